@@ -0,0 +1,187 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <vector>
+#include "BinaryUnrolls.h"
+
+using namespace std;
+
+// Identifier and version of the binary format
+static const char c_binaryUnrollsMagic[8] = "UNROLLS";
+static const int c_binaryUnrollsVersion = 2;
+
+
+/**
+ * Size of the binary file
+ */
+size_t BinaryUnrolls::FileSize(const Header &header) {
+  return sizeof(Header)
+  + ((size_t)header.numSentences + 1) * sizeof(int)
+  + ((size_t)header.numUnrolls + 1) * sizeof(int)
+  + (size_t)header.numTokens * sizeof(Token);
+}
+
+
+/**
+ * Check a table of numRanges + 1 offsets delimiting consecutive ranges
+ * of numItems items: it starts at 0, ends at numItems and never decreases
+ */
+bool BinaryUnrolls::AreOffsetsValid(const int *offsets,
+                                    int numRanges,
+                                    int numItems) {
+  if ((offsets[0] != 0) || (offsets[numRanges] != numItems)) {
+    return false;
+  }
+  for (int k = 0; k < numRanges; k++) {
+    if (offsets[k + 1] < offsets[k]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Check the indexes of the words (out-of-vocabulary words are mapped
+ * to <unk>) and of the label (-1 for unknown labels), and the number
+ * of occurrences of a token (which is inverted into its discount)
+ */
+bool BinaryUnrolls::IsTokenValid(const Token &token,
+                                 int numWords,
+                                 int numLabels) {
+  return (token.wordAsContext >= 0) && (token.wordAsContext < numWords)
+  && (token.wordAsTarget >= 0) && (token.wordAsTarget < numWords)
+  && (token.label >= -1) && (token.label < numLabels)
+  && (token.numOccurrences >= 1);
+}
+
+
+/**
+ * Write a book to a binary file (first to a temporary file,
+ * which is then renamed, so that the binary file is always complete)
+ */
+bool BinaryUnrolls::Write(const string &filename,
+                          const BookUnrolls &book,
+                          unsigned long long vocabularyHash,
+                          bool mergeLabel) {
+  Header header;
+  memset(&header, 0, sizeof(Header));
+  memcpy(header.magic, c_binaryUnrollsMagic, sizeof(header.magic));
+  header.version = c_binaryUnrollsVersion;
+  header.mergeLabel = mergeLabel ? 1 : 0;
+  header.vocabularyHash = vocabularyHash;
+  header.numSentences = book.NumSentences();
+  header.numUnrolls = (int)book.UnrollOffsets().size() - 1;
+  header.numTokens = (int)book.NumTokens();
+
+  string tmpFilename = filename + ".tmp";
+  FILE *file = fopen(tmpFilename.c_str(), "wb");
+  if (file == NULL) {
+    cout << "Cannot write binary book " << filename << endl;
+    return false;
+  }
+  const vector<int> &sentenceOffsets = book.SentenceOffsets();
+  const vector<int> &unrollOffsets = book.UnrollOffsets();
+  const vector<Token> &tokens = book.Tokens();
+  bool isWritten =
+  (fwrite(&header, sizeof(Header), 1, file) == 1)
+  && (fwrite(sentenceOffsets.data(), sizeof(int),
+             sentenceOffsets.size(), file) == sentenceOffsets.size())
+  && (fwrite(unrollOffsets.data(), sizeof(int),
+             unrollOffsets.size(), file) == unrollOffsets.size())
+  && (fwrite(tokens.data(), sizeof(Token),
+             tokens.size(), file) == tokens.size());
+  isWritten = (fclose(file) == 0) && isWritten;
+  if (!isWritten || (rename(tmpFilename.c_str(), filename.c_str()) != 0)) {
+    cout << "Cannot write binary book " << filename << endl;
+    remove(tmpFilename.c_str());
+    return false;
+  }
+  cout << "Wrote binary book " << filename << endl;
+  return true;
+}
+
+
+/**
+ * Map a binary file in memory, check its arrays, then copy them
+ * into the book (the book owns its arrays, so that the mapping
+ * can be released right away).
+ * Returns false if the file does not exist, is invalid,
+ * or was converted with another vocabulary.
+ */
+bool BinaryUnrolls::Read(const string &filename,
+                         BookUnrolls &book,
+                         unsigned long long vocabularyHash,
+                         bool mergeLabel,
+                         int numWords,
+                         int numLabels) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat fileStat;
+  if ((fstat(fd, &fileStat) != 0) || (fileStat.st_size < (off_t)sizeof(Header))) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)fileStat.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  // Check that the file matches the current vocabulary
+  const Header *header = (const Header *)data;
+  if ((memcmp(header->magic, c_binaryUnrollsMagic, sizeof(header->magic)) != 0)
+      || (header->version != c_binaryUnrollsVersion)
+      || (header->mergeLabel != (mergeLabel ? 1 : 0))
+      || (header->vocabularyHash != vocabularyHash)
+      || (header->numSentences < 0) || (header->numUnrolls < 0)
+      || (header->numTokens < 0)
+      || (FileSize(*header) != size)) {
+    cout << "Binary book " << filename
+         << " is invalid or uses another vocabulary\n";
+    munmap(data, size);
+    return false;
+  }
+
+  // Locate the arrays
+  int numSentences = header->numSentences;
+  int numUnrolls = header->numUnrolls;
+  int numTokens = header->numTokens;
+  const int *sentenceOffsets = (const int *)(header + 1);
+  const int *unrollOffsets = sentenceOffsets + numSentences + 1;
+  const Token *tokens = (const Token *)(unrollOffsets + numUnrolls + 1);
+  // Check the arrays once, so that the views of the sentences
+  // and unrolls of the book never read outside of them
+  bool isValid = AreOffsetsValid(sentenceOffsets, numSentences, numUnrolls)
+  && AreOffsetsValid(unrollOffsets, numUnrolls, numTokens);
+  for (int k = 0; isValid && (k < numTokens); k++) {
+    isValid = IsTokenValid(tokens[k], numWords, numLabels);
+  }
+  if (!isValid) {
+    cout << "Binary book " << filename << " is invalid\n";
+    munmap(data, size);
+    return false;
+  }
+
+  // Copy the arrays into the book
+  book.Assign(sentenceOffsets, numSentences,
+              unrollOffsets, numUnrolls,
+              tokens, numTokens);
+  munmap(data, size);
+  cout << "Read binary book " << filename << " ("
+       << numSentences << " sentences; " << numTokens << " tokens)\n";
+  return true;
+}
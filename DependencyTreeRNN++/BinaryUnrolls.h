@@ -0,0 +1,82 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____BinaryUnrolls__
+#define __DependencyTreeRNN____BinaryUnrolls__
+
+#include <string>
+#include "CorpusUnrollsReader.h"
+
+
+/**
+ * Pre-tokenized binary format of a book (.unrolls.bin), where the words
+ * and labels are already replaced by their indexes in the vocabulary.
+ * The file contains a header, recording the hash of the vocabulary
+ * the book was converted with, followed by the flat arrays of the book:
+ * the offsets of the sentences in the unrolls (numSentences + 1),
+ * the offsets of the unrolls in the tokens (numUnrolls + 1),
+ * then the tokens (16-byte records).
+ */
+class BinaryUnrolls {
+public:
+
+  /**
+   * Write a book to a binary file
+   */
+  static bool Write(const std::string &filename,
+                    const BookUnrolls &book,
+                    unsigned long long vocabularyHash,
+                    bool mergeLabel);
+
+  /**
+   * Map a binary file in memory, check its arrays (offsets within bounds
+   * and in increasing order, indexes of the words below numWords
+   * and of the labels below numLabels), then copy them into the book.
+   * Returns false if the file does not exist, is invalid,
+   * or was converted with another vocabulary.
+   */
+  static bool Read(const std::string &filename,
+                   BookUnrolls &book,
+                   unsigned long long vocabularyHash,
+                   bool mergeLabel,
+                   int numWords,
+                   int numLabels);
+
+protected:
+
+  /**
+   * Header of the binary file
+   */
+  struct Header {
+    char magic[8];
+    int version;
+    int mergeLabel;
+    unsigned long long vocabularyHash;
+    int numSentences;
+    int numUnrolls;
+    int numTokens;
+    int padding;
+  };
+
+  /**
+   * Size of the binary file
+   */
+  static size_t FileSize(const Header &header);
+
+  /**
+   * Check a table of numRanges + 1 offsets delimiting consecutive ranges
+   * of numItems items: it starts at 0, ends at numItems and never decreases
+   */
+  static bool AreOffsetsValid(const int *offsets, int numRanges, int numItems);
+
+  /**
+   * Check the indexes of the words and of the label
+   * and the number of occurrences of a token
+   */
+  static bool IsTokenValid(const Token &token, int numWords, int numLabels);
+};
+
+#endif /* defined(__DependencyTreeRNN____BinaryUnrolls__) */
@@ -0,0 +1,157 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include "BinaryVocabulary.h"
+
+using namespace std;
+
+// Identifier and version of the binary format
+static const char c_binaryVocabularyMagic[8] = "VOCABIN";
+static const int c_binaryVocabularyVersion = 1;
+
+
+/**
+ * Size of a table in the binary file
+ * (the blob of strings is padded to 8 bytes)
+ */
+size_t BinaryVocabulary::TableSize(const TableHeader &table) {
+  return (size_t)table.numStrings * sizeof(double)
+  + ((size_t)table.numStrings + 1) * sizeof(int)
+  + (size_t)table.numSlots * sizeof(int)
+  + (((size_t)table.blobSize + 7) & ~(size_t)7);
+}
+
+
+/**
+ * Write the tables of words and labels to a binary file
+ * (first to a temporary file, which is then renamed,
+ * so that the binary file is always complete)
+ */
+bool BinaryVocabulary::Write(const string &filename,
+                             long long textSize,
+                             long long textModificationTime,
+                             const StringTable &words,
+                             const StringTable &labels) {
+  const StringTable *tables[2] = {&words, &labels};
+  Header header;
+  memset(&header, 0, sizeof(Header));
+  memcpy(header.magic, c_binaryVocabularyMagic, sizeof(header.magic));
+  header.version = c_binaryVocabularyVersion;
+  header.textSize = textSize;
+  header.textModificationTime = textModificationTime;
+  for (int t = 0; t < 2; t++) {
+    header.tables[t].blobSize = (long long)tables[t]->Blob().size();
+    header.tables[t].numStrings = tables[t]->Size();
+    header.tables[t].numSlots = (int)tables[t]->Slots().size();
+  }
+
+  string tmpFilename = filename + ".tmp";
+  FILE *file = fopen(tmpFilename.c_str(), "wb");
+  if (file == NULL) {
+    cout << "Cannot write binary vocabulary " << filename << endl;
+    return false;
+  }
+  bool isWritten = (fwrite(&header, sizeof(Header), 1, file) == 1);
+  for (int t = 0; (t < 2) && isWritten; t++) {
+    const StringTable &table = *(tables[t]);
+    static const char c_padding[8] = {0};
+    size_t blobPadding = (8 - (table.Blob().size() & 7)) & 7;
+    isWritten =
+    (fwrite(table.Counts().data(), sizeof(double),
+            table.Counts().size(), file) == table.Counts().size())
+    && (fwrite(table.Offsets().data(), sizeof(int),
+               table.Offsets().size(), file) == table.Offsets().size())
+    && (fwrite(table.Slots().data(), sizeof(int),
+               table.Slots().size(), file) == table.Slots().size())
+    && (fwrite(table.Blob().data(), 1,
+               table.Blob().size(), file) == table.Blob().size())
+    && (fwrite(c_padding, 1, blobPadding, file) == blobPadding);
+  }
+  isWritten = (fclose(file) == 0) && isWritten;
+  if (!isWritten || (rename(tmpFilename.c_str(), filename.c_str()) != 0)) {
+    cout << "Cannot write binary vocabulary " << filename << endl;
+    remove(tmpFilename.c_str());
+    return false;
+  }
+  cout << "Wrote binary vocabulary " << filename << endl;
+  return true;
+}
+
+
+/**
+ * Map a binary file in memory and copy its arrays into the tables.
+ * Returns false if the file does not exist, is invalid,
+ * or was made from another version of the text file.
+ */
+bool BinaryVocabulary::Read(const string &filename,
+                            long long textSize,
+                            long long textModificationTime,
+                            StringTable &words,
+                            StringTable &labels) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat fileStat;
+  if ((fstat(fd, &fileStat) != 0) || (fileStat.st_size < (off_t)sizeof(Header))) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)fileStat.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  // Check that the file was made from the current text file
+  const Header *header = (const Header *)data;
+  bool isValid =
+  (memcmp(header->magic, c_binaryVocabularyMagic, sizeof(header->magic)) == 0)
+  && (header->version == c_binaryVocabularyVersion)
+  && (header->textSize == textSize)
+  && (header->textModificationTime == textModificationTime);
+  size_t expectedSize = sizeof(Header);
+  for (int t = 0; (t < 2) && isValid; t++) {
+    const TableHeader &table = header->tables[t];
+    isValid = (table.numStrings >= 0) && (table.numSlots >= 0)
+    && (table.blobSize >= 0) && (table.blobSize <= (long long)size);
+    if (isValid) {
+      expectedSize += TableSize(table);
+    }
+  }
+  isValid = isValid && (expectedSize == size);
+
+  // Copy the arrays of each table
+  StringTable *tables[2] = {&words, &labels};
+  const char *cursor = (const char *)(header + 1);
+  for (int t = 0; (t < 2) && isValid; t++) {
+    const TableHeader &table = header->tables[t];
+    const double *counts = (const double *)cursor;
+    const int *offsets = (const int *)(counts + table.numStrings);
+    const int *slots = offsets + table.numStrings + 1;
+    const char *blob = (const char *)(slots + table.numSlots);
+    isValid = tables[t]->Assign(blob, (size_t)table.blobSize,
+                                offsets, counts, table.numStrings,
+                                slots, table.numSlots);
+    cursor += TableSize(table);
+  }
+  munmap(data, size);
+  if (!isValid) {
+    cout << "Binary vocabulary " << filename
+         << " is invalid or out of date\n";
+    return false;
+  }
+  cout << "Read binary vocabulary " << filename << endl;
+  return true;
+}
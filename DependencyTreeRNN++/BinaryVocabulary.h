@@ -0,0 +1,73 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____BinaryVocabulary__
+#define __DependencyTreeRNN____BinaryVocabulary__
+
+#include <string>
+#include "StringTable.h"
+
+
+/**
+ * Binary cache (.bin) of a vocabulary text file: the arrays of the
+ * tables of words and labels, as they were imported from the text file.
+ * The file contains a header, recording the size and modification time
+ * of the text file, followed for each table by its counts, offsets,
+ * hash table slots and blob of strings (padded to 8 bytes).
+ */
+class BinaryVocabulary {
+public:
+
+  /**
+   * Write the tables of words and labels to a binary file
+   */
+  static bool Write(const std::string &filename,
+                    long long textSize,
+                    long long textModificationTime,
+                    const StringTable &words,
+                    const StringTable &labels);
+
+  /**
+   * Map a binary file in memory and copy its arrays into the tables.
+   * Returns false if the file does not exist, is invalid,
+   * or was made from another version of the text file.
+   */
+  static bool Read(const std::string &filename,
+                   long long textSize,
+                   long long textModificationTime,
+                   StringTable &words,
+                   StringTable &labels);
+
+protected:
+
+  /**
+   * Sizes of a table in the binary file
+   */
+  struct TableHeader {
+    long long blobSize;
+    int numStrings;
+    int numSlots;
+  };
+
+  /**
+   * Header of the binary file
+   */
+  struct Header {
+    char magic[8];
+    int version;
+    int padding;
+    long long textSize;
+    long long textModificationTime;
+    TableHeader tables[2];
+  };
+
+  /**
+   * Size of a table in the binary file
+   */
+  static size_t TableSize(const TableHeader &table);
+};
+
+#endif /* defined(__DependencyTreeRNN____BinaryVocabulary__) */
@@ -0,0 +1,88 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <utility>
+#include "BookPrefetcher.h"
+
+using namespace std;
+
+
+/**
+ * Constructor: start reading the books
+ */
+BookPrefetcher::BookPrefetcher(CorpusUnrolls &corpus,
+                               bool mergeLabel,
+                               int numBooksAhead,
+                               int numBooks)
+: m_corpus(corpus),
+m_mergeLabel(mergeLabel),
+m_numBooksAhead((numBooksAhead < 0) ? 0 : numBooksAhead),
+m_numBooks((numBooks < 0) ? corpus.NumBooks() : numBooks),
+m_isStopped(false) {
+  if (m_numBooksAhead > 0) {
+    m_thread = thread(&BookPrefetcher::ReadBooks, this);
+  }
+}
+
+
+/**
+ * Destructor: stop reading the books
+ * (after the book being read, if any)
+ */
+BookPrefetcher::~BookPrefetcher() {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_isStopped = true;
+  }
+  m_condition.notify_all();
+  if (m_thread.joinable()) {
+    m_thread.join();
+  }
+}
+
+
+/**
+ * Read all the books on the background thread,
+ * waiting while m_numBooksAhead books are not taken
+ */
+void BookPrefetcher::ReadBooks() {
+  for (int k = 0; k < m_numBooks; k++) {
+    {
+      unique_lock<mutex> lock(m_mutex);
+      m_condition.wait(lock, [this] {
+        return m_isStopped || ((int)m_books.size() < m_numBooksAhead);
+      });
+      if (m_isStopped) {
+        return;
+      }
+    }
+    BookUnrolls book;
+    m_corpus.ReadBook(m_corpus.NextBook(), m_mergeLabel, book);
+    {
+      lock_guard<mutex> lock(m_mutex);
+      m_books.push_back(move(book));
+    }
+    m_condition.notify_all();
+  }
+}
+
+
+/**
+ * Wait for the next book and move it into book
+ */
+void BookPrefetcher::NextBook(BookUnrolls &book) {
+  if (m_numBooksAhead == 0) {
+    m_corpus.ReadBook(m_corpus.NextBook(), m_mergeLabel, book);
+    return;
+  }
+  {
+    unique_lock<mutex> lock(m_mutex);
+    m_condition.wait(lock, [this] { return !m_books.empty(); });
+    book = move(m_books.front());
+    m_books.pop_front();
+  }
+  m_condition.notify_all();
+}
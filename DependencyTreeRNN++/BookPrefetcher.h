@@ -0,0 +1,75 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____BookPrefetcher__
+#define __DependencyTreeRNN____BookPrefetcher__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "CorpusUnrollsReader.h"
+
+
+/**
+ * Read the books of a corpus, in the order in which they are visited
+ * (one pass over all the books, or over the given number of books,
+ * starting after the current book),
+ * on a background thread that stays up to a given number of books
+ * ahead of the reader, so that parsing overlaps with training or testing.
+ * The books are handed over by move. With 0 books ahead,
+ * each book is simply read when it is requested.
+ */
+class BookPrefetcher {
+public:
+
+  /**
+   * Constructor: start reading the books
+   * (all the books of the corpus when numBooks is negative)
+   */
+  BookPrefetcher(CorpusUnrolls &corpus, bool mergeLabel, int numBooksAhead,
+                 int numBooks = -1);
+
+  /**
+   * Destructor: stop reading the books
+   */
+  ~BookPrefetcher();
+
+  /**
+   * Wait for the next book and move it into book
+   */
+  void NextBook(BookUnrolls &book);
+
+protected:
+
+  /**
+   * Read all the books on the background thread
+   */
+  void ReadBooks();
+
+  // Corpus whose books are read
+  CorpusUnrolls &m_corpus;
+  bool m_mergeLabel;
+
+  // Maximum number of books read ahead
+  int m_numBooksAhead;
+
+  // Number of books to read
+  int m_numBooks;
+
+  // Books already read, waiting to be taken
+  std::deque<BookUnrolls> m_books;
+
+  // Has the reading been stopped?
+  bool m_isStopped;
+
+  // Synchronization between the background thread and the reader
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+};
+
+#endif /* defined(__DependencyTreeRNN____BookPrefetcher__) */
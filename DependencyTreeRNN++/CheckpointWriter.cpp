@@ -0,0 +1,148 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <stdio.h>
+#include <unistd.h>
+#include "CheckpointWriter.h"
+#include "MappedModel.h"
+
+using namespace std;
+
+
+/**
+ * Constructor: start the background thread
+ */
+CheckpointWriter::CheckpointWriter()
+: m_isPending(false),
+m_isStopped(false) {
+  m_thread = thread(&CheckpointWriter::WriteCheckpoints, this);
+}
+
+
+/**
+ * Destructor: finish writing the last checkpoint, then stop the thread
+ */
+CheckpointWriter::~CheckpointWriter() {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_isStopped = true;
+  }
+  m_condition.notify_all();
+  if (m_thread.joinable()) {
+    m_thread.join();
+  }
+}
+
+
+/**
+ * Wait until the previous checkpoint is written, take a snapshot
+ * of the model and write it to a file on the background thread
+ */
+void CheckpointWriter::Save(RnnLM &model,
+                            const string &filename,
+                            const string &embeddingsFilename,
+                            const string &resumeState) {
+  Wait();
+  // Fold the scales of the lazily decayed weights into the weights,
+  // as when the model was saved synchronously
+  model.m_weights.Renormalize();
+  // The buffers of the snapshot are only accessed by the background
+  // thread while a checkpoint is pending
+  if (m_snapshot == NULL) {
+    m_snapshot.reset(new RnnLM(model));
+  } else {
+    model.UpdateSnapshot(*m_snapshot);
+  }
+  if (!resumeState.empty()) {
+    m_snapshot->SetModelVersion(c_mappedModelVersion);
+  }
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_filename = filename;
+    m_embeddingsFilename = embeddingsFilename;
+    m_resumeState = resumeState;
+    m_isPending = true;
+  }
+  m_condition.notify_all();
+}
+
+
+/**
+ * Wait until the last checkpoint is written
+ */
+void CheckpointWriter::Wait() {
+  unique_lock<mutex> lock(m_mutex);
+  m_condition.wait(lock, [this] { return !m_isPending; });
+}
+
+
+/**
+ * Is a checkpoint being written?
+ */
+bool CheckpointWriter::IsBusy() {
+  lock_guard<mutex> lock(m_mutex);
+  return m_isPending;
+}
+
+
+/**
+ * Write a text file (to a temporary file, flushed to disk then renamed)
+ */
+bool CheckpointWriter::WriteTextFile(const string &filename,
+                                     const string &text) {
+  string tmpFilename = filename + ".tmp";
+  FILE *fo = fopen(tmpFilename.c_str(), "wb");
+  if (fo == NULL) {
+    printf("Cannot create file %s\n", tmpFilename.c_str());
+    return false;
+  }
+  bool isWritten = (fwrite(text.data(), 1, text.size(), fo) == text.size())
+  && (fflush(fo) == 0) && (fsync(fileno(fo)) == 0);
+  isWritten = (fclose(fo) == 0) && isWritten;
+  if (!isWritten || (rename(tmpFilename.c_str(), filename.c_str()) != 0)) {
+    printf("Cannot write file %s\n", filename.c_str());
+    remove(tmpFilename.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Write the checkpoints on the background thread,
+ * until the thread is stopped and no checkpoint is pending
+ */
+void CheckpointWriter::WriteCheckpoints() {
+  while (true) {
+    string filename;
+    string embeddingsFilename;
+    string resumeState;
+    {
+      unique_lock<mutex> lock(m_mutex);
+      m_condition.wait(lock, [this] { return m_isStopped || m_isPending; });
+      if (!m_isPending) {
+        return;
+      }
+      filename = m_filename;
+      embeddingsFilename = m_embeddingsFilename;
+      resumeState = m_resumeState;
+    }
+    bool isSaved = m_snapshot->SaveRnnModelToFile(filename);
+    if (!embeddingsFilename.empty()) {
+      m_snapshot->SaveWordEmbeddings(embeddingsFilename);
+    }
+    // The state of the training is written after the model,
+    // and records its position, so that a mismatch can be detected
+    if (isSaved && !resumeState.empty()) {
+      WriteTextFile(filename + ".resume", resumeState);
+    }
+    {
+      lock_guard<mutex> lock(m_mutex);
+      m_isPending = false;
+    }
+    m_condition.notify_all();
+  }
+}
@@ -0,0 +1,103 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____CheckpointWriter__
+#define __DependencyTreeRNN____CheckpointWriter__
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "RnnLib.h"
+
+
+/**
+ * Save checkpoints of a model during training on a background thread.
+ * Each checkpoint is a snapshot of the model, so that training only stops
+ * for the copy and continues while the snapshot is written to disk.
+ * The first checkpoint copies the whole model; the next ones only copy
+ * the weights, the hidden layer and the state of the training
+ * (the vocabulary does not change during training) into the buffers
+ * of the same snapshot. At most one checkpoint is written at a time.
+ */
+class CheckpointWriter {
+public:
+
+  /**
+   * Constructor: start the background thread
+   */
+  CheckpointWriter();
+
+  /**
+   * Destructor: finish writing the last checkpoint, then stop the thread
+   */
+  ~CheckpointWriter();
+
+  /**
+   * Wait until the previous checkpoint is written, take a snapshot
+   * of the model and write it to a file on the background thread,
+   * as well as the word embeddings if embeddingsFilename is not empty.
+   * Before the snapshot, the lazy weight decay of the model is folded
+   * into its weights (RnnWeights::Renormalize), so Save modifies
+   * the weights being trained and must not be called while other
+   * threads update them.
+   * If resumeState is not empty, the checkpoint is one from which
+   * training can resume exactly: the model is written in the memory-mapped
+   * format (which keeps the weights in full precision), then resumeState
+   * (the state of the training) is written to filename + ".resume".
+   */
+  void Save(RnnLM &model,
+            const std::string &filename,
+            const std::string &embeddingsFilename,
+            const std::string &resumeState = std::string());
+
+  /**
+   * Wait until the last checkpoint is written
+   */
+  void Wait();
+
+  /**
+   * Is a checkpoint being written?
+   */
+  bool IsBusy();
+
+protected:
+
+  /**
+   * Write the checkpoints on the background thread
+   */
+  void WriteCheckpoints();
+
+  /**
+   * Write a text file (to a temporary file, flushed to disk then renamed)
+   */
+  static bool WriteTextFile(const std::string &filename,
+                            const std::string &text);
+
+  // Snapshot of the model being written, allocated with the first checkpoint
+  std::unique_ptr<RnnLM> m_snapshot;
+
+  // Files of the checkpoint being written
+  std::string m_filename;
+  std::string m_embeddingsFilename;
+
+  // State of the training saved with the checkpoint, if any
+  std::string m_resumeState;
+
+  // Is there a checkpoint being written?
+  bool m_isPending;
+
+  // Has the thread been stopped?
+  bool m_isStopped;
+
+  // Synchronization between the background thread and the trainer
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+};
+
+#endif /* defined(__DependencyTreeRNN____CheckpointWriter__) */
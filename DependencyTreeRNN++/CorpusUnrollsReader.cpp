@@ -5,6 +5,8 @@
 // ACL 2015
 
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <climits>
 #include <cmath>
 #include <algorithm>
@@ -14,6 +16,9 @@
 #include <assert.h>
 #include "CorpusUnrollsReader.h"
 #include "ReadJson.h"
+#include "BinaryUnrolls.h"
+#include "BinaryVocabulary.h"
+#include "WorkStealingScheduler.h"
 
 using namespace std;
 
@@ -22,41 +27,48 @@ using namespace std;
  */
 void BookUnrolls::AddToken(bool isNewSentence, bool isNewUnroll,
                            int pos, int wordAsContext, int wordAsTarget,
-                           double discount, int label) {
+                           double numOccurrences, int label) {
   
-  // Add a new sentence?
+  // Add a new (empty) sentence?
   if (isNewSentence) {
-    Sentence s;
-    _sentences.push_back(s);
-    _numUnrollsInSentence.push_back(0);
-    vector<int> v;
-    _numTokensInUnrollSentence.push_back(v);
+    _sentenceOffsets.push_back(_sentenceOffsets.back());
     // Bookkeeping of sentences and unrolls
-    _numSentences++;
-    _sentenceIndex = _numSentences - 1;
+    _sentenceIndex = NumSentences() - 1;
     _unrollIndex = 0;
     _tokenIndex = 0;
   }
-  // Add a new unroll?
+  // Add a new (empty) unroll to the current sentence?
   if (isNewUnroll) {
-    Unroll u;
-    _sentences[_sentenceIndex].push_back(u);
+    _unrollOffsets.push_back(_unrollOffsets.back());
+    _sentenceOffsets.back()++;
     // Bookkeeping of unrolls
-    _numUnrollsInSentence[_sentenceIndex]++;
-    _unrollIndex = _numUnrollsInSentence[_sentenceIndex] - 1;
-    _numTokensInUnrollSentence[_sentenceIndex].push_back(0);
+    _unrollIndex = NumUnrolls(_sentenceIndex) - 1;
     _tokenIndex = 0;
   }
-  // Add a new token
+  // Add a new token to the current unroll
+  assert((pos >= 0) && (pos <= USHRT_MAX));
+  assert((label >= SHRT_MIN) && (label <= SHRT_MAX));
   Token newToken;
-  newToken.pos = pos;
+  newToken.pos = (unsigned short)pos;
   newToken.wordAsContext = wordAsContext;
   newToken.wordAsTarget = wordAsTarget;
-  newToken.discount = discount;
-  newToken.label = label;
-  _sentences[_sentenceIndex][_unrollIndex].push_back(newToken);
-  _numTokensInUnrollSentence[_sentenceIndex][_unrollIndex]++;
-  _numTokens++;
+  newToken.numOccurrences = (float)numOccurrences;
+  newToken.label = (short)label;
+  _tokens.push_back(newToken);
+  _unrollOffsets.back()++;
+}
+
+
+/**
+ * Replace the content of the book by the given tokens and offset tables
+ */
+void BookUnrolls::Assign(const int *sentenceOffsets, int numSentences,
+                         const int *unrollOffsets, int numUnrolls,
+                         const Token *tokens, int numTokens) {
+  Burn();
+  _sentenceOffsets.assign(sentenceOffsets, sentenceOffsets + numSentences + 1);
+  _unrollOffsets.assign(unrollOffsets, unrollOffsets + numUnrolls + 1);
+  _tokens.assign(tokens, tokens + numTokens);
 }
 
 
@@ -65,7 +77,7 @@ void BookUnrolls::AddToken(bool isNewSentence, bool isNewUnroll,
  */
 bool BookUnrolls::GoToSentence(int n) {
   // Sanity check
-  if ((n < 0) || (n >= _numSentences)) {
+  if ((n < 0) || (n >= NumSentences())) {
     return false;
   }
   // Set the new sentence
@@ -81,7 +93,7 @@ bool BookUnrolls::GoToSentence(int n) {
  */
 int BookUnrolls::NextSentence() {
   // Set the new sentence by incrementing its index
-  if (_sentenceIndex >= (_numSentences - 1)) {
+  if (_sentenceIndex >= (NumSentences() - 1)) {
     // Return to sentence 0
     ResetSentence();
   } else {
@@ -98,7 +110,7 @@ int BookUnrolls::NextSentence() {
  * Go to the next unroll in the sentence
  */
 int BookUnrolls::NextUnrollInSentence() {
-  int n_unrolls = _numUnrollsInSentence[_sentenceIndex];
+  int n_unrolls = NumUnrolls(_sentenceIndex);
   if (_unrollIndex >= (n_unrolls - 1)) {
     // Return to unroll 0 in the current sentence...
     ResetUnroll();
@@ -122,9 +134,9 @@ int BookUnrolls::NextTokenInUnroll() {
   if (_tokenIndex < 0)
     return -1;
   // Number of tokens in sentence
-  int _numTokens = _numTokensInUnrollSentence[_sentenceIndex][_unrollIndex];
+  int numTokens = NumTokens(_sentenceIndex, _unrollIndex);
   // Go to the next token or stop
-  if (_tokenIndex < (_numTokens - 1)) {
+  if (_tokenIndex < (numTokens - 1)) {
     _tokenIndex++;
     UpdateCurrentToken();
   } else {
@@ -134,6 +146,43 @@ int BookUnrolls::NextTokenInUnroll() {
 }
 
 
+/**
+ * Build the trie from all the unrolls of a sentence
+ */
+void SentenceTrie::Build(const Sentence &sentence) {
+  _nodes.assign(1, Node());
+  _nodeOfToken.resize(sentence.size());
+  for (size_t k = 0; k < sentence.size(); k++) {
+    const Unroll &unroll = sentence[k];
+    _nodeOfToken[k].resize(unroll.size());
+    int node = 0;
+    for (size_t j = 0; j < unroll.size(); j++) {
+      const Token &token = unroll[j];
+      // Look for the child keyed by (context word, label, position)
+      int child = -1;
+      const vector<int> &children = _nodes[node].children;
+      for (size_t c = 0; (c < children.size()) && (child < 0); c++) {
+        const Token &other = _nodes[children[c]].token;
+        if ((other.wordAsContext == token.wordAsContext) &&
+            (other.label == token.label) &&
+            (other.pos == token.pos)) {
+          child = children[c];
+        }
+      }
+      // Otherwise, branch out with a new node
+      if (child < 0) {
+        child = (int)(_nodes.size());
+        _nodes.push_back(Node());
+        _nodes[child].token = token;
+        _nodes[node].children.push_back(child);
+      }
+      _nodeOfToken[k][j] = child;
+      node = child;
+    }
+  }
+}
+
+
 /**
  * Custom comparator for sorting a vector<pair<string, double>>
  * by values
@@ -151,10 +200,8 @@ struct reverseSortByValue {
  */
 void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
   
-  // Copy the labels as they are
-  for (int k = 0; k < other.NumLabels(); k++) {
-    InsertLabel(other.labelsReverse[k]);
-  }
+  // Share the labels as they are
+  _labels = other._labels;
   
   // Initialize a vector of filtered word counts
   // that contains OOV and EOS
@@ -169,8 +216,8 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
   // Note that we start the indexing at 3 because we already stored
   // <unk> and </s>
   for (int k = 2; k < other.NumWords(); k++) {
-    string word = other.vocabularyReverse[k];
-    double wordFreq = ceil(other.wordCountsDiscounted[k]);
+    const char *word = other.Word(k);
+    double wordFreq = ceil(other.WordCount(k));
     if (wordFreq >= _minWordOccurrence) {
       pair<string, double> p(word, wordFreq);
       filteredWords.push_back(p);
@@ -190,12 +237,8 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
        filteredWords.end(),
        reverseSortByValue());
   
-  // Completely clear the corpus word vocabulary
-  // (not the labels)
-  vocabulary.clear();
-  vocabularyReverse.clear();
-  wordCountsDiscounted.clear();
-  _vocabSizeWords = 0;
+  // Start a new word vocabulary
+  _words = make_shared<StringTable>();
 
   // Now we can set the number of </s> tokens to 0
   // (it never happens, because of the tree parsing)
@@ -203,43 +246,30 @@ void CorpusUnrolls::FilterSortVocabulary(CorpusUnrolls &other) {
   
   // Copy the content of that vector
   for (int k = 0; k < filteredWords.size(); k++) {
-    string word = filteredWords[k].first;
-    double wordFreq = filteredWords[k].second;
-    InsertWord(word, wordFreq);
+    InsertWord(filteredWords[k].first, filteredWords[k].second);
   }
   // Note the OOV tag
-  _oov = vocabulary["<unk>"];
+  _oov = max(_words->Find("<unk>"), 0);
 }
 
 
 /**
- * Copy the vocabulary from another corpus
+ * Share the vocabulary of another corpus (which is not copied)
  */
 void CorpusUnrolls::CopyVocabulary(CorpusUnrolls &other) {
-  
-  // Completely clear the corpus word vocabulary and labels
-  labels.clear();
-  labelsReverse.clear();
-  vocabulary.clear();
-  vocabularyReverse.clear();
-  wordCountsDiscounted.clear();
-  _vocabSizeWords = 0;
-  _vocabSizeLabels = 0;
-
-  // Copy the labels as they are
-  for (int k = 0; k < other.NumLabels(); k++) {
-    InsertLabel(other.labelsReverse[k]);
-  }
-  
-  // Insert the words from the other corpus into the vocabulary
-  for (int k = 0; k < other.NumWords(); k++) {
-    string word = other.vocabularyReverse[k];
-    double wordFreq = other.wordCountsDiscounted[k];
-    InsertWord(word, wordFreq);
-  }
+  _words = other._words;
+  _labels = other._labels;
+  _oov = other._oov;
+}
 
-  // Note the OOV tag
-  _oov = vocabulary["<unk>"];
+
+/**
+ * Release the vocabulary (e.g., once it has been filtered into another corpus)
+ */
+void CorpusUnrolls::ReleaseVocabulary() {
+  _words = make_shared<StringTable>();
+  _labels = make_shared<StringTable>();
+  _oov = 0;
 }
 
 
@@ -252,78 +282,87 @@ void CorpusUnrolls::ExportVocabulary(const string &filename) {
   vocabFile << NumWords() << "\t" << NumLabels() << "\n";
   // Write the labels
   for (int k = 0; k < NumLabels(); k++) {
-    vocabFile << k << "\t" << labelsReverse[k] << "\n";
+    vocabFile << k << "\t" << Label(k) << "\n";
   }
   // Write the words and their discount factors
   for (int k = 0; k < NumWords(); k++) {
-    vocabFile << k << "\t" << vocabularyReverse[k]
-    << "\t" << wordCountsDiscounted[k] << "\n";
+    vocabFile << k << "\t" << Word(k)
+    << "\t" << WordCount(k) << "\n";
   }
   vocabFile.close();
 }
 
 
 /**
- * Import the vocabulary from a text file
+ * Import the vocabulary from a text file, or from its binary cache
+ * (.bin), which is written the first time the text file is imported
  */
 void CorpusUnrolls::ImportVocabulary(const string &filename) {
 
-  // Read the header
-  ifstream vocabFile(filename);
-  cout << "Reading vocabulary file " << filename << endl;
-  assert(vocabFile.is_open());
-
-  // Completely clear the corpus word vocabulary and labels
-  labels.clear();
-  labelsReverse.clear();
-  vocabulary.clear();
-  vocabularyReverse.clear();
-  wordCountsDiscounted.clear();
-  _vocabSizeWords = 0;
-  _vocabSizeLabels = 0;
-
-  // Read the header line
-  string line;
-  getline(vocabFile, line);
-  stringstream lineStream(line);
-  string strNumWords;
-  string strNumLabels;
-  getline(lineStream, strNumWords, '\t');
-  getline(lineStream, strNumLabels);
-  int numWords = stoi(strNumWords);
-  int numLabels = stoi(strNumLabels);
-  cout << "Vocabulary file contains " << numWords << " words and "
-  << numLabels << " labels\n";
-
-  // Read the labels one by one
-  for (int k = 0; k < numLabels; k++) {
-    getline(vocabFile, line);
-    stringstream lineStream(line);
-    string strIdx;
-    string label;
-    getline(lineStream, strIdx, '\t');
-    getline(lineStream, label);
-    InsertLabel(label);
-  }
+  // Start a new vocabulary of words and labels
+  _words = make_shared<StringTable>();
+  _labels = make_shared<StringTable>();
+
+  // The binary cache is valid for a given size and modification time
+  // of the text file
+  struct stat textStat;
+  bool hasTextStat = (stat(filename.c_str(), &textStat) == 0);
+  string binaryFilename = filename + ".bin";
+  if (hasTextStat &&
+      BinaryVocabulary::Read(binaryFilename,
+                             (long long)textStat.st_size,
+                             (long long)textStat.st_mtime,
+                             *_words, *_labels)) {
+    cout << "Vocabulary file " << filename << " read from its binary cache\n";
+  } else {
+    // (a failed read may have filled part of the tables)
+    _words = make_shared<StringTable>();
+    _labels = make_shared<StringTable>();
+
+    // Read the header
+    ifstream vocabFile(filename);
+    cout << "Reading vocabulary file " << filename << endl;
+    assert(vocabFile.is_open());
 
-  // Read the words one by one
-  for (int k = 0; k < numWords; k++) {
+    // Read the header line
+    string line;
     getline(vocabFile, line);
-    stringstream lineStream(line);
-    string strIdx;
+    size_t tab = line.find('\t');
+    int numWords = stoi(line.substr(0, tab));
+    int numLabels = stoi(line.substr(tab + 1));
+    cout << "Vocabulary file contains " << numWords << " words and "
+    << numLabels << " labels\n";
+
+    // Read the labels one by one (index, label)
+    for (int k = 0; k < numLabels; k++) {
+      getline(vocabFile, line);
+      tab = line.find('\t');
+      InsertLabel(line.substr(tab + 1));
+    }
+
+    // Read the words one by one (index, word, discounted count)
     string word;
-    string strWordFreq;
-    getline(lineStream, strIdx, '\t');
-    getline(lineStream, word, '\t');
-    getline(lineStream, strWordFreq);
-    double wordFreq = stof(strWordFreq);
-    InsertWord(word, wordFreq);
+    for (int k = 0; k < numWords; k++) {
+      getline(vocabFile, line);
+      size_t tab1 = line.find('\t');
+      size_t tab2 = line.find('\t', tab1 + 1);
+      word.assign(line, tab1 + 1, tab2 - tab1 - 1);
+      double wordFreq = strtof(line.c_str() + tab2 + 1, NULL);
+      InsertWord(word, wordFreq);
+    }
+    vocabFile.close();
+
+    // Cache the vocabulary for the next imports
+    if (hasTextStat) {
+      BinaryVocabulary::Write(binaryFilename,
+                              (long long)textStat.st_size,
+                              (long long)textStat.st_mtime,
+                              *_words, *_labels);
+    }
   }
 
-  vocabFile.close();
-
   // Note the OOV tag
-  _oov = vocabulary["<unk>"];
+  _oov = max(_words->Find("<unk>"), 0);
 
   printf("Vocab size: %d\n", NumWords());
   printf("Unknown tag at: %d\n", _oov);
@@ -332,71 +371,207 @@ void CorpusUnrolls::ImportVocabulary(const string &filename) {
 
 
 /**
- * Read vocabulary from all books and return the number of tokens
+ * Read vocabulary from all books and return the number of tokens.
+ * The books are parsed in parallel, a batch at a time (to bound
+ * the memory taken by their words), and merged in order.
  */
-long CorpusUnrolls::ReadVocabulary(bool mergeLabel) {
+long CorpusUnrolls::ReadVocabulary(bool mergeLabel, int numThreads) {
   
   long nTokens = 0;
-  // Loop over the books
-  for (int k = 0; k < NumBooks(); k++) {
-    // Open the training file, load it to a JSON structure
-    // and add words to the corpus
-    ReadJson *train_json =
-    new ReadJson(_bookFilenames[k], *this, true, false, mergeLabel);
-    nTokens = m_currentBook.NumTokens();
-    // Free the memory
-    delete train_json;
+  WorkStealingScheduler scheduler(min(numThreads, NumBooks()));
+  int batchSize = 4 * scheduler.GetNumThreads();
+  // Loop over the batches of books
+  for (int k0 = 0; k0 < NumBooks(); k0 += batchSize) {
+    int numBooksInBatch = min(batchSize, NumBooks() - k0);
+    vector<BookVocabulary> bookVocabularies(numBooksInBatch);
+    vector<long> bookNumTokens(numBooksInBatch, 0);
+    scheduler.Run(numBooksInBatch, [&](int k, int) {
+      // Open the training file, parse it
+      // and collect the words of the book
+      ReadJson train_json(_bookFilenames[k0 + k], *this, true, false,
+                          mergeLabel, NULL, &(bookVocabularies[k]));
+      bookNumTokens[k] = train_json.NumTokens();
+    });
+    // Add the words of the books to the corpus, in order
+    for (int k = 0; k < numBooksInBatch; k++) {
+      MergeVocabulary(bookVocabularies[k]);
+      nTokens += bookNumTokens[k];
+    }
+    cout << "Corpus now contains " << NumWords()
+    << " words and " << NumLabels() << " labels\n";
   }
   return nTokens;
 }
 
 
+/**
+ * Merge the words and labels of a book into the vocabulary,
+ * adding the discounts of each word in the order of its occurrences
+ */
+void CorpusUnrolls::MergeVocabulary(const BookVocabulary &bookVocabulary) {
+
+  for (int k = 0; k < bookVocabulary.NumLabels(); k++) {
+    InsertLabel(bookVocabulary._labels[k]);
+  }
+  // Index of each word of the book in the corpus
+  vector<int> wordIndexes(bookVocabulary.NumWords(), -1);
+  for (size_t i = 0; i < bookVocabulary._occurrences.size(); i++) {
+    int k = bookVocabulary._occurrences[i].first;
+    double discount = bookVocabulary._occurrences[i].second;
+    if (wordIndexes[k] < 0) {
+      wordIndexes[k] = InsertWord(bookVocabulary._words[k], discount);
+    } else {
+      _words->Count(wordIndexes[k]) += discount;
+    }
+  }
+}
+
+
+/**
+ * Insert an occurrence of a word, with its discount
+ */
+void BookVocabulary::InsertWord(const string &word, double discount) {
+  unordered_map<string, int>::iterator it = _wordIndexes.find(word);
+  int wordIndex = 0;
+  if (it == _wordIndexes.end()) {
+    wordIndex = (int)(_words.size());
+    _wordIndexes.insert(pair<string, int>(word, wordIndex));
+    _words.push_back(word);
+  } else {
+    wordIndex = it->second;
+  }
+  _occurrences.push_back(pair<int, double>(wordIndex, discount));
+}
+
+
+/**
+ * Insert a label, if new
+ */
+void BookVocabulary::InsertLabel(const string &label) {
+  if (_labelSet.insert(label).second) {
+    _labels.push_back(label);
+  }
+}
+
+
+/**
+ * Set the order of the books, which must be a permutation of the books
+ * of the corpus; returns false otherwise
+ */
+bool CorpusUnrolls::SetBookOrder(const vector<string> &filenames) {
+  vector<string> sortedBooks(_bookFilenames);
+  vector<string> sortedOrder(filenames);
+  sort(sortedBooks.begin(), sortedBooks.end());
+  sort(sortedOrder.begin(), sortedOrder.end());
+  if (sortedBooks != sortedOrder) {
+    return false;
+  }
+  _bookFilenames = filenames;
+  return true;
+}
+
+
+/**
+ * Save the state of the generator shuffling the books
+ */
+string CorpusUnrolls::RandomGeneratorState() const {
+  ostringstream state;
+  state << _randomGenerator;
+  return state.str();
+}
+
+
+/**
+ * Restore the state of the generator shuffling the books
+ */
+bool CorpusUnrolls::SetRandomGeneratorState(const string &state) {
+  istringstream stream(state);
+  mt19937 generator;
+  stream >> generator;
+  if (stream.fail()) {
+    return false;
+  }
+  _randomGenerator = generator;
+  return true;
+}
+
+
 /**
  * Read the current book into memory
  */
 void CorpusUnrolls::ReadBook(bool mergeLabel) {
+  ReadBook(_currentBookIndex, mergeLabel, m_currentBook);
+}
+
+
+/**
+ * Read a book into memory
+ */
+void CorpusUnrolls::ReadBook(int bookIndex,
+                             bool mergeLabel,
+                             BookUnrolls &book) {
   
   // "Burn" the previous book, if any, to initialize it
-  m_currentBook.Burn();
-  // Open the training file, load it to a JSON structure
-  // and add words to the corpus
+  book.Burn();
+  const string &filename = _bookFilenames[bookIndex];
+  // Load the pre-tokenized binary book, if it exists
+  // and was converted with the same vocabulary
+  string binaryFilename = filename + ".unrolls.bin";
+  unsigned long long vocabularyHash = 0;
+  if (_useBinaryBooks) {
+    vocabularyHash = VocabularyHash();
+    if (BinaryUnrolls::Read(binaryFilename, book,
+                            vocabularyHash, mergeLabel,
+                            NumWords(), NumLabels())) {
+      return;
+    }
+    book.Burn();
+  }
+  // Open the training file, parse it
+  // and add its tokens to the book
   ReadJson *train_json =
-  new ReadJson(_bookFilenames[_currentBookIndex], *this, false, true, mergeLabel);
+  new ReadJson(filename, *this, false, true, mergeLabel, &book);
   // Free the memory
   delete train_json;
+  // Convert the book for the next times it is read
+  if (_useBinaryBooks) {
+    BinaryUnrolls::Write(binaryFilename, book,
+                         vocabularyHash, mergeLabel);
+  }
 }
 
 
 /**
- * Insert a word into the vocabulary, if new
+ * Hash (64-bit FNV-1a) of the words and labels of the vocabulary
+ * and of their indexes
  */
-int CorpusUnrolls::InsertWord(const string &word, double discount) {
-  
-  // Try to find the word
-  int wordIndex = LookUpWord(word);
-  if (wordIndex == _oov) {
-    // Could not find word: insert it to the vocabulary
-    wordIndex = _vocabSizeWords;
-    pair<string, int> kv(word, wordIndex);
-    vocabulary.insert(kv);
-    pair<int, string> kv2(wordIndex, word);
-    vocabularyReverse.insert(kv2);
-    _vocabSizeWords++;
-  } else {
-    wordIndex = vocabulary[word];
-  }
-  
-  // Find the current (dis)count of the word
-  unordered_map<int, double>::iterator it2 =
-  wordCountsDiscounted.find(wordIndex);
-  if (it2 == wordCountsDiscounted.end()) {
-    pair<int, double> kv(wordIndex, discount);
-    wordCountsDiscounted.insert(kv);
-  } else {
-    wordCountsDiscounted[wordIndex] += discount;
+unsigned long long CorpusUnrolls::VocabularyHash() const {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (int pass = 0; pass < 2; pass++) {
+    int num = (pass == 0) ? NumWords() : NumLabels();
+    for (int k = 0; k < num; k++) {
+      const char *text = (pass == 0) ? Word(k) : Label(k);
+      // Include the terminating 0 to separate the words
+      size_t length = strlen(text);
+      for (size_t i = 0; i <= length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+      }
+    }
+    hash ^= (unsigned long long)num;
+    hash *= 1099511628211ULL;
   }
-  
-  // Simply return the word index
+  return hash;
+}
+
+
+/**
+ * Insert a word into the vocabulary, if new,
+ * and add the discount to its count
+ */
+int CorpusUnrolls::InsertWord(const string &word, double discount) {
+  int wordIndex = _words->Insert(word);
+  _words->Count(wordIndex) += discount;
   return wordIndex;
 }
 
@@ -405,53 +580,22 @@ int CorpusUnrolls::InsertWord(const string &word, double discount) {
  * Insert a label into the vocabulary, if new
  */
 int CorpusUnrolls::InsertLabel(const string &label) {
-  
-  // Try to find the label
-  int labelIndex = LookUpLabel(label);
-  if (labelIndex == -1) {
-    // Could not find word: insert it to the vocabulary
-    labelIndex = _vocabSizeLabels;
-    pair<string, int> kv(label, labelIndex);
-    labels.insert(kv);
-    pair<int, string> kv2(labelIndex, label);
-    labelsReverse.insert(kv2);
-    _vocabSizeLabels++;
-  } else {
-    labelIndex = labels[label];
-  }
-  
-  // Simply return the label index
-  return labelIndex;
+  return _labels->Insert(label);
 }
 
 
 /**
  * Look-up a word in the vocabulary
  */
-int CorpusUnrolls::LookUpWord(const string &word) {
-  
-  // Try to find the word
-  int wordIndex = _oov;
-  unordered_map<string, int>::iterator it =
-  vocabulary.find(word);
-  if (it != vocabulary.end()) {
-    wordIndex = vocabulary[word];
-  }
-  return wordIndex;
+int CorpusUnrolls::LookUpWord(const string &word) const {
+  int wordIndex = _words->Find(word);
+  return (wordIndex < 0) ? _oov : wordIndex;
 }
 
 
 /**
  * Look-up a label in the vocabulary
  */
-int CorpusUnrolls::LookUpLabel(const string &label) {
-  
-  // Try to find the word
-  int labelIndex = -1;
-  unordered_map<string, int>::iterator it =
-  labels.find(label);
-  if (it != labels.end()) {
-    labelIndex = labels[label];
-  }
-  return labelIndex;
+int CorpusUnrolls::LookUpLabel(const string &label) const {
+  return _labels->Find(label);
 }
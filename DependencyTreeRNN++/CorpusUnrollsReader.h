@@ -12,33 +12,89 @@
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <random>
+#include <memory>
+#include "StringTable.h"
 
 /**
- * Basic unit of a text: a token
+ * Basic unit of a text: a token, packed in 16 bytes
  */
 struct Token {
-  int pos;
   int wordAsContext;
   int wordAsTarget;
-  double discount;
-  int label;
+  // Position of the token in the sentence
+  unsigned short pos;
+  // Dependency label (-1 if not in the vocabulary of labels)
+  short label;
+  // Number of occurrences of the token in the unrolls of the sentence
+  float numOccurrences;
+
+  /**
+   * Discount of the token, i.e., the inverse of its number of occurrences
+   */
+  double Discount() const { return 1.0 / numOccurrences; }
 };
 
 /**
- * Sentence unroll: a vector of tokens
+ * Sentence unroll: a view of a contiguous range of tokens of a book
  */
-typedef std::vector<Token> Unroll;
+class Unroll {
+public:
+  Unroll(const Token *tokens, int numTokens)
+  : _tokens(tokens), _numTokens(numTokens) { }
+
+  /**
+   * Number of tokens
+   */
+  size_t size() const { return (size_t)_numTokens; }
+
+  /**
+   * Token j of the unroll
+   */
+  const Token &operator[](size_t j) const { return _tokens[j]; }
+
+protected:
+  const Token *_tokens;
+  int _numTokens;
+};
 
 /**
- * Sentence: a vector of unrolls
+ * Sentence: a view of a contiguous range of unrolls of a book
  */
-typedef std::vector<Unroll> Sentence;
+class Sentence {
+public:
+  Sentence(const Token *tokens, const int *unrollOffsets, int numUnrolls)
+  : _tokens(tokens), _unrollOffsets(unrollOffsets), _numUnrolls(numUnrolls) { }
+
+  /**
+   * Number of unrolls
+   */
+  size_t size() const { return (size_t)_numUnrolls; }
+
+  /**
+   * Unroll k of the sentence
+   */
+  Unroll operator[](size_t k) const {
+    return Unroll(_tokens + _unrollOffsets[k],
+                  _unrollOffsets[k + 1] - _unrollOffsets[k]);
+  }
+
+protected:
+  // Tokens of the book, and offsets of the unrolls of the sentence in them
+  const Token *_tokens;
+  const int *_unrollOffsets;
+  int _numUnrolls;
+};
 
 
 /**
- * Book: a class containing a vector of sentences
+ * Book: a class containing a vector of sentences, stored as one array
+ * of tokens with offset tables (compressed sparse rows):
+ * the tokens of unroll j are [_unrollOffsets[j], _unrollOffsets[j + 1][
+ * and the unrolls of sentence k are
+ * [_sentenceOffsets[k], _sentenceOffsets[k + 1][
  */
 class BookUnrolls {
 public:
@@ -49,18 +105,25 @@ public:
   BookUnrolls() { Burn(); }
   ~BookUnrolls() { }
 
+  /**
+   * Books are copied or moved (e.g., from the thread that reads them)
+   */
+  BookUnrolls(const BookUnrolls &other) = default;
+  BookUnrolls(BookUnrolls &&other) = default;
+  BookUnrolls &operator=(const BookUnrolls &other) = default;
+  BookUnrolls &operator=(BookUnrolls &&other) = default;
+
   /**
    * Wipe-out all content of the book
    */
   void Burn() {
-    _sentences.clear();
-    _numUnrollsInSentence.clear();
-    _numTokensInUnrollSentence.clear();
-    _numSentences = 0;
+    _tokens.clear();
+    _unrollOffsets.assign(1, 0);
+    _sentenceOffsets.assign(1, 0);
+    _currentToken = NULL;
     _sentenceIndex = 0;
     _unrollIndex = 0;
     _tokenIndex = 0;
-    _numTokens = 0;
   }
 
   /**
@@ -68,22 +131,49 @@ public:
    */
   void AddToken(bool new_sentence, bool new_unroll,
                 int pos, int wordAsContext, int wordAsTarget,
-                double discount, int label);
+                double numOccurrences, int label);
+
+  /**
+   * Replace the content of the book by the given tokens and offset tables
+   */
+  void Assign(const int *sentenceOffsets, int numSentences,
+              const int *unrollOffsets, int numUnrolls,
+              const Token *tokens, int numTokens);
 
   /**
    * Return the number of sentences
    */
-  int NumSentences() { return _numSentences; }
+  int NumSentences() const { return (int)_sentenceOffsets.size() - 1; }
 
   /**
    * Return the number of unrolls in sentence
    */
-  int NumUnrolls(int k) { return _numUnrollsInSentence[k]; }
+  int NumUnrolls(int k) const {
+    return _sentenceOffsets[k + 1] - _sentenceOffsets[k];
+  }
 
   /**
    * Return the number of tokens in unroll of a sentence
    */
-  int NumTokens(int k, int j) { return _numTokensInUnrollSentence[k][j]; }
+  int NumTokens(int k, int j) const {
+    int unroll = _sentenceOffsets[k] + j;
+    return _unrollOffsets[unroll + 1] - _unrollOffsets[unroll];
+  }
+
+  /**
+   * Return a view of all the unrolls of sentence k
+   */
+  Sentence GetSentence(int k) const {
+    return Sentence(_tokens.data(), &_unrollOffsets[_sentenceOffsets[k]],
+                    NumUnrolls(k));
+  }
+
+  /**
+   * Tokens and offset tables
+   */
+  const std::vector<Token> &Tokens() const { return _tokens; }
+  const std::vector<int> &UnrollOffsets() const { return _unrollOffsets; }
+  const std::vector<int> &SentenceOffsets() const { return _sentenceOffsets; }
 
   /**
    * Return the index of the current sentence
@@ -121,15 +211,15 @@ public:
    * Update the current token
    */
   void UpdateCurrentToken() {
-    _currentToken =
-    &(_sentences[_sentenceIndex][_unrollIndex][_tokenIndex]);
+    _currentToken = &(_tokens[_unrollOffsets[_sentenceOffsets[_sentenceIndex]
+                                             + _unrollIndex] + _tokenIndex]);
   }
 
   /**
    * Accessors to the current token's information
    */
   int CurrentTokenNumberInSentence() { return _currentToken->pos; }
-  double CurrentTokenDiscount() { return _currentToken->discount; }
+  double CurrentTokenDiscount() { return _currentToken->Discount(); }
   int CurrentTokenWordAsContext() { return _currentToken->wordAsContext; }
   int CurrentTokenWordAsTarget() { return _currentToken->wordAsTarget; }
   int CurrentTokenLabel() { return _currentToken->label; }
@@ -163,32 +253,116 @@ public:
   /**
    * Number of tokens
    */
-  long NumTokens() { return _numTokens; }
+  long NumTokens() const { return (long)_tokens.size(); }
 
 protected:
 
-  // All the sentences of the book
-  std::vector<Sentence> _sentences;
+  // All the tokens of the book
+  std::vector<Token> _tokens;
+
+  // Offsets of the unrolls in the tokens (number of unrolls + 1)
+  std::vector<int> _unrollOffsets;
+
+  // Offsets of the sentences in the unrolls (number of sentences + 1)
+  std::vector<int> _sentenceOffsets;
 
-  // Copy of the current token
-  Token *_currentToken;
+  // Pointer to the current token
+  const Token *_currentToken;
 
-  // Current sentence, unroll and token index
+  // Current sentence, unroll (in the sentence)
+  // and token (in the unroll) index
   int _sentenceIndex;
   int _unrollIndex;
   int _tokenIndex;
+};
 
-  // Number of sentences
-  int _numSentences;
 
-  // Number of unrolls in each sentence
-  std::vector<int> _numUnrollsInSentence;
+/**
+ * Prefix trie of the unrolls of a sentence: the unrolls are root-to-leaf
+ * paths in the dependency tree, and share their prefixes (e.g., ROOT, verb).
+ * Each node (except the root) stands for one token of the sentence, and is
+ * keyed by (context word, label, position) among the children of its parent.
+ */
+class SentenceTrie {
+public:
+
+  /**
+   * Node of the trie
+   */
+  struct Node {
+    // Token consumed when entering the node (undefined for the root)
+    Token token;
+    // Indexes of the children nodes
+    std::vector<int> children;
+  };
+
+  /**
+   * Build the trie from all the unrolls of a sentence
+   */
+  void Build(const Sentence &sentence);
 
-  // Number of tokens in each unroll and sentence
-  std::vector<std::vector<int> > _numTokensInUnrollSentence;
+  /**
+   * Return the number of nodes, including the root
+   */
+  int NumNodes() const { return (int)(_nodes.size()); }
 
-  // Total number of tokens
-  long _numTokens;
+  /**
+   * Return node n (node 0 is the root)
+   */
+  const Node &GetNode(int n) const { return _nodes[n]; }
+
+  /**
+   * Return the index of the node of token j in unroll k
+   */
+  int NodeOfToken(int k, int j) const { return _nodeOfToken[k][j]; }
+
+protected:
+
+  // All the nodes of the trie, the root being node 0
+  std::vector<Node> _nodes;
+
+  // Index of the node for each token in each unroll
+  std::vector<std::vector<int> > _nodeOfToken;
+};
+
+
+/**
+ * Words and labels of one book, collected (e.g., on another thread)
+ * before being merged into the vocabulary of a corpus. The words and labels
+ * are kept in order of first occurrence, and the discounts of the words
+ * in order of occurrence, so that merging the books in order gives
+ * exactly the vocabulary obtained by inserting the tokens one by one.
+ */
+class BookVocabulary {
+public:
+
+  /**
+   * Insert an occurrence of a word, with its discount
+   */
+  void InsertWord(const std::string &word, double discount);
+
+  /**
+   * Insert a label, if new
+   */
+  void InsertLabel(const std::string &label);
+
+  /**
+   * Number of words and labels
+   */
+  int NumWords() const { return (int)(_words.size()); }
+  int NumLabels() const { return (int)(_labels.size()); }
+
+protected:
+  friend class CorpusUnrolls;
+
+  // Words and labels, in order of first occurrence
+  std::vector<std::string> _words;
+  std::vector<std::string> _labels;
+  std::unordered_map<std::string, int> _wordIndexes;
+  std::unordered_set<std::string> _labelSet;
+
+  // Occurrences of the words (index, discount), in order
+  std::vector<std::pair<int, double> > _occurrences;
 };
 
 
@@ -204,9 +378,10 @@ public:
   CorpusUnrolls() :
   _minWordOccurrence(3),
   _oov(0),
-  _vocabSizeWords(0),
-  _vocabSizeLabels(0),
-  _currentBookIndex(-1) {
+  _currentBookIndex(-1),
+  _useBinaryBooks(false),
+  _words(std::make_shared<StringTable>()),
+  _labels(std::make_shared<StringTable>()) {
     // Insert OOV and EOS tokens
     InsertWord("<unk>", 1.0);
     InsertWord("</s>", 1.0);
@@ -223,27 +398,34 @@ public:
   /**
    * Number of books
    */
-  int NumBooks() { return (int)(_bookFilenames.size()); }
+  int NumBooks() const { return (int)(_bookFilenames.size()); }
 
   /**
    * Size of the vocabulary
    */
-  int NumWords() { return _vocabSizeWords; }
+  int NumWords() const { return _words->Size(); }
 
   /**
    * Number of labels
    */
-  int NumLabels() { return _vocabSizeLabels; }
+  int NumLabels() const { return _labels->Size(); }
 
   /**
    * Look-up a word in the vocabulary
    */
-  int LookUpWord(const std::string &word);
+  int LookUpWord(const std::string &word) const;
 
   /**
    * Look-up a label in the vocabulary
    */
-  int LookUpLabel(const std::string &label);
+  int LookUpLabel(const std::string &label) const;
+
+  /**
+   * Return word k, its discounted count, and label k
+   */
+  const char *Word(int k) const { return _words->String(k); }
+  double WordCount(int k) const { return _words->Count(k); }
+  const char *Label(int k) const { return _labels->String(k); }
 
 public:
   /**
@@ -262,9 +444,16 @@ public:
   int InsertLabel(const std::string &label);
 
   /**
-   * Read vocabulary from all books and return the number of tokens
+   * Read vocabulary from all books and return the number of tokens.
+   * The books are parsed on numThreads threads, and merged in order,
+   * so the vocabulary does not depend on the number of threads.
+   */
+  long ReadVocabulary(bool mergeLabel, int numThreads = 1);
+
+  /**
+   * Merge the words and labels of a book into the vocabulary
    */
-  long ReadVocabulary(bool mergeLabel);
+  void MergeVocabulary(const BookVocabulary &bookVocabulary);
 
   /**
    * Filter and sort the vocabulary from another corpus
@@ -272,17 +461,23 @@ public:
   void FilterSortVocabulary(CorpusUnrolls &other);
 
   /**
-   * Copy the vocabulary from another corpus
+   * Share the vocabulary of another corpus
    */
   void CopyVocabulary(CorpusUnrolls &other);
 
+  /**
+   * Release the vocabulary (e.g., once it has been filtered into another corpus)
+   */
+  void ReleaseVocabulary();
+
   /**
    * Export the vocabulary to a text file
    */
   void ExportVocabulary(const std::string &filename);
 
   /**
-   * Import the vocabulary from a text file
+   * Import the vocabulary from a text file, or from its binary cache
+   * (.bin), which is written the first time the text file is imported
    */
   void ImportVocabulary(const std::string &filename);
 
@@ -307,14 +502,58 @@ public:
    * Shuffle the order of the books
    */
   void ShuffleBooks() {
-    std::random_shuffle(_bookFilenames.begin(), _bookFilenames.end());
+    std::shuffle(_bookFilenames.begin(), _bookFilenames.end(), _randomGenerator);
+  }
+
+  /**
+   * Go back to the position before a book, so that NextBook returns it
+   */
+  void RewindToBook(int bookIndex) {
+    _currentBookIndex = ((bookIndex > 0) ? bookIndex : NumBooks()) - 1;
   }
 
+  /**
+   * Order of the books (filenames)
+   */
+  const std::vector<std::string> &BookFilenames() const {
+    return _bookFilenames;
+  }
+
+  /**
+   * Set the order of the books, which must be a permutation of the books
+   * of the corpus; returns false otherwise
+   */
+  bool SetBookOrder(const std::vector<std::string> &filenames);
+
+  /**
+   * Save or restore the state of the generator shuffling the books
+   * (text representation of the Mersenne twister)
+   */
+  std::string RandomGeneratorState() const;
+  bool SetRandomGeneratorState(const std::string &state);
+
   /**
    * Read the current book into memory
    */
   void ReadBook(bool mergeLabel);
 
+  /**
+   * Read book bookIndex into a given book. Only looks up the vocabulary,
+   * so it can run on another thread than the one using the corpus.
+   */
+  void ReadBook(int bookIndex, bool mergeLabel, BookUnrolls &book);
+
+  /**
+   * Load the books from their pre-tokenized binary files (.unrolls.bin),
+   * written the first time each book is parsed
+   */
+  void SetBinaryBooks(bool useBinaryBooks) { _useBinaryBooks = useBinaryBooks; }
+
+  /**
+   * Hash of the words and labels of the vocabulary and of their indexes
+   */
+  unsigned long long VocabularyHash() const;
+
 protected:
 
   // Minimum number of word occurrences not to be OOV
@@ -323,28 +562,24 @@ protected:
   // Out-of-vocabulary token
   int _oov;
 
-  // Number of words and labels in the vocabulary
-  int _vocabSizeWords;
-  int _vocabSizeLabels;
-
   // Current book
   int _currentBookIndex;
 
   // List of books (filenames)
   std::vector<std::string> _bookFilenames;
 
-public:
+  // Random generator shuffling the books
+  std::mt19937 _randomGenerator;
 
-  // Vocabulary: map between a string of text and an integer
-  std::unordered_map<std::string, int> vocabulary;
-  std::unordered_map<int, std::string> vocabularyReverse;
+  // Load the books from their pre-tokenized binary files
+  bool _useBinaryBooks;
 
-  // Discounted word counts
-  std::unordered_map<int, double> wordCountsDiscounted;
+  // Vocabulary of words (with their discounted counts) and of labels,
+  // shared between the corpora that use the same vocabulary
+  std::shared_ptr<StringTable> _words;
+  std::shared_ptr<StringTable> _labels;
 
-  // Labels: map between a string of text and an integer
-  std::unordered_map<std::string, int> labels;
-  std::unordered_map<int, std::string> labelsReverse;
+public:
 
   // Current book
   BookUnrolls m_currentBook;
@@ -0,0 +1,147 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <chrono>
+#include "Logger.h"
+
+using namespace std;
+
+
+/**
+ * Logger of the process
+ */
+Logger &Logger::Instance() {
+  static Logger logger;
+  return logger;
+}
+
+
+/**
+ * Constructor: start the background thread
+ */
+Logger::Logger()
+: m_severity(LogInfo),
+m_messages(NULL),
+m_numFlushRequests(0),
+m_numFlushes(0),
+m_isStopped(false) {
+  m_thread = thread(&Logger::WriteMessages, this);
+}
+
+
+/**
+ * Destructor: write the remaining messages, then stop the thread
+ */
+Logger::~Logger() {
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_isStopped = true;
+  }
+  m_condition.notify_all();
+  if (m_thread.joinable()) {
+    m_thread.join();
+  }
+}
+
+
+/**
+ * Append text to a file: push the message on the queue
+ * (without waiting for the background thread)
+ */
+void Logger::Write(const string &text, const string &filename) {
+  Message *message = new Message;
+  message->Text = text;
+  message->Filename = filename;
+  message->Next = m_messages.load(memory_order_relaxed);
+  while (!m_messages.compare_exchange_weak(message->Next, message,
+                                           memory_order_release,
+                                           memory_order_relaxed)) {
+  }
+}
+
+
+/**
+ * Wait until all the messages logged so far are written,
+ * then flush and close the files
+ */
+void Logger::Flush() {
+  unique_lock<mutex> lock(m_mutex);
+  long request = ++m_numFlushRequests;
+  m_condition.notify_all();
+  m_condition.wait(lock, [this, request] { return m_numFlushes >= request; });
+}
+
+
+/**
+ * Take all the messages from the queue, in the order they were pushed
+ */
+Logger::Message *Logger::TakeMessages() {
+  Message *stack = m_messages.exchange(NULL, memory_order_acquire);
+  // The last message pushed is on top of the stack: reverse it
+  Message *messages = NULL;
+  while (stack != NULL) {
+    Message *next = stack->Next;
+    stack->Next = messages;
+    messages = stack;
+    stack = next;
+  }
+  return messages;
+}
+
+
+/**
+ * Write the messages on the background thread, until the thread is stopped
+ */
+void Logger::WriteMessages() {
+  while (true) {
+    // The messages are not signalled: wait until there are some
+    // (checking periodically), or until a flush is requested
+    long numFlushRequests;
+    bool isStopped;
+    {
+      unique_lock<mutex> lock(m_mutex);
+      m_condition.wait_for(lock, chrono::milliseconds(10), [this] {
+        return m_isStopped || (m_numFlushRequests > m_numFlushes)
+        || (m_messages.load(memory_order_relaxed) != NULL);
+      });
+      numFlushRequests = m_numFlushRequests;
+      isStopped = m_isStopped;
+    }
+
+    // Write the messages to the buffered files
+    Message *message = TakeMessages();
+    while (message != NULL) {
+      FILE *&file = m_files[message->Filename];
+      if (file == NULL) {
+        file = fopen(message->Filename.c_str(), "a");
+      }
+      if (file != NULL) {
+        fwrite(message->Text.data(), 1, message->Text.size(), file);
+      }
+      Message *next = message->Next;
+      delete message;
+      message = next;
+    }
+
+    // Close the files once the messages logged before the flush are written
+    if (isStopped || (numFlushRequests > m_numFlushes)) {
+      for (auto &file : m_files) {
+        if (file.second != NULL) {
+          fclose(file.second);
+        }
+      }
+      m_files.clear();
+      {
+        lock_guard<mutex> lock(m_mutex);
+        m_numFlushes = numFlushRequests;
+      }
+      m_condition.notify_all();
+      if (isStopped) {
+        return;
+      }
+    }
+  }
+}
@@ -0,0 +1,164 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____Logger__
+#define __DependencyTreeRNN____Logger__
+
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+
+/**
+ * Severity of the logged messages: debug messages (e.g., one per token
+ * when testing) are only logged in debug mode
+ */
+enum LogSeverity {
+  LogDebug = 0,
+  LogInfo = 1
+};
+
+
+/**
+ * Write the log messages to their files (sinks) on a background thread.
+ * The messages are pushed on a lock-free queue, which the background thread
+ * drains into one buffered file handle per sink, opened (in append mode)
+ * on the first message and kept open until the next Flush.
+ */
+class Logger {
+public:
+
+  /**
+   * Logger of the process
+   */
+  static Logger &Instance();
+
+  /**
+   * Set the minimum severity of the logged messages
+   */
+  void SetSeverity(LogSeverity severity) {
+    m_severity.store(severity, std::memory_order_relaxed);
+  }
+
+  /**
+   * Is a message of that severity logged?
+   */
+  bool IsLogged(LogSeverity severity) const {
+    return severity >= m_severity.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Append text to a file, on the background thread
+   */
+  void Write(const std::string &text, const std::string &filename);
+
+  /**
+   * Wait until all the messages logged so far are written,
+   * then flush and close the files
+   */
+  void Flush();
+
+protected:
+
+  /**
+   * Constructor: start the background thread
+   */
+  Logger();
+
+  /**
+   * Destructor: write the remaining messages, then stop the thread
+   */
+  ~Logger();
+
+  // Message waiting in the queue
+  struct Message {
+    std::string Text;
+    std::string Filename;
+    Message *Next;
+  };
+
+  /**
+   * Take all the messages from the queue, in the order they were pushed
+   */
+  Message *TakeMessages();
+
+  /**
+   * Write the messages on the background thread
+   */
+  void WriteMessages();
+
+  // Minimum severity of the logged messages
+  std::atomic<int> m_severity;
+
+  // Lock-free queue of messages: a stack on which the messages are pushed,
+  // and which the background thread takes as a whole
+  std::atomic<Message *> m_messages;
+
+  // Files written by the background thread
+  std::unordered_map<std::string, FILE *> m_files;
+
+  // Number of flushes requested, and done by the background thread
+  long m_numFlushRequests;
+  long m_numFlushes;
+
+  // Has the thread been stopped?
+  bool m_isStopped;
+
+  // Synchronization between the background thread and Flush
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  std::thread m_thread;
+};
+
+
+/**
+ * Is a message of that severity logged? Check it before building
+ * the message, e.g.: if (IsLogged(LogDebug)) { Log(...); }
+ */
+inline bool IsLogged(LogSeverity severity) {
+  return Logger::Instance().IsLogged(severity);
+}
+
+
+/**
+ * Set the minimum severity of the logged messages
+ */
+inline void SetLogSeverity(LogSeverity severity) {
+  Logger::Instance().SetSeverity(severity);
+}
+
+
+/**
+ * Log to screen and to file (append, on the background thread)
+ */
+inline void Log(const std::string &str, const std::string &logFilename) {
+  std::cout << str;
+  Logger::Instance().Write(str, logFilename);
+}
+
+
+/**
+ * Log to screen only
+ */
+inline void Log(const std::string &str) {
+  std::cout << str;
+}
+
+
+/**
+ * Wait until the logged messages are written to their files
+ */
+inline void FlushLog() {
+  std::cout << std::flush;
+  Logger::Instance().Flush();
+}
+
+#endif /* defined(__DependencyTreeRNN____Logger__) */
@@ -0,0 +1,98 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____MappedModel__
+#define __DependencyTreeRNN____MappedModel__
+
+#include <stddef.h>
+#include "RnnWeights.h"
+
+
+/**
+ * Version of the memory-mapped model format
+ * (version 20 is the text header followed by matrices of floats)
+ */
+static const int c_mappedModelVersion = 21;
+
+/**
+ * Identifier of the memory-mapped model format, at the start of the file
+ */
+static const char c_mappedModelMagic[8] = "RNNMMAP";
+
+/**
+ * Alignment (in bytes) of the sections of the memory-mapped model
+ */
+static const long long c_mappedModelAlignment = 64;
+
+
+/**
+ * Sections of the memory-mapped model: names of the training and
+ * validation files, the vocabulary (blob of 0-terminated words, offsets
+ * of the words in the blob, word counts and word classes), the hidden
+ * layer, the weight matrices (in the order of RnnWeights::Matrix
+ * and in their in-memory layout) and the topic feature matrix
+ */
+enum MappedModelSection {
+  c_sectionTrainFile = 0,
+  c_sectionValidationFile,
+  c_sectionWords,
+  c_sectionWordOffsets,
+  c_sectionWordCounts,
+  c_sectionWordClasses,
+  c_sectionHiddenLayer,
+  c_sectionWeights,
+  c_sectionFeatureMatrix = c_sectionWeights + RnnWeights::c_numMatrices,
+  c_numMappedModelSections
+};
+
+
+/**
+ * Offset (from the start of the file, aligned on c_mappedModelAlignment)
+ * and size in bytes of a section of the memory-mapped model
+ */
+struct MappedModelSectionHeader {
+  long long offset;
+  long long size;
+};
+
+
+/**
+ * Header of the memory-mapped model: the training state and dimensions
+ * of the model (as in the text header of version 20), followed by
+ * the table of sections
+ */
+struct MappedModelHeader {
+  char magic[8];
+  int version;
+  // Size of real, the type of the weights and activations in the file
+  int sizeReal;
+  // Training state
+  int iteration;
+  int doStartReducingLearningRate;
+  long long currentPosTrainFile;
+  long long numTrainWords;
+  double initialLearningRate;
+  double learningRate;
+  double featureGammaCoeff;
+  int featureMatrixUsed;
+  int usesClassFile;
+  int areSentencesIndependent;
+  int numBpttSteps;
+  int bpttBlockSize;
+  // Dimensions of the model
+  int sizeVocabulary;
+  int sizeHidden;
+  int sizeFeature;
+  int sizeClasses;
+  int sizeCompress;
+  int orderDirectConnection;
+  int padding;
+  long long sizeDirectConnection;
+  // Sections
+  MappedModelSectionHeader sections[c_numMappedModelSections];
+};
+
+#endif /* defined(__DependencyTreeRNN____MappedModel__) */
@@ -7,69 +7,135 @@
 #ifndef DependencyTreeRNN___readjson_h
 #define DependencyTreeRNN___readjson_h
 
+#include <string>
 #include <vector>
 #include "CorpusUnrollsReader.h"
 
 using namespace std;
 
-struct JsonToken {
-  int pos;
-  string word;
-  double discount;
-  string label;
-};
-
 
 class ReadJson {
 public:
-  
+
   /**
    * Constructor: read a text file in JSON format.
-   * If required, insert words and labels to the vocabulary.
-   * If required, insert tokens into the current book.
+   * If required, insert words and labels to the vocabulary
+   * (by default, of the corpus, otherwise to a book vocabulary,
+   * so that several books can be read in parallel).
+   * If required, insert tokens into the book (by default,
+   * the current book of the corpus).
+   * The text is parsed in a single pass, and the tokens are
+   * processed as soon as they are parsed.
    */
   ReadJson(const string &filename,
            CorpusUnrolls &corpus,
            bool insert_vocab,
            bool read_book,
-           bool merge_label_with_word);
-  
+           bool merge_label_with_word,
+           BookUnrolls *book = NULL,
+           BookVocabulary *vocabulary = NULL);
+
   /**
    * Destructor
    */
   ~ReadJson() { }
 
+  /**
+   * Number of tokens in the file
+   */
+  long NumTokens() const { return _numTokens; }
+
 protected:
-  
 
   /**
-   * Trim a word
+   * Skip the white spaces
+   */
+  void SkipSpaces();
+
+  /**
+   * Consume character c (after white spaces), if it is the next one
+   */
+  bool Consume(char c);
+
+  /**
+   * Consume character c (after white spaces), which must be the next one
+   */
+  void Expect(char c);
+
+  /**
+   * Parse a number
+   */
+  double ParseNumber();
+
+  /**
+   * Parse a string between double quotes, keeping escape sequences as is,
+   * and return its first character and its length
    */
-  string const Trim(const string &word) const;
+  const char *ParseString(size_t &len);
 
   /**
-   * Parse a token
+   * Parse a token and process it
    */
-  size_t const ParseToken(const string &json_element,
-                          JsonToken &tok) const;
+  void ParseToken();
 
   /**
    * Parse an unroll
    */
-  size_t const ParseUnroll(const string &json_unrolls,
-                           vector<JsonToken> &unroll) const;
+  void ParseUnroll();
 
   /**
    * Parse a sentence
    */
-  size_t const ParseSentence(const string &json_sentences,
-                             vector<vector<JsonToken>> &sentence) const;
+  void ParseSentence();
 
   /**
    * Parse a book
    */
-  size_t const ParseBook(const string &json_book,
-                         vector<vector<vector<JsonToken>>> &book) const;
+  void ParseBook();
+
+  /**
+   * Insert a word or a label into the vocabulary of the corpus or of the book
+   */
+  void InsertWord(const string &word, double discount);
+  void InsertLabel(const string &label);
+
+  /**
+   * Insert the words and labels of a token to the vocabulary,
+   * and the token to the current book, as required
+   */
+  void ProcessToken(int pos, double numOccurrences);
+
+protected:
+
+  // Corpus (vocabulary) and book into which the tokens are inserted
+  CorpusUnrolls &_corpus;
+  BookUnrolls *_book;
+
+  // Vocabulary of the book, if the words are not inserted into the corpus
+  BookVocabulary *_vocabulary;
+
+  // What to do with the tokens
+  bool _insertVocab;
+  bool _readBook;
+  bool _mergeLabelWithWord;
+
+  // Text of the book (terminated by 0), and current position in it
+  vector<char> _text;
+  const char *_cursor;
+
+  // Word, label and context word (word and label) of the current token,
+  // reused between tokens so that looking them up does not allocate
+  string _tokenWord;
+  string _tokenLabel;
+  string _tokenWordAsContext;
+
+  // Are we at the beginning of a sentence or unroll?
+  bool _isNewSentence;
+  bool _isNewUnroll;
+
+  // Number of sentences (including empty ones) and of tokens
+  int _numSentences;
+  long _numTokens;
 };
 
 #endif
@@ -0,0 +1,33 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____RnnBlas__
+#define __DependencyTreeRNN____RnnBlas__
+
+#include "Utils.h"
+
+// Include BLAS
+extern "C" {
+#include <cblas.h>
+}
+
+/**
+ * BLAS routines matching the precision of the type real
+ * (single precision when compiled with -DUSE_FLOAT, double otherwise)
+ */
+#ifdef USE_FLOAT
+#define cblas_xgemv cblas_sgemv
+#define cblas_xgemm cblas_sgemm
+#define cblas_xaxpy cblas_saxpy
+#define cblas_xscal cblas_sscal
+#else
+#define cblas_xgemv cblas_dgemv
+#define cblas_xgemm cblas_dgemm
+#define cblas_xaxpy cblas_daxpy
+#define cblas_xscal cblas_dscal
+#endif
+
+#endif /* defined(__DependencyTreeRNN____RnnBlas__) */
@@ -40,13 +40,19 @@
 #include <math.h>
 #include <time.h>
 #include <map>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <stdexcept>
 #include <assert.h>
 #include "ReadJson.h"
 #include "RnnState.h"
 #include "CorpusUnrollsReader.h"
 #include "RnnDependencyTreeLib.h"
+#include "WorkStealingScheduler.h"
+#include "BookPrefetcher.h"
+#include "CheckpointWriter.h"
 
 // Include BLAS
 #ifdef USE_BLAS
@@ -74,8 +80,9 @@ bool RnnTreeLM::LearnVocabularyFromTrainFile(int numClasses) {
   // Read the vocabulary from all the files
   // OOV <unk> and EOS </s> tokens are added automatically.
   // Also count the number of words in all the books.
+  // The books are parsed in parallel.
   m_numTrainWords =
-  m_corpusVocabulary.ReadVocabulary(m_typeOfDepLabels == 1);
+  m_corpusVocabulary.ReadVocabulary(m_typeOfDepLabels == 1, m_numThreads);
   printf("Words in train file: %ld\n", m_numTrainWords);
 
   // Filter the vocabulary based on frequency
@@ -90,7 +97,10 @@ bool RnnTreeLM::LearnVocabularyFromTrainFile(int numClasses) {
   printf("Label vocab size: %d\n",
          m_corpusTrain.NumLabels());
 
-  // Copy the vocabulary to the other corpus
+  // The unfiltered vocabulary is no longer needed
+  m_corpusVocabulary.ReleaseVocabulary();
+
+  // Share the vocabulary with the other corpus
   m_corpusValidTest.CopyVocabulary(m_corpusTrain);
 
   // Export the vocabulary
@@ -119,11 +129,11 @@ bool RnnTreeLM::AssignVocabularyFromCorpora(int numClasses) {
   // and to the maps: word <-> index
   for (int k = 0; k < m_corpusTrain.NumWords(); k++) {
     // Get the word
-    string word = m_corpusTrain.vocabularyReverse[k];
+    string word = m_corpusTrain.Word(k);
     // Lookup it up in the vocabulary and add to vocabulary if required
     m_vocab.AddWordToVocabulary(word);
     // Store the count of words in the vocabulary
-    double count = m_corpusTrain.wordCountsDiscounted[k];
+    double count = m_corpusTrain.WordCount(k);
     m_vocab.SetWordCount(word, (int)round(count));
   }
   // Note that we do not sort the words by frequency, as they are already sorted
@@ -139,7 +149,7 @@ bool RnnTreeLM::AssignVocabularyFromCorpora(int numClasses) {
   // Copy the labels currently in the corpus
   for (int k = 0; k < m_corpusTrain.NumLabels(); k++) {
     // Get the word
-    string label = m_corpusTrain.labelsReverse[k];
+    string label = m_corpusTrain.Label(k);
     // Lookup it up in the vocabulary of labels and add it if needed
     m_labels.AddWordToVocabulary(label);
   }
@@ -163,15 +173,152 @@ void RnnTreeLM::ResetFeatureLabelVector(RnnState &state) const {
  * Update the vector of feature labels
  */
 void RnnTreeLM::UpdateFeatureLabelVector(int label, RnnState &state) const {
+  UpdateFeatureLabelVector(label, state.FeatureLayer.data());
+}
+void RnnTreeLM::UpdateFeatureLabelVector(int label, real *featureLayer) const {
   // Time-decay the previous labels using weight gamma
   int sizeFeatures = GetFeatureSize();
   for (int a = 0; a < sizeFeatures; a++) {
-    state.FeatureLayer[a] *= m_featureGammaCoeff;
+    featureLayer[a] *= m_featureGammaCoeff;
   }
   // Find the current label and set it to 1
   if ((label >= 0) && (label < sizeFeatures)) {
-    state.FeatureLayer[label] = 1.0;
+    featureLayer[label] = 1.0;
+  }
+}
+
+
+/**
+ * Write the state of the training as text: one "key: value" per line
+ * (with full precision for the log-probabilities and accuracies),
+ * followed by the number of books and their filenames, in order
+ */
+string RnnTreeLM::FormatResumeState(const ResumeState &resume) {
+  char buffer[1024];
+  string text;
+  snprintf(buffer, sizeof(buffer),
+           "number of finished iterations: %d\n"
+           "current position in training data: %ld\n"
+           "next book: %d\n"
+           "next sentence: %d\n"
+           "training log-probability: %.17g\n"
+           "training unique words: %d\n"
+           "last validation log-probability: %.17g\n"
+           "last validation accuracy: %.17g\n"
+           "best validation log-probability: %.17g\n"
+           "best validation accuracy: %.17g\n",
+           resume.Iteration, resume.WordCounter,
+           resume.NextBook, resume.NextSentence,
+           resume.TrainLogProbability, resume.UniqueWordCounter,
+           resume.LastValidLogProbability, resume.LastValidAccuracy,
+           resume.BestValidLogProbability, resume.BestValidAccuracy);
+  text = buffer;
+  text += "random generator: " + resume.RandomGeneratorState + "\n";
+  text += "books: " + ConvString((int)resume.BookOrder.size()) + "\n";
+  for (size_t k = 0; k < resume.BookOrder.size(); k++) {
+    text += resume.BookOrder[k] + "\n";
+  }
+  return text;
+}
+
+
+/**
+ * Read the state of the training written by FormatResumeState
+ */
+bool RnnTreeLM::ParseResumeState(const string &filename,
+                                 ResumeState &resume) {
+  ifstream stream(filename);
+  if (!stream) {
+    return false;
   }
+  map<string, string> values;
+  string line;
+  while (getline(stream, line)) {
+    size_t pos = line.find(": ");
+    if (pos == string::npos) {
+      return false;
+    }
+    string key = line.substr(0, pos);
+    string value = line.substr(pos + 2);
+    if (key == "books") {
+      // The filenames of the books follow, one per line
+      int numBooks = atoi(value.c_str());
+      resume.BookOrder.clear();
+      for (int k = 0; (k < numBooks) && getline(stream, line); k++) {
+        resume.BookOrder.push_back(line);
+      }
+      if ((int)resume.BookOrder.size() != numBooks) {
+        return false;
+      }
+    } else {
+      values[key] = value;
+    }
+  }
+  const char *keys[] = {
+    "number of finished iterations", "current position in training data",
+    "next book", "next sentence", "training log-probability", "training unique words",
+    "last validation log-probability", "last validation accuracy",
+    "best validation log-probability", "best validation accuracy",
+    "random generator"};
+  for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+    if (values.find(keys[k]) == values.end()) {
+      return false;
+    }
+  }
+  resume.Iteration = atoi(values["number of finished iterations"].c_str());
+  resume.WordCounter =
+  atol(values["current position in training data"].c_str());
+  resume.NextBook = atoi(values["next book"].c_str());
+  resume.NextSentence = atoi(values["next sentence"].c_str());
+  resume.TrainLogProbability =
+  strtod(values["training log-probability"].c_str(), NULL);
+  resume.UniqueWordCounter = atoi(values["training unique words"].c_str());
+  resume.LastValidLogProbability =
+  strtod(values["last validation log-probability"].c_str(), NULL);
+  resume.LastValidAccuracy =
+  strtod(values["last validation accuracy"].c_str(), NULL);
+  resume.BestValidLogProbability =
+  strtod(values["best validation log-probability"].c_str(), NULL);
+  resume.BestValidAccuracy =
+  strtod(values["best validation accuracy"].c_str(), NULL);
+  resume.RandomGeneratorState = values["random generator"];
+  return true;
+}
+
+
+/**
+ * Load the last checkpoint saved during an epoch and the state
+ * of the training saved with it
+ */
+bool RnnTreeLM::LoadCheckpoint() {
+  string filename = m_rnnModelFile + ".checkpoint";
+  ResumeState resume;
+  if (!ParseResumeState(filename + ".resume", resume)) {
+    printf("Cannot read the training state %s.resume\n", filename.c_str());
+    return false;
+  }
+  LoadRnnModelFromFile(filename);
+  // The state is written after the model: if they do not match, the model
+  // was overwritten by a later checkpoint whose state was not written
+  if ((resume.Iteration != m_iteration)
+      || (resume.WordCounter != m_currentPosTrainFile)) {
+    printf("The training state %s.resume does not match the checkpoint\n",
+           filename.c_str());
+    return false;
+  }
+  if (!m_corpusTrain.SetBookOrder(resume.BookOrder)) {
+    printf("The books of the checkpoint differ from the training books\n");
+    return false;
+  }
+  if ((resume.NextBook < 0) || (resume.NextBook > m_corpusTrain.NumBooks())
+      || (resume.NextSentence < 0)
+      || !m_corpusTrain.SetRandomGeneratorState(resume.RandomGeneratorState)) {
+    printf("Invalid training state %s.resume\n", filename.c_str());
+    return false;
+  }
+  m_resume = resume;
+  m_resume.IsResuming = true;
+  return true;
 }
 
 
@@ -187,13 +334,35 @@ bool RnnTreeLM::TrainRnnModel() {
   double bestValidAccuracy = 0;
   // Word counter, saved at the end of last training session
   m_wordCounter = m_currentPosTrainFile;
-  // Keep track of the initial learning rate
-  m_initialLearningRate = m_learningRate;
+  if (m_resume.IsResuming) {
+    // The learning rate schedule continues from the checkpoint
+    lastValidLogProbability = m_resume.LastValidLogProbability;
+    lastValidAccuracy = m_resume.LastValidAccuracy;
+    bestValidLogProbability = m_resume.BestValidLogProbability;
+    bestValidAccuracy = m_resume.BestValidAccuracy;
+  } else {
+    // Keep track of the initial learning rate
+    m_initialLearningRate = m_learningRate;
+  }
 
   // Log file
   string logFilename = m_rnnModelFile + ".log.txt";
   Log("Starting training tree-dependent LM using list of books " +
       m_trainFile + "...\n", logFilename);
+
+  // The model is saved in the background while training continues
+  CheckpointWriter checkpointWriter;
+
+  // Synchronous training accumulates the gradients of each shard
+  // in a separate buffer, allocated once; these buffers only store
+  // the rows of the word embeddings and the direct n-grams they update
+  vector<RnnWeights> shardGradients;
+  for (int k = 0; k < m_numSyncShards; k++) {
+    shardGradients.push_back(m_weights.CreateSparseGradient());
+  }
+
+  // The training threads are started once for all the epochs
+  WorkStealingScheduler scheduler(m_numThreads);
   
   bool loopEpochs = true;
   while (loopEpochs) {
@@ -201,8 +370,23 @@ bool RnnTreeLM::TrainRnnModel() {
     double trainLogProbability = 0.0;
     // Unique word counter (count only once each word token in a sentence)
     int uniqueWordCounter = 0;
-    // Shuffle the order of the books
-    m_corpusTrain.ShuffleBooks();
+    int firstBook = 0;
+    int firstSentence = 0;
+    if (m_resume.IsResuming) {
+      // Resume the epoch at the sentence following the checkpoint,
+      // with the order of the books restored by LoadCheckpoint
+      trainLogProbability = m_resume.TrainLogProbability;
+      uniqueWordCounter = m_resume.UniqueWordCounter;
+      firstBook = m_resume.NextBook;
+      firstSentence = m_resume.NextSentence;
+      m_resume.IsResuming = false;
+      Log("Resuming training at book " + ConvString(firstBook) +
+          ", sentence " + ConvString(firstSentence) + "\n", logFilename);
+    } else {
+      // Shuffle the order of the books
+      m_corpusTrain.ShuffleBooks();
+    }
+    m_corpusTrain.RewindToBook(firstBook);
 
     // Print current epoch and learning rate
     Log("Iter: " + ConvString(m_iteration) +
@@ -210,143 +394,179 @@ bool RnnTreeLM::TrainRnnModel() {
     
     // Reset everything, including word history
     ResetAllRnnActivations(m_state);
-    
-    // Loop over the books
-    clock_t start = clock();
-    Log(ConvString(m_corpusTrain.NumBooks()) + " books to train on\n");
-    for (int idxBook = 0; idxBook < m_corpusTrain.NumBooks(); idxBook++) {
-      // Read the next book (training file)
-      m_corpusTrain.NextBook();
-      m_corpusTrain.ReadBook(m_typeOfDepLabels == 1);
-      BookUnrolls book = m_corpusTrain.m_currentBook;
-      
-      // Loop over the sentences in that book
-      book.ResetSentence();
-      for (int idxSentence = 0; idxSentence < book.NumSentences(); idxSentence++) {
-        // Initialize a map of log-likelihoods for each token
-        unordered_map<int, double> logProbSentence;
-        
-        // Loop over the unrolls in each sentence
-        book.ResetUnroll();
-        int numUnrolls = book.NumUnrolls(idxSentence);
-        for (int idxUnroll = 0; idxUnroll < numUnrolls; idxUnroll++) {
-          // Reset the state of the neural net before each unroll
-          ResetHiddenRnnStateAndWordHistory(m_state);
-          // Reset the dependency label features
-          // at the beginning of each unroll
-          ResetFeatureLabelVector(m_state);
-          
-          // At the beginning of an unroll,
-          // the last word is reset to </s> (end of sentence)
-          // and the last label is reset to 0 (root)
-          int contextWord = 0;
-          int contextLabel = 0;
-          
-          // Loop over the tokens in the sentence unroll
-          bool ok = true;
-          while (ok) {
-
-            // Get the current word, discount and label
-            int tokenNumber = book.CurrentTokenNumberInSentence();
-            int nextContextWord = book.CurrentTokenWordAsContext();
-            int targetWord = book.CurrentTokenWordAsTarget();
-            double discount = book.CurrentTokenDiscount();
-            int targetLabel = book.CurrentTokenLabel();
 
-            // Update the feature matrix with the last dependency label
-            if (m_typeOfDepLabels == 2) {
-              UpdateFeatureLabelVector(contextLabel, m_state);
-            }
+    // Each training thread uses its own state and BPTT buffers,
+    // but all the threads update the same weights
+    vector<RnnState> threadStates;
+    vector<RnnBptt> threadBpttVectors;
+    for (int k = 1; k < m_numThreads; k++) {
+      threadStates.push_back(CreateState());
+      threadBpttVectors.push_back(RnnBptt(GetHiddenSize(), GetFeatureSize(),
+                                          m_numBpttSteps, m_bpttBlockSize));
+    }
+    // The next books are read in the background during training
+    BookPrefetcher prefetcher(m_corpusTrain, m_typeOfDepLabels == 1,
+                              m_numPrefetchedBooks,
+                              m_corpusTrain.NumBooks() - firstBook);
 
-            // Run one step of the RNN to predict word
-            // from contextWord, contextLabel and the last hidden state
-            ForwardPropagateOneStep(contextWord, targetWord, m_state);
-
-            // For perplexity, we do not count OOV words...
-            if ((targetWord >= 0) && (targetWord != m_oov)) {
-              // Compute the log-probability of the current word
-              int outputNodeClass =
-              m_vocab.WordIndex2Class(targetWord) + GetVocabularySize();
-              double condProbaClass = m_state.OutputLayer[outputNodeClass];
-              double condProbaWordGivenClass = m_state.OutputLayer[targetWord];
-              double logProbabilityWord =
-              log10(condProbaClass * condProbaWordGivenClass);
-
-              // Did we see already that word token (at that position)
-              // in the sentence?
-              if (logProbSentence.find(tokenNumber) == logProbSentence.end()) {
-                // No: store the log-likelihood of that word
-                logProbSentence[tokenNumber] = logProbabilityWord;
-                // Contribute the log-likelihood to the sentence and corpus
-                trainLogProbability += logProbabilityWord;
-                uniqueWordCounter++;
-              }
-              m_wordCounter++;
-            }
-            
-            // Safety check (that log-likelihood does not diverge)
-            assert(!(trainLogProbability != trainLogProbability));
+    // Checkpoint of the model during the epoch, once m_numCheckpointWords
+    // words were trained on since the last one, with the state
+    // of the training needed to resume at sentence nextSentence
+    // of book nextBook. Checkpoints are taken between two sentences
+    // (between two steps of synchronous training, and between two books
+    // of Hogwild training); while the previous checkpoint is being written,
+    // the checkpoint is deferred to the next one of these points.
+    long nextCheckpointWords = m_wordCounter + m_numCheckpointWords;
+    bool isCheckpointDeferred = false;
+    auto saveCheckpoint = [&](int nextBook, int nextSentence) {
+      if ((m_numCheckpointWords <= 0) || (m_wordCounter < nextCheckpointWords)) {
+        return;
+      }
+      if (checkpointWriter.IsBusy()) {
+        if (!isCheckpointDeferred) {
+          Log("Checkpoint deferred: the previous one is still being written\n",
+              logFilename);
+          isCheckpointDeferred = true;
+        }
+        return;
+      }
+      m_currentPosTrainFile = m_wordCounter;
+      ResumeState resume;
+      resume.IsResuming = false;
+      resume.Iteration = m_iteration;
+      resume.WordCounter = m_wordCounter;
+      resume.BookOrder = m_corpusTrain.BookFilenames();
+      resume.NextBook = nextBook;
+      resume.NextSentence = nextSentence;
+      resume.RandomGeneratorState = m_corpusTrain.RandomGeneratorState();
+      resume.TrainLogProbability = trainLogProbability;
+      resume.UniqueWordCounter = uniqueWordCounter;
+      resume.LastValidLogProbability = lastValidLogProbability;
+      resume.LastValidAccuracy = lastValidAccuracy;
+      resume.BestValidLogProbability = bestValidLogProbability;
+      resume.BestValidAccuracy = bestValidAccuracy;
+      checkpointWriter.Save(*this, m_rnnModelFile + ".checkpoint", "",
+                            FormatResumeState(resume));
+      nextCheckpointWords = m_wordCounter + m_numCheckpointWords;
+      isCheckpointDeferred = false;
+    };
 
-            // Shift memory needed for BPTT to next time step
-            m_bpttVectors.Shift(contextWord);
+    // Loop over the books
+    clock_t start = clock();
+    Log(ConvString(m_corpusTrain.NumBooks()) + " books to train on\n");
+    for (int idxBook = firstBook; idxBook < m_corpusTrain.NumBooks(); idxBook++) {
+      // Take the next book (training file)
+      BookUnrolls book;
+      prefetcher.NextBook(book);
+      // A resumed epoch may start within its first book
+      int idxFirstSentence = (idxBook == firstBook) ? firstSentence : 0;
 
-            // Discount the learning rate to handle
-            // multiple occurrences of the same word
-            // in the dependency parse tree
-            double alphaBackup = m_learningRate;
-            m_learningRate *= discount;
-            
-            // Back-propagate the error and run one step of
-            // stochastic gradient descent (SGD) using optional
-            // back-propagation through time (BPTT)
-            BackPropagateErrorsThenOneStepGradientDescent(contextWord, targetWord);
+      if (m_numSyncShards > 0) {
+        // Synchronous training: the gradients of the shards are reduced
+        // then applied to the weights once per step
+        int numSentencesPerStep = m_numSyncShards * m_numSyncShardSentences;
+        for (int idxStep = idxFirstSentence; idxStep < book.NumSentences();
+             idxStep += numSentencesPerStep) {
+          TrainRnnOnStepSynchronously(book, idxStep, scheduler,
+                                      threadStates, threadBpttVectors,
+                                      shardGradients,
+                                      trainLogProbability, uniqueWordCounter);
+          if (idxStep + numSentencesPerStep < book.NumSentences()) {
+            saveCheckpoint(idxBook, idxStep + numSentencesPerStep);
+          }
+        }
+      } else if (m_numThreads > 1) {
+        // Hogwild-style training: the threads take sentences from the book
+        // and update the shared weights without locks; their updates
+        // (sparse for the direct n-grams and the word embeddings)
+        // rarely collide
+        vector<double> threadLogProbability(m_numThreads, 0.0);
+        vector<int> threadUniqueWordCounter(m_numThreads, 0);
+        vector<long> threadWordCounter(m_numThreads, m_wordCounter);
+        m_weights.IsSharedByThreads = true;
+        scheduler.Run(book.NumSentences() - idxFirstSentence,
+                      [&](int idxTask, int idxThread) {
+          RnnState &state =
+          (idxThread == 0) ? m_state : threadStates[idxThread - 1];
+          RnnBptt &bpttState =
+          (idxThread == 0) ? m_bpttVectors : threadBpttVectors[idxThread - 1];
+          TrainRnnOnSentence(book.GetSentence(idxFirstSentence + idxTask),
+                             state, bpttState,
+                             threadWordCounter[idxThread],
+                             threadLogProbability[idxThread],
+                             threadUniqueWordCounter[idxThread],
+                             m_regularizationRate, m_weights);
+        });
+        m_weights.IsSharedByThreads = false;
+        if (m_weights.HasScaleUnderflow()) {
+          cout << "RnnWeights: the scale of the weights to the hidden layer "
+          << "underflows within a book; reduce -beta or the size of the books"
+          << endl;
+          throw runtime_error("Underflow of the scale of the weights");
+        }
+        long numWords = 0;
+        for (int k = 0; k < m_numThreads; k++) {
+          trainLogProbability += threadLogProbability[k];
+          uniqueWordCounter += threadUniqueWordCounter[k];
+          numWords += threadWordCounter[k] - m_wordCounter;
+        }
+        m_wordCounter += numWords;
+      }
+      if ((m_numSyncShards > 0) || (m_numThreads > 1)) {
+        // Safety check (that log-likelihood does not diverge)
+        assert(!(trainLogProbability != trainLogProbability));
 
-            // Undiscount the learning rate
-            m_learningRate = alphaBackup;
-            
-            // Store the current state s(t) at the end of the input layer
-            // vector so that it can be used as s(t-1) at the next step
-            ForwardPropagateRecurrentConnectionOnly(m_state);
-            
-            // Rotate the word history by one: the current context word
-            // (potentially enriched by dependency label information)
-            // will be used at next iteration as input to the RNN
-            ForwardPropagateWordHistory(m_state, contextWord, nextContextWord);
-            // Update the last label
-            contextLabel = targetLabel;
-
-            // Go to the next word
-            ok = (book.NextTokenInUnroll() >= 0);
-          } // Loop over tokens in the unroll of a sentence
-          book.NextUnrollInSentence();
-
-          // Reset the BPTT at every unroll
-          m_bpttVectors.Reset();
-
-        } // Loop over unrolls of a sentence
-        
         // Verbose
-        if (((idxSentence % 1000) == 0) && (idxSentence > 0)) {
-          clock_t now = clock();
-          double entropy =
-          -trainLogProbability/log10((double)2) / uniqueWordCounter;
-          double perplexity =
-          ExponentiateBase10(-trainLogProbability / (double)uniqueWordCounter);
-          Log("Iter," + ConvString(m_iteration) +
-              ",Alpha," + ConvString(m_learningRate) +
-              ",Book," + ConvString(idxBook) +
-              ",TRAINent," + ConvString(entropy) +
-              ",TRAINppx," + ConvString(perplexity) +
-              ",words/sec," +
-              ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
-              logFilename);
-        }
+        clock_t now = clock();
+        double entropy =
+        -trainLogProbability/log10((double)2) / uniqueWordCounter;
+        double perplexity =
+        ExponentiateBase10(-trainLogProbability / (double)uniqueWordCounter);
+        Log("Iter," + ConvString(m_iteration) +
+            ",Alpha," + ConvString(m_learningRate) +
+            ",Book," + ConvString(idxBook) +
+            ",TRAINent," + ConvString(entropy) +
+            ",TRAINppx," + ConvString(perplexity) +
+            ",words/sec," +
+            ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
+            logFilename);
+      } else {
+        // Loop over the sentences in that book
+        for (int idxSentence = idxFirstSentence;
+             idxSentence < book.NumSentences(); idxSentence++) {
+          TrainRnnOnSentence(book.GetSentence(idxSentence),
+                             m_state, m_bpttVectors, m_wordCounter,
+                             trainLogProbability, uniqueWordCounter,
+                             m_regularizationRate, m_weights);
+          if (idxSentence + 1 < book.NumSentences()) {
+            saveCheckpoint(idxBook, idxSentence + 1);
+          }
         
-        // Reset the table of word token probabilities
-        logProbSentence.clear();
+          // Verbose
+          if (((idxSentence % 1000) == 0) && (idxSentence > 0)) {
+            clock_t now = clock();
+            double entropy =
+            -trainLogProbability/log10((double)2) / uniqueWordCounter;
+            double perplexity =
+            ExponentiateBase10(-trainLogProbability / (double)uniqueWordCounter);
+            Log("Iter," + ConvString(m_iteration) +
+                ",Alpha," + ConvString(m_learningRate) +
+                ",Book," + ConvString(idxBook) +
+                ",TRAINent," + ConvString(entropy) +
+                ",TRAINppx," + ConvString(perplexity) +
+                ",words/sec," +
+                ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
+                logFilename);
+          }
+        } // loop over sentences for one epoch
+      }
+
+      // Fold the scales of the lazily decayed weights into the weights
+      // while no thread is updating them
+      m_weights.Renormalize();
 
-        book.NextSentence();
-      } // loop over sentences for one epoch
+      // Checkpoint of the model between two books
+      saveCheckpoint(idxBook + 1, 0);
 
       // Clear memory
       book.Burn();
@@ -418,8 +638,8 @@ bool RnnTreeLM::TrainRnnModel() {
       m_iteration++;
       // Save the best model
       if (validAccuracy > bestValidAccuracy) {
-        SaveRnnModelToFile();
-        SaveWordEmbeddings(m_rnnModelFile + ".word_embeddings.txt");
+        checkpointWriter.Save(*this, m_rnnModelFile,
+                              m_rnnModelFile + ".word_embeddings.txt");
         Log("Saved the best model so far\n", logFilename);
         bestValidAccuracy = validAccuracy;
         bestValidLogProbability = validLogProbability;
@@ -431,11 +651,706 @@ bool RnnTreeLM::TrainRnnModel() {
 }
 
 
+/**
+ * Train the RNN on all the unrolls of one sentence, using the given state
+ * and BPTT buffers, and accumulate the log-probability of the word tokens
+ * (counted once per token) and the number of words.
+ * The updates are applied to updatedWeights.
+ */
+void RnnTreeLM::TrainRnnOnSentence(const Sentence &sentence,
+                                   RnnState &state,
+                                   RnnBptt &bpttState,
+                                   long &wordCounter,
+                                   double &logProbability,
+                                   int &uniqueWordCounter,
+                                   double regularizationRate,
+                                   RnnWeights &updatedWeights) {
+  if (m_useSharedPrefixTraining) {
+    TrainRnnOnSentenceTrie(sentence, state, bpttState,
+                           wordCounter, logProbability, uniqueWordCounter,
+                           regularizationRate, updatedWeights);
+    return;
+  }
+
+  // Initialize a map of log-likelihoods for each token
+  unordered_map<int, double> logProbSentence;
+  
+  // Loop over the unrolls in each sentence
+  for (size_t idxUnroll = 0; idxUnroll < sentence.size(); idxUnroll++) {
+    const Unroll &unroll = sentence[idxUnroll];
+    // Reset the state of the neural net before each unroll
+    ResetHiddenRnnStateAndWordHistory(state);
+    // Reset the dependency label features
+    // at the beginning of each unroll
+    ResetFeatureLabelVector(state);
+    
+    // At the beginning of an unroll,
+    // the last word is reset to </s> (end of sentence)
+    // and the last label is reset to 0 (root)
+    int contextWord = 0;
+    int contextLabel = 0;
+    
+    // Loop over the tokens in the sentence unroll
+    for (size_t idxToken = 0; idxToken < unroll.size(); idxToken++) {
+
+      // Get the current word, discount and label
+      int tokenNumber = unroll[idxToken].pos;
+      int nextContextWord = unroll[idxToken].wordAsContext;
+      int targetWord = unroll[idxToken].wordAsTarget;
+      double discount = unroll[idxToken].Discount();
+      int targetLabel = unroll[idxToken].label;
+
+      // Update the feature matrix with the last dependency label
+      if (m_typeOfDepLabels == 2) {
+        UpdateFeatureLabelVector(contextLabel, state);
+      }
+
+      // Run one step of the RNN to predict word
+      // from contextWord, contextLabel and the last hidden state
+      ForwardPropagateOneStep(contextWord, targetWord, state);
+
+      // For perplexity, we do not count OOV words...
+      if ((targetWord >= 0) && (targetWord != m_oov)) {
+        // Compute the log-probability of the current word
+        int outputNodeClass =
+        m_vocab.WordIndex2Class(targetWord) + GetVocabularySize();
+        double condProbaClass = state.OutputLayer[outputNodeClass];
+        double condProbaWordGivenClass = state.OutputLayer[targetWord];
+        double logProbabilityWord =
+        log10(condProbaClass * condProbaWordGivenClass);
+
+        // Did we see already that word token (at that position)
+        // in the sentence?
+        if (logProbSentence.find(tokenNumber) == logProbSentence.end()) {
+          // No: store the log-likelihood of that word
+          logProbSentence[tokenNumber] = logProbabilityWord;
+          // Contribute the log-likelihood to the sentence and corpus
+          logProbability += logProbabilityWord;
+          uniqueWordCounter++;
+        }
+        wordCounter++;
+      }
+      
+      // Safety check (that log-likelihood does not diverge)
+      assert(!(logProbability != logProbability));
+
+      // Shift memory needed for BPTT to next time step
+      bpttState.Shift(contextWord);
+
+      // Back-propagate the error and run one step of
+      // stochastic gradient descent (SGD) using optional
+      // back-propagation through time (BPTT);
+      // the learning rate is discounted to handle
+      // multiple occurrences of the same word
+      // in the dependency parse tree
+      BackPropagateErrorsThenOneStepGradientDescent(contextWord, targetWord,
+                                                    m_learningRate * discount,
+                                                    regularizationRate,
+                                                    wordCounter,
+                                                    state, bpttState,
+                                                    updatedWeights);
+      
+      // Store the current state s(t) at the end of the input layer
+      // vector so that it can be used as s(t-1) at the next step
+      ForwardPropagateRecurrentConnectionOnly(state);
+      
+      // Rotate the word history by one: the current context word
+      // (potentially enriched by dependency label information)
+      // will be used at next iteration as input to the RNN
+      ForwardPropagateWordHistory(state, contextWord, nextContextWord);
+      // Update the last label
+      contextLabel = targetLabel;
+    } // Loop over tokens in the unroll of a sentence
+
+    // Reset the BPTT at every unroll
+    bpttState.Reset();
+  } // Loop over unrolls of a sentence
+}
+
+
+/**
+ * Train the RNN on all the unrolls of one sentence, organized as a prefix
+ * trie. The forward pass visits each node of the trie once; at each node,
+ * the errors on its children are back-propagated to the output layer
+ * (whose weights are updated by SGD, as in TrainRnnOnSentence) and
+ * accumulated, weighted by the discounts of the tokens, in the gradient
+ * w.r.t. the hidden state of the node. The backward pass then visits
+ * the nodes in reverse order (children before parents), back-propagating
+ * these gradients through the trie (BPTT over the whole prefix of each
+ * token), and the weights to the hidden layer are updated once.
+ */
+void RnnTreeLM::TrainRnnOnSentenceTrie(const Sentence &sentence,
+                                       RnnState &state,
+                                       RnnBptt &bpttState,
+                                       long &wordCounter,
+                                       double &logProbability,
+                                       int &uniqueWordCounter,
+                                       double regularizationRate,
+                                       RnnWeights &updatedWeights) {
+  SentenceTrie trie;
+  trie.Build(sentence);
+  int numNodes = trie.NumNodes();
+  int sizeHidden = GetHiddenSize();
+  int sizeFeature = GetFeatureSize();
+
+  // Allocate the activations and gradients at each node of the trie
+  TrieTraining nodes;
+  nodes.Recurrent.assign((long)numNodes * sizeHidden, 0);
+  nodes.Hidden.assign((long)numNodes * sizeHidden, 0);
+  nodes.Features.assign((long)numNodes * sizeFeature, 0);
+  nodes.WordHistory.assign((long)numNodes * c_maxNGramOrder, 0);
+  nodes.HiddenGradient.assign((long)numNodes * sizeHidden, 0);
+  nodes.RecurrentGradient.assign((long)numNodes * sizeHidden, 0);
+  nodes.ContextWord.assign(numNodes, -1);
+  nodes.IsHiddenComputed.assign(numNodes, false);
+  nodes.Weight.assign(numNodes, 0.0);
+  nodes.NumTokens.assign(numNodes, 0);
+  nodes.WordCounter = wordCounter;
+  nodes.HiddenLayerDecay = 1.0;
+  nodes.LogProbability = 0.0;
+  nodes.UniqueWordCounter = 0;
+  // The learning rate of a node is discounted by the sum of the discounts
+  // of its tokens, which handles multiple occurrences of the same word
+  // in the dependency parse tree
+  for (size_t idxUnroll = 0; idxUnroll < sentence.size(); idxUnroll++) {
+    for (size_t idxToken = 0; idxToken < sentence[idxUnroll].size(); idxToken++) {
+      int node = trie.NodeOfToken((int)idxUnroll, (int)idxToken);
+      nodes.Weight[node] += sentence[idxUnroll][idxToken].Discount();
+      nodes.NumTokens[node]++;
+    }
+  }
+
+  // Forward pass: at the beginning of each unroll, the state of the neural
+  // net and the dependency label features are reset, the last word is reset
+  // to </s> (end of sentence) and the last label is reset to 0 (root)
+  ResetHiddenRnnStateAndWordHistory(state);
+  ResetFeatureLabelVector(state);
+  TrainTrieNode(trie, 0, 0, 0, regularizationRate, state, nodes,
+                updatedWeights);
+  // The other nodes are visited depth-first, in the order of the children,
+  // using a stack of (node, parent) pairs. The state entering a node
+  // is restored from the rows stored at its parent: s(t-1) for the child
+  // of an OOV word, s(t) otherwise, the features and the word history.
+  // The leaves have no children to predict, so they are not visited.
+  vector<pair<int, int> > stack;
+  int node = 0;
+  while (true) {
+    const vector<int> &children = trie.GetNode(node).children;
+    for (size_t c = children.size(); c > 0; c--) {
+      if (!trie.GetNode(children[c - 1]).children.empty()) {
+        stack.push_back(make_pair(children[c - 1], node));
+      }
+    }
+    if (stack.empty()) {
+      break;
+    }
+    node = stack.back().first;
+    int parent = stack.back().second;
+    stack.pop_back();
+    const Token &token = trie.GetNode(node).token;
+    const vector<real> &hidden =
+    (token.wordAsTarget == -1) ? nodes.Recurrent : nodes.Hidden;
+    std::copy(hidden.begin() + (long)parent * sizeHidden,
+              hidden.begin() + (long)(parent + 1) * sizeHidden,
+              state.HiddenLayer.begin());
+    std::copy(hidden.begin() + (long)parent * sizeHidden,
+              hidden.begin() + (long)(parent + 1) * sizeHidden,
+              state.RecurrentLayer.begin());
+    std::copy(nodes.Features.begin() + (long)parent * sizeFeature,
+              nodes.Features.begin() + (long)(parent + 1) * sizeFeature,
+              state.FeatureLayer.begin());
+    std::copy(nodes.WordHistory.begin() + (long)parent * c_maxNGramOrder,
+              nodes.WordHistory.begin() + (long)(parent + 1) * c_maxNGramOrder,
+              state.WordHistory.begin());
+    int contextWord = -1;
+    ForwardPropagateWordHistory(state, contextWord, token.wordAsContext);
+    TrainTrieNode(trie, node, contextWord, token.label, regularizationRate,
+                  state, nodes, updatedWeights);
+  }
+  wordCounter = nodes.WordCounter;
+  logProbability += nodes.LogProbability;
+  uniqueWordCounter += nodes.UniqueWordCounter;
+
+  // Safety check (that log-likelihood does not diverge)
+  assert(!(logProbability != logProbability));
+
+  // Backward pass: children have larger indexes than their parents
+  double alpha = m_learningRate;
+  vector<real> hiddenGradient(sizeHidden);
+  vector<real> recurrentGradient(sizeHidden);
+  for (int node = numNodes - 1; node >= 0; node--) {
+    const vector<int> &children = trie.GetNode(node).children;
+    real *gradientNode = &nodes.HiddenGradient[(long)node * sizeHidden];
+    real *recurrentGradientNode =
+    &nodes.RecurrentGradient[(long)node * sizeHidden];
+    // The children of an OOV word start from s(t-1) of the node,
+    // the other children from s(t)
+    for (size_t c = 0; c < children.size(); c++) {
+      const real *recurrentGradientChild =
+      &nodes.RecurrentGradient[(long)children[c] * sizeHidden];
+      bool isOov = (trie.GetNode(children[c]).token.wordAsTarget == -1);
+      real *gradientToChild = isOov ? recurrentGradientNode : gradientNode;
+      for (int a = 0; a < sizeHidden; a++) {
+        gradientToChild[a] += recurrentGradientChild[a];
+      }
+    }
+    if (!nodes.IsHiddenComputed[node]) {
+      continue;
+    }
+
+    // Gradient w.r.t. the input of the sigmoid of the hidden layer
+    const real *hiddenNode = &nodes.Hidden[(long)node * sizeHidden];
+    for (int a = 0; a < sizeHidden; a++) {
+      double dLdSa = hiddenNode[a];
+      gradientNode[a] = gradientNode[a] * dLdSa * (1 - dLdSa);
+      hiddenGradient[a] = gradientNode[a];
+    }
+
+    // Backprop hidden -> input
+    int word = nodes.ContextWord[node];
+    if (word != -1) {
+      real *rowGradInput2Hidden = bpttState.GradientInput2Hidden(word);
+      for (int a = 0; a < sizeHidden; a++) {
+        rowGradInput2Hidden[a] += alpha * gradientNode[a];
+      }
+    }
+
+    // Backprop hidden -> recurrent (without BPTT, the gradient
+    // is not propagated to the previous nodes)
+    if (m_numBpttSteps > 1) {
+      recurrentGradient.assign(recurrentGradientNode,
+                               recurrentGradientNode + sizeHidden);
+      GradientMatrixXvectorBlas(recurrentGradient,
+                                hiddenGradient,
+                                m_weights.Recurrent2Hidden,
+                                m_weights.ScaleRecurrent2Hidden,
+                                sizeHidden,
+                                0,
+                                sizeHidden);
+      for (int a = 0; a < sizeHidden; a++) {
+        recurrentGradientNode[a] = recurrentGradient[a];
+      }
+    }
+  }
+
+  // Lazy weight decay of the weights to the hidden layer,
+  // which are then updated up to their scales
+  double coeffSGD = nodes.HiddenLayerDecay;
+  updatedWeights.DecayHiddenLayerWeights(coeffSGD);
+
+  // Weight update for recurrent weights, summing over the nodes
+  // the hidden gradients times the previous hidden activations
+  MultiplyTransposedMatrixXmatrixBlas(nodes.HiddenGradient,
+                                      nodes.Recurrent,
+                                      updatedWeights.Recurrent2Hidden,
+                                      alpha / updatedWeights.ScaleRecurrent2Hidden,
+                                      numNodes,
+                                      sizeHidden,
+                                      sizeHidden);
+
+  // Weight update for feature-hidden weights, summing over the nodes
+  // the hidden gradients times the features
+  if (sizeFeature > 0) {
+    MultiplyTransposedMatrixXmatrixBlas(nodes.HiddenGradient,
+                                        nodes.Features,
+                                        updatedWeights.Features2Hidden,
+                                        alpha / updatedWeights.ScaleFeatures2Hidden,
+                                        numNodes,
+                                        sizeHidden,
+                                        sizeFeature);
+  }
+
+  // Weight update for the input weights of the context words
+  bpttState.ApplyTouchedGradientsInput2Hidden(updatedWeights, coeffSGD);
+}
+
+
+/**
+ * Forward-propagate the children of a node of the trie (as in
+ * ForwardPropagateTrieNode) and back-propagate their errors to the output
+ * layer, storing the activations and the gradient w.r.t. the hidden state
+ * of the node
+ */
+void RnnTreeLM::TrainTrieNode(const SentenceTrie &trie,
+                              int node,
+                              int contextWord,
+                              int contextLabel,
+                              double regularizationRate,
+                              RnnState &state,
+                              TrieTraining &nodes,
+                              RnnWeights &updatedWeights) {
+  const vector<int> &children = trie.GetNode(node).children;
+  if (children.empty()) {
+    return;
+  }
+  int sizeHidden = GetHiddenSize();
+  int sizeFeature = GetFeatureSize();
+
+  if (m_typeOfDepLabels == 2) {
+    // Update the feature matrix with the last dependency label
+    UpdateFeatureLabelVector(contextLabel, state);
+  }
+  // Store the inputs to the hidden layer at that node
+  std::copy(state.RecurrentLayer.begin(), state.RecurrentLayer.end(),
+            nodes.Recurrent.begin() + (long)node * sizeHidden);
+  std::copy(state.FeatureLayer.begin(), state.FeatureLayer.end(),
+            nodes.Features.begin() + (long)node * sizeFeature);
+  std::copy(state.WordHistory.begin(), state.WordHistory.end(),
+            nodes.WordHistory.begin() + (long)node * c_maxNGramOrder);
+  nodes.ContextWord[node] = contextWord;
+
+  // All the children share the hidden state s(t), computed from
+  // contextWord, contextLabel and the last hidden state;
+  // only the outputs of the target class differ between children
+  real *gradientNode = &nodes.HiddenGradient[(long)node * sizeHidden];
+  for (size_t c = 0; c < children.size(); c++) {
+    int child = children[c];
+    const Token &token = trie.GetNode(child).token;
+    int targetWord = token.wordAsTarget;
+    if (targetWord == -1) {
+      // Nothing is propagated for OOV words
+      continue;
+    }
+    if (!nodes.IsHiddenComputed[node]) {
+      // Run one step of the RNN to predict word
+      ForwardPropagateOneStep(contextWord, targetWord, state);
+      std::copy(state.HiddenLayer.begin(), state.HiddenLayer.end(),
+                nodes.Hidden.begin() + (long)node * sizeHidden);
+      nodes.IsHiddenComputed[node] = true;
+    } else {
+      // Only compute the softmax for the words in the target class
+      ComputeRnnOutputsForGivenClass(m_vocab.WordIndex2Class(targetWord),
+                                     state);
+    }
+
+    // For perplexity, we do not count OOV words...
+    long wordCounterBefore = nodes.WordCounter;
+    if (targetWord != m_oov) {
+      // Compute the log-probability of the current word
+      // once for each word token in the sentence
+      if (nodes.CountedPositions.insert(token.pos).second) {
+        int outputNodeClass =
+        m_vocab.WordIndex2Class(targetWord) + GetVocabularySize();
+        double condProbaClass = state.OutputLayer[outputNodeClass];
+        double condProbaWordGivenClass = state.OutputLayer[targetWord];
+        nodes.LogProbability +=
+        log10(condProbaClass * condProbaWordGivenClass);
+        nodes.UniqueWordCounter++;
+      }
+      nodes.WordCounter += nodes.NumTokens[child];
+    }
+    // Regularization is done every 10th step, as if the tokens of the node
+    // were trained one by one: once per multiple of 10 crossed by the word
+    // counter (or once per token, if an OOV word leaves it on a multiple)
+    int numDecaySteps = (int)(nodes.WordCounter / 10 - wordCounterBefore / 10);
+    if ((nodes.WordCounter == wordCounterBefore) &&
+        ((nodes.WordCounter % 10) == 0)) {
+      numDecaySteps = nodes.NumTokens[child];
+    }
+    // The decay of the weights to the hidden layer is discounted
+    // like the learning rate of each token, as in TrainRnnOnSentence
+    // (the tokens of a node share their discount)
+    double discount = nodes.Weight[child] / nodes.NumTokens[child];
+    nodes.HiddenLayerDecay *=
+    pow(1.0 - regularizationRate * m_learningRate * discount, numDecaySteps);
+
+    // Back-propagate the error to the hidden layer and run one step of SGD
+    // on the weights to the output layer, with the learning rate
+    // discounted by the weight of the child, then accumulate
+    // the weighted gradient w.r.t. the hidden layer
+    double weight = nodes.Weight[child];
+    BackPropagateOutputLayer(targetWord,
+                             m_learningRate * weight,
+                             regularizationRate,
+                             numDecaySteps,
+                             state, updatedWeights);
+    for (int a = 0; a < sizeHidden; a++) {
+      gradientNode[a] += weight * state.HiddenGradient[a];
+    }
+  }
+
+  // The input w(t) of the node is no longer needed
+  if (contextWord != -1) {
+    state.InputLayer[contextWord] = 0;
+  }
+}
+
+
+/**
+ * One step of synchronous data-parallel training, on the sentences
+ * of a book starting at idxStep. The gradients of m_numSyncShards shards
+ * of m_numSyncShardSentences consecutive sentences are computed
+ * in parallel, each shard starting from a reset state and accumulating
+ * its gradients in its own buffer; the buffers are summed in a fixed order
+ * (pairwise tree reduction) and applied to the weights, so that
+ * the result does not depend on the number of threads.
+ */
+void RnnTreeLM::TrainRnnOnStepSynchronously(const BookUnrolls &book,
+                                            int idxStep,
+                                            WorkStealingScheduler &scheduler,
+                                            vector<RnnState> &threadStates,
+                                            vector<RnnBptt> &threadBpttVectors,
+                                            vector<RnnWeights> &shardGradients,
+                                            double &logProbability,
+                                            int &uniqueWordCounter) {
+  int numShards = m_numSyncShards;
+  vector<double> shardLogProbability(numShards);
+  vector<int> shardUniqueWordCounter(numShards);
+  vector<long> shardWordCounter(numShards);
+  // Compute the gradients on each shard
+  scheduler.Run(numShards, [&](int idxShard, int idxThread) {
+    RnnState &state =
+    (idxThread == 0) ? m_state : threadStates[idxThread - 1];
+    RnnBptt &bpttState =
+    (idxThread == 0) ? m_bpttVectors : threadBpttVectors[idxThread - 1];
+    ResetAllRnnActivations(state);
+    state.RecurrentGradient.assign(state.RecurrentGradient.size(), 0);
+    bpttState.Reset();
+    bpttState.ResetGradients();
+    shardGradients[idxShard].SetToZero();
+    shardLogProbability[idxShard] = 0;
+    shardUniqueWordCounter[idxShard] = 0;
+    shardWordCounter[idxShard] = m_wordCounter;
+    int idxFirst = idxStep + idxShard * m_numSyncShardSentences;
+    int idxLast = min(idxFirst + m_numSyncShardSentences,
+                      book.NumSentences());
+    for (int idxSentence = idxFirst; idxSentence < idxLast; idxSentence++) {
+      // Regularization is applied once per step, on the weights
+      TrainRnnOnSentence(book.GetSentence(idxSentence), state, bpttState,
+                         shardWordCounter[idxShard],
+                         shardLogProbability[idxShard],
+                         shardUniqueWordCounter[idxShard],
+                         0.0, shardGradients[idxShard]);
+    }
+  });
+
+  // Sum the gradients of the shards by pairwise tree reduction:
+  // the buffer of shard k receives the sum over shards [k, k + 2 * stride[
+  for (int stride = 1; stride < numShards; stride *= 2) {
+    int numPairs = (numShards - stride + 2 * stride - 1) / (2 * stride);
+    scheduler.Run(numPairs, [&](int idxPair, int) {
+      int k = idxPair * 2 * stride;
+      shardGradients[k].Add(shardGradients[k + stride]);
+    });
+  }
+
+  // Merge the statistics of the shards, in order
+  long numWords = 0;
+  for (int k = 0; k < numShards; k++) {
+    logProbability += shardLogProbability[k];
+    uniqueWordCounter += shardUniqueWordCounter[k];
+    numWords += shardWordCounter[k] - m_wordCounter;
+  }
+  m_wordCounter += numWords;
+
+  // Apply the gradients, with the L2 weight decay that SGD
+  // would have applied every 10 words during the step
+  double decay = pow(1 - m_regularizationRate * m_learningRate,
+                     numWords / 10.0);
+  m_weights.Update(shardGradients[0], decay);
+}
+
+
+/**
+ * Compute the log-probability of each token in each unroll of a sentence,
+ * using the given state. The unrolls share their prefixes (the path
+ * from the root of the dependency tree), so they are organized as a prefix
+ * trie and each node of the trie is forward-propagated only once.
+ */
+void RnnTreeLM::ForwardPropagateUnrolls(const Sentence &sentence,
+                                        RnnState &state,
+                                        vector<vector<double> > &logProbabilities) const {
+  SentenceTrie trie;
+  trie.Build(sentence);
+
+  // At the beginning of each unroll, the state of the neural net
+  // and the dependency label features are reset,
+  // the last word is reset to </s> (end of sentence)
+  // and the last label is reset to 0 (root)
+  ResetHiddenRnnStateAndWordHistory(state);
+  ResetFeatureLabelVector(state);
+  vector<double> logProbNodes(trie.NumNodes(), 0.0);
+  ForwardPropagateTrieNode(trie, 0, 0, 0, state, logProbNodes);
+
+  // Read the log-probability of each token from its node
+  logProbabilities.resize(sentence.size());
+  for (size_t idxUnroll = 0; idxUnroll < sentence.size(); idxUnroll++) {
+    size_t numTokens = sentence[idxUnroll].size();
+    logProbabilities[idxUnroll].resize(numTokens);
+    for (size_t idxToken = 0; idxToken < numTokens; idxToken++) {
+      logProbabilities[idxUnroll][idxToken] =
+      logProbNodes[trie.NodeOfToken((int)idxUnroll, (int)idxToken)];
+    }
+  }
+}
+
+
+/**
+ * Compute the log-probability of the tokens of all the children
+ * of a node of the trie, then recurse into the children
+ */
+void RnnTreeLM::ForwardPropagateTrieNode(const SentenceTrie &trie,
+                                         int node,
+                                         int contextWord,
+                                         int contextLabel,
+                                         RnnState &state,
+                                         vector<double> &logProbNodes) const {
+  const vector<int> &children = trie.GetNode(node).children;
+  if (children.empty()) {
+    return;
+  }
+
+  if (m_typeOfDepLabels == 2) {
+    // Update the feature matrix with the last dependency label
+    UpdateFeatureLabelVector(contextLabel, state);
+  }
+
+  // All the children share the hidden state s(t), computed from
+  // contextWord, contextLabel and the last hidden state;
+  // only the outputs of the target class differ between children
+  bool isHiddenComputed = false;
+  for (size_t c = 0; c < children.size(); c++) {
+    int targetWord = trie.GetNode(children[c]).token.wordAsTarget;
+    if (targetWord == -1) {
+      // Nothing is propagated for OOV words
+      continue;
+    }
+    if (!isHiddenComputed) {
+      // Run one step of the RNN to predict word
+      ForwardPropagateOneStep(contextWord, targetWord, state);
+      isHiddenComputed = true;
+    } else {
+      // Only compute the softmax for the words in the target class
+      ComputeRnnOutputsForGivenClass(m_vocab.WordIndex2Class(targetWord),
+                                     state);
+    }
+    // Compute the log-probability of the current word
+    if (targetWord != m_oov) {
+      int outputNodeClass =
+      m_vocab.WordIndex2Class(targetWord) + GetVocabularySize();
+      double condProbaClass =
+      state.OutputLayer[outputNodeClass];
+      double condProbaWordGivenClass =
+      state.OutputLayer[targetWord];
+      logProbNodes[children[c]] =
+      log10(condProbaClass * condProbaWordGivenClass);
+    }
+  }
+
+  if (children.size() == 1) {
+    // No branching: simply carry on with the state
+    const Token &token = trie.GetNode(children[0]).token;
+    // Store the current state s(t) at the end of the input layer vector
+    // so that it can be used as s(t-1) at the next step
+    // (for an OOV word, s(t) was left untouched and equals s(t-1))
+    ForwardPropagateRecurrentConnectionOnly(state);
+    // Rotate the word history by one: the current context word
+    // (potentially enriched by dependency label information)
+    // will be used at next iteration as input to the RNN
+    ForwardPropagateWordHistory(state, contextWord, token.wordAsContext);
+    ForwardPropagateTrieNode(trie, children[0], contextWord, token.label,
+                             state, logProbNodes);
+    return;
+  }
+
+  // Branch point: snapshot the state s(t-1) (to which an OOV child
+  // returns), the state s(t), the feature vector and the word history,
+  // and resume from them for each child
+  vector<real> snapshotRecurrent = state.RecurrentLayer;
+  vector<real> snapshotHidden = state.HiddenLayer;
+  vector<real> snapshotFeatures = state.FeatureLayer;
+  vector<int> snapshotWordHistory = state.WordHistory;
+  for (size_t c = 0; c < children.size(); c++) {
+    const Token &token = trie.GetNode(children[c]).token;
+    const vector<real> &hidden =
+    (token.wordAsTarget == -1) ? snapshotRecurrent : snapshotHidden;
+    state.HiddenLayer = hidden;
+    state.RecurrentLayer = hidden;
+    state.FeatureLayer = snapshotFeatures;
+    state.WordHistory = snapshotWordHistory;
+    int nextContextWord = contextWord;
+    ForwardPropagateWordHistory(state, nextContextWord,
+                                token.wordAsContext);
+    ForwardPropagateTrieNode(trie, children[c], nextContextWord, token.label,
+                             state, logProbNodes);
+  }
+}
+
+
+/**
+ * Compute the log-probability of each token in each unroll of a sentence,
+ * forward-propagating up to m_batchSize unrolls together through the RNN
+ */
+void RnnTreeLM::ForwardPropagateUnrollsBatch(const Sentence &sentence,
+                                             vector<vector<double> > &logProbabilities) const {
+  int numUnrolls = (int)sentence.size();
+  int sizeFeature = GetFeatureSize();
+  logProbabilities.resize(numUnrolls);
+  for (int idxFrom = 0; idxFrom < numUnrolls; idxFrom += m_batchSize) {
+    int numStreams = min(m_batchSize, numUnrolls - idxFrom);
+    RnnBatchState batch(numStreams, GetHiddenSize(), sizeFeature,
+                        GetCompressSize(), GetNumClasses());
+    size_t maxLength = 0;
+    for (int i = 0; i < numStreams; i++) {
+      // Reset the state and the dependency label features of each unroll
+      ResetBatchStream(batch, i);
+      logProbabilities[idxFrom + i].assign(sentence[idxFrom + i].size(), 0.0);
+      maxLength = max(maxLength, sentence[idxFrom + i].size());
+    }
+
+    // At the beginning of an unroll,
+    // the last word is reset to </s> (end of sentence)
+    // and the last label is reset to 0 (root)
+    vector<int> contextWords(numStreams, 0);
+    vector<int> contextLabels(numStreams, 0);
+    vector<int> targetWords(numStreams, -1);
+    for (size_t idxToken = 0; idxToken < maxLength; idxToken++) {
+      // Unrolls that are already finished do not have a target word
+      for (int i = 0; i < numStreams; i++) {
+        const Unroll &unroll = sentence[idxFrom + i];
+        targetWords[i] = -1;
+        if (idxToken < unroll.size()) {
+          targetWords[i] = unroll[idxToken].wordAsTarget;
+          if (m_typeOfDepLabels == 2) {
+            // Update the feature matrix with the last dependency label
+            UpdateFeatureLabelVector(contextLabels[i],
+                                     &batch.FeatureLayer[i * sizeFeature]);
+          }
+        }
+      }
+
+      // Run one step of the RNN on all the unrolls
+      ForwardPropagateBatch(contextWords, targetWords, batch);
+
+      // Compute the log-probability of the current words
+      for (int i = 0; i < numStreams; i++) {
+        const Unroll &unroll = sentence[idxFrom + i];
+        if (idxToken >= unroll.size()) {
+          continue;
+        }
+        int targetWord = targetWords[i];
+        if ((targetWord >= 0) && (targetWord != m_oov)) {
+          double condProbaClass = batch.ClassProbability[i];
+          double condProbaWordGivenClass = batch.WordProbability[i];
+          logProbabilities[idxFrom + i][idxToken] =
+          log10(condProbaClass * condProbaWordGivenClass);
+        }
+        contextWords[i] = unroll[idxToken].wordAsContext;
+        contextLabels[i] = unroll[idxToken].label;
+      }
+
+      // Rotate the word histories by one
+      ForwardPropagateBatchWordHistory(contextWords, batch);
+    }
+  }
+}
+
+
 /**
  * Test a Recurrent Neural Network model on a test file
  */
 bool RnnTreeLM::TestRnnModel(const string &testFile,
-                             const string &featureFile,
+                             const string &,
                              vector<double> &sentenceScores,
                              double &logProbability,
                              double &perplexity,
@@ -466,36 +1381,67 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
   
   // Since we just set s(1)=0, this will set the state s(t-1) to 0 as well...
   ForwardPropagateRecurrentConnectionOnly(m_state);
+
+  // Sentences are scored by several threads, each using its own state
+  WorkStealingScheduler scheduler(m_numThreads);
+  vector<RnnState> threadStates;
+  for (int k = 1; k < m_numThreads; k++) {
+    threadStates.push_back(CreateState());
+  }
+  RnnState stateAfterLastSentence = CreateState();
   
+  // The next books are read in the background during testing
+  BookPrefetcher prefetcher(m_corpusValidTest, m_typeOfDepLabels == 1,
+                            m_numPrefetchedBooks);
+
   // Loop over the books
-  if (m_debugMode) { Log("New book\n"); }
+  if (IsLogged(LogDebug)) { Log("New book\n"); }
   for (int idxBook = 0; idxBook < m_corpusValidTest.NumBooks(); idxBook++) {
-    // Read the next book
-    m_corpusValidTest.NextBook();
-    m_corpusValidTest.ReadBook(m_typeOfDepLabels == 1);
-    BookUnrolls book = m_corpusValidTest.m_currentBook;
+    // Take the next book
+    BookUnrolls book;
+    prefetcher.NextBook(book);
+
+    // Run the RNN on all the unrolls of all the sentences of the book;
+    // the sentences are independent and scored in parallel,
+    // each thread using its own state
+    vector<vector<vector<double> > > logProbBook(book.NumSentences());
+    scheduler.Run(book.NumSentences(), [&](int idxSentence, int idxThread) {
+      const Sentence &sentence = book.GetSentence(idxSentence);
+      if (m_batchSize > 1) {
+        ForwardPropagateUnrollsBatch(sentence, logProbBook[idxSentence]);
+      } else {
+        RnnState &state =
+        (idxThread == 0) ? m_state : threadStates[idxThread - 1];
+        ForwardPropagateUnrolls(sentence, state, logProbBook[idxSentence]);
+        if ((m_numThreads > 1) && (idxSentence == book.NumSentences() - 1)) {
+          stateAfterLastSentence = state;
+        }
+      }
+    });
+    // Leave the model in the state after the last sentence
+    // (it is saved with the model), whichever thread scored it
+    if ((m_numThreads > 1) && (m_batchSize == 1)) {
+      m_state = stateAfterLastSentence;
+    }
     
     // Loop over the sentences in the book
-    book.ResetSentence();
-    if (m_debugMode) { Log("  New sentence\n"); }
+    if (IsLogged(LogDebug)) { Log("  New sentence\n"); }
     for (int idxSentence = 0; idxSentence < book.NumSentences(); idxSentence++) {
+      const Sentence &sentence = book.GetSentence(idxSentence);
+      const vector<vector<double> > &logProbUnrolls = logProbBook[idxSentence];
+
       // Initialize a map of log-likelihoods for each token
       unordered_map<int, double> logProbSentence;
       // Reset the log-likelihood of the sentence
       double sentenceLogProbability = 0.0;
       
       // Loop over the unrolls in each sentence
-      book.ResetUnroll();
       int numUnrolls = book.NumUnrolls(idxSentence);
-      if (m_debugMode) { Log("    New unroll\n"); }
+      if (IsLogged(LogDebug)) { Log("    New unroll\n"); }
       for (int idxUnroll = 0; idxUnroll < numUnrolls; idxUnroll++)
       {
-        // Reset the state of the neural net before each unroll
-        ResetHiddenRnnStateAndWordHistory(m_state);
-        // Reset the dependency label features
-        // at the beginning of each unroll
-        ResetFeatureLabelVector(m_state);
-        
+        const Unroll &unroll = sentence[idxUnroll];
+
         // At the beginning of an unroll,
         // the last word is reset to </s> (end of sentence)
         // and the last label is reset to 0 (root)
@@ -503,34 +1449,17 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
         int contextLabel = 0;
         
         // Loop over the tokens in the sentence unroll
-        bool ok = true;
-        while (ok) {
+        for (size_t idxToken = 0; idxToken < unroll.size(); idxToken++) {
           // Get the current word, discount and label
-          int tokenNumber = book.CurrentTokenNumberInSentence();
-          int nextContextWord = book.CurrentTokenWordAsContext();
-          int targetWord = book.CurrentTokenWordAsTarget();
-          int targetLabel = book.CurrentTokenLabel();
-          
-          if (m_typeOfDepLabels == 2) {
-            // Update the feature matrix with the last dependency label
-            UpdateFeatureLabelVector(contextLabel, m_state);
-          }
-          
-          // Run one step of the RNN to predict word
-          // from contextWord, contextLabel and the last hidden state
-          ForwardPropagateOneStep(contextWord, targetWord, m_state);
+          int tokenNumber = unroll[idxToken].pos;
+          int nextContextWord = unroll[idxToken].wordAsContext;
+          int targetWord = unroll[idxToken].wordAsTarget;
+          int targetLabel = unroll[idxToken].label;
           
           // For perplexity, we do not count OOV words...
           if ((targetWord >= 0) && (targetWord != m_oov)) {
-            // Compute the log-probability of the current word
-            int outputNodeClass =
-            m_vocab.WordIndex2Class(targetWord) + GetVocabularySize();
-            double condProbaClass =
-            m_state.OutputLayer[outputNodeClass];
-            double condProbaWordGivenClass =
-            m_state.OutputLayer[targetWord];
-            double logProbabilityWord =
-            log10(condProbaClass * condProbaWordGivenClass);
+            // Log-probability of the current word
+            double logProbabilityWord = logProbUnrolls[idxUnroll][idxToken];
             
             // Did we see already that word token (at that position)
             // in the sentence?
@@ -543,57 +1472,51 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
               uniqueWordCounter++;
               
               // Verbose
-              if (m_debugMode) {
+              if (IsLogged(LogDebug)) {
                 Log(ConvString(tokenNumber) + "\t" +
                     ConvString(targetWord) + "\t" +
                     ConvString(logProbabilityWord) + "\t" +
                     m_vocab.Word2WordIndex(contextWord) + "\t" +
-                    m_corpusValidTest.labelsReverse[contextLabel] + "\t" +
+                    m_corpusValidTest.Label(contextLabel) + "\t" +
                     m_vocab.Word2WordIndex(targetWord) + "\t" +
                     ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
                     ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
               }
             } else {
               // We have already use the word's log-probability in the score
-              // but let's make a safety check
-              assert(logProbSentence[tokenNumber] == logProbabilityWord);
-              if (m_debugMode) {
+              // but let's make a safety check (the unrolls of a batch
+              // are computed by different rows of the matrix products,
+              // which may differ in the last bits)
+              assert(fabs(logProbSentence[tokenNumber] - logProbabilityWord)
+                     < ((m_batchSize > 1) ? 1e-4 : 0.0) ||
+                     (logProbSentence[tokenNumber] == logProbabilityWord));
+              if (IsLogged(LogDebug)) {
                 Log(ConvString(tokenNumber) + "\t" +
                     ConvString(targetWord) + "\t" +
                     ConvString(logProbabilityWord) + "\t" +
                     m_vocab.Word2WordIndex(contextWord) + "\t" +
-                    m_corpusValidTest.labelsReverse[contextLabel] + "\t" +
+                    m_corpusValidTest.Label(contextLabel) + "\t" +
                     m_vocab.Word2WordIndex(targetWord) + "(seen)\t" +
                     ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
                     ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
               }
             }
           } else {
-            if (m_debugMode) {
+            if (IsLogged(LogDebug)) {
               // Out-of-vocabulary words have probability 0 and index -1
               Log(ConvString(tokenNumber) + "\t-1\t0\t" +
                   m_vocab.Word2WordIndex(contextWord) + "\t" +
-                  m_corpusValidTest.labelsReverse[contextLabel] + "\t" +
+                  m_corpusValidTest.Label(contextLabel) + "\t" +
                   m_vocab.Word2WordIndex(targetWord) + "\t-1\t-1\n");
             }
             numUnk++;
           }
           
-          // Store the current state s(t) at the end of the input layer vector
-          // so that it can be used as s(t-1) at the next step
-          ForwardPropagateRecurrentConnectionOnly(m_state);
-          
-          // Rotate the word history by one: the current context word
-          // (potentially enriched by dependency label information)
-          // will be used at next iteration as input to the RNN
-          ForwardPropagateWordHistory(m_state, contextWord, nextContextWord);
-          // Update the last label
+          // The current context word (potentially enriched by dependency
+          // label information) and label are used at next iteration
+          contextWord = nextContextWord;
           contextLabel = targetLabel;
-          
-          // Go to the next word
-          ok = (book.NextTokenInUnroll() >= 0);
         } // Loop over tokens in the unroll of a sentence
-        book.NextUnrollInSentence();
       } // Loop over unrolls of a sentence
       
       // Reset the table of word token probabilities
@@ -601,8 +1524,6 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
       // Store the log-probability of the sentence
       sentenceScores.push_back(sentenceLogProbability);
       Log(ConvString(sentenceLogProbability) + "\n", scoresFilename);
-
-      book.NextSentence();
     } // Loop over sentences
   } // Loop over books
   
@@ -629,6 +1550,8 @@ bool RnnTreeLM::TestRnnModel(const string &testFile,
   accuracy = AccuracyNBestList(sentenceScores, m_correctSentenceLabels);
   Log("Accuracy: " + ConvString(accuracy * 100) + "% on " +
       ConvString(sentenceScores.size()) + " sentences\n", logFilename);
+  // The scores and the log are complete when the test returns
+  FlushLog();
 
   return true;
 }
@@ -37,9 +37,11 @@
 #ifndef __DependencyTreeRNN____RnnDependencyTreeLib__
 #define __DependencyTreeRNN____RnnDependencyTreeLib__
 
+#include <unordered_set>
 #include "RnnLib.h"
 #include "RnnTraining.h"
 #include "CorpusUnrollsReader.h"
+#include "WorkStealingScheduler.h"
 
 class RnnTreeLM : public RnnLMTraining {
 public:
@@ -52,7 +54,11 @@ public:
   // otherwise simply set its filename
   : RnnLMTraining(filename, doLoadModel, debugMode),
   // Parameters set by default (can be overriden when loading the model)
-  m_typeOfDepLabels(0), m_labels(1) {
+  m_typeOfDepLabels(0), m_labels(1),
+  m_numSyncShards(0), m_numSyncShardSentences(1),
+  m_useSharedPrefixTraining(false),
+  m_numPrefetchedBooks(1) {
+    m_resume.IsResuming = false;
     // If we use dependency labels, do not connect them to the outputs
     m_useFeatures2Output = false;
     std::cout << "RnnTreeLM\n";
@@ -74,7 +80,7 @@ public:
    */
   void ImportVocabularyFromFile(std::string &filename, int numClasses) {
     m_corpusTrain.ImportVocabulary(filename);
-    m_corpusValidTest.ImportVocabulary(filename);
+    m_corpusValidTest.CopyVocabulary(m_corpusTrain);
     AssignVocabularyFromCorpora(numClasses);
   }
 
@@ -93,6 +99,43 @@ public:
     m_typeOfDepLabels = type;
   }
 
+  /**
+   * Use synchronous, deterministic data-parallel training, where each step
+   * computes the gradients on numShards shards of numShardSentences
+   * sentences (0 shards for the default, sequential or Hogwild, training)
+   */
+  void SetSynchronousTraining(int numShards, int numShardSentences) {
+    m_numSyncShards = (numShards < 0) ? 0 : numShards;
+    m_numSyncShardSentences = (numShardSentences < 1) ? 1 : numShardSentences;
+  }
+
+  /**
+   * Train on the prefix trie of the unrolls of each sentence,
+   * forward-propagating each shared prefix only once and back-propagating
+   * the accumulated gradients through the trie
+   */
+  void SetSharedPrefixTraining(bool useSharedPrefix) {
+    m_useSharedPrefixTraining = useSharedPrefix;
+  }
+
+  /**
+   * Load the training and test/validation books from their pre-tokenized
+   * binary files (book.unrolls.bin), written the first time each book
+   * is parsed with the current vocabulary
+   */
+  void SetBinaryBooks(bool useBinaryBooks) {
+    m_corpusTrain.SetBinaryBooks(useBinaryBooks);
+    m_corpusValidTest.SetBinaryBooks(useBinaryBooks);
+  }
+
+  /**
+   * Set the number of books read ahead, on a background thread,
+   * during training and testing (0 to read each book when needed)
+   */
+  void SetNumPrefetchedBooks(int numBooks) {
+    m_numPrefetchedBooks = (numBooks < 0) ? 0 : numBooks;
+  }
+
   /**
    * Set the minimum number of word occurrences
    */
@@ -117,6 +160,14 @@ public:
     m_corpusValidTest.AddBookFilename(filename);
   }
   
+  /**
+   * Load the last checkpoint saved during an epoch (<rnnlm>.checkpoint)
+   * and the state of the training saved with it (<rnnlm>.checkpoint.resume),
+   * so that TrainRnnModel resumes exactly where the checkpoint was taken.
+   * Call after adding the books to the training corpus.
+   */
+  bool LoadCheckpoint();
+
   /**
    * Function that trains the RNN on JSON trees
    * of dependency parse
@@ -148,6 +199,78 @@ protected:
   // Label vocabulary hashtables
   Vocabulary m_labels;
 
+  // Number of shards, and of sentences per shard, at each step
+  // of synchronous training (0 shards when not used)
+  int m_numSyncShards;
+  int m_numSyncShardSentences;
+
+  // Train on the prefix trie of the unrolls of each sentence
+  bool m_useSharedPrefixTraining;
+
+  // Number of books read ahead on a background thread
+  int m_numPrefetchedBooks;
+
+  // State of the training when a checkpoint is taken during an epoch,
+  // after a book, and from which training can resume exactly
+  struct ResumeState {
+    bool IsResuming;
+    // Position of the checkpoint (to check that it matches the model)
+    int Iteration;
+    long WordCounter;
+    // Order of the books in the epoch, index of the next book
+    // and of the next sentence in that book,
+    // and state of the generator shuffling the books
+    std::vector<std::string> BookOrder;
+    int NextBook;
+    int NextSentence;
+    std::string RandomGeneratorState;
+    // Log-probability and number of unique words since the epoch started
+    double TrainLogProbability;
+    int UniqueWordCounter;
+    // Validation log-probability and accuracy at the last epoch,
+    // and of the best model, which drive the learning rate schedule
+    double LastValidLogProbability;
+    double LastValidAccuracy;
+    double BestValidLogProbability;
+    double BestValidAccuracy;
+  };
+  ResumeState m_resume;
+
+  // Write the state of the training as text, and read it back
+  static std::string FormatResumeState(const ResumeState &resume);
+  static bool ParseResumeState(const std::string &filename,
+                               ResumeState &resume);
+
+  // Activations, gradients and counters stored during shared-prefix
+  // training on the trie of one sentence (one row per node of the trie)
+  struct TrieTraining {
+    // Hidden state s(t-1) entering the node, hidden state s(t)
+    // computed at the node to predict its children, and features f(t)
+    std::vector<real> Recurrent;
+    std::vector<real> Hidden;
+    std::vector<real> Features;
+    // Gradient w.r.t. s(t) (then w.r.t. the input of the sigmoid)
+    // and w.r.t. s(t-1)
+    std::vector<real> HiddenGradient;
+    std::vector<real> RecurrentGradient;
+    // Word history entering the node (c_maxNGramOrder words per node)
+    std::vector<int> WordHistory;
+    // Context word of the node, and whether s(t) was computed
+    std::vector<int> ContextWord;
+    std::vector<bool> IsHiddenComputed;
+    // Sum of the discounts, and number, of the tokens of each node
+    std::vector<double> Weight;
+    std::vector<int> NumTokens;
+    // Positions of the tokens already counted in the log-probability
+    std::unordered_set<int> CountedPositions;
+    // Word counter, weight decay coefficient of the weights
+    // to the hidden layer, log-probability and number of unique words
+    long WordCounter;
+    double HiddenLayerDecay;
+    double LogProbability;
+    int UniqueWordCounter;
+  };
+
   // Label vocabulary representation (label -> index of the label)
   std::unordered_map<std::string, int> m_mapLabel2Index;
   
@@ -156,6 +279,86 @@ protected:
   
   // Update the vector of feature labels
   void UpdateFeatureLabelVector(int label, RnnState &state) const;
+  void UpdateFeatureLabelVector(int label, real *featureLayer) const;
+
+  // Train the RNN on all the unrolls of one sentence, using the given state
+  // and BPTT buffers (e.g., private to a training thread), and accumulate
+  // the log-probability and the number of the word tokens.
+  // The updates are applied to updatedWeights, which are either m_weights
+  // (SGD) or a buffer of gradients (without regularization).
+  void TrainRnnOnSentence(const Sentence &sentence,
+                          RnnState &state,
+                          RnnBptt &bpttState,
+                          long &wordCounter,
+                          double &logProbability,
+                          int &uniqueWordCounter,
+                          double regularizationRate,
+                          RnnWeights &updatedWeights);
+
+  // Train the RNN on all the unrolls of one sentence, organized as a prefix
+  // trie: each node is forward-propagated once, the weights to the output
+  // layer are updated at each node, and the gradients are back-propagated
+  // through the trie and applied once to the weights to the hidden layer.
+  // Same arguments as TrainRnnOnSentence.
+  void TrainRnnOnSentenceTrie(const Sentence &sentence,
+                              RnnState &state,
+                              RnnBptt &bpttState,
+                              long &wordCounter,
+                              double &logProbability,
+                              int &uniqueWordCounter,
+                              double regularizationRate,
+                              RnnWeights &updatedWeights);
+
+  // Forward-propagate the children of a node of the trie
+  // and back-propagate their errors to the output layer
+  void TrainTrieNode(const SentenceTrie &trie,
+                     int node,
+                     int contextWord,
+                     int contextLabel,
+                     double regularizationRate,
+                     RnnState &state,
+                     TrieTraining &nodes,
+                     RnnWeights &updatedWeights);
+
+  // One step of synchronous data-parallel training, on the sentences
+  // of a book starting at idxStep: m_numSyncShards shards
+  // of m_numSyncShardSentences consecutive sentences have their gradients
+  // computed (in parallel) in separate buffers, which are then summed
+  // by a tree reduction, and applied to the weights.
+  // The result does not depend on the number of threads.
+  void TrainRnnOnStepSynchronously(const BookUnrolls &book,
+                                   int idxStep,
+                                   WorkStealingScheduler &scheduler,
+                                   std::vector<RnnState> &threadStates,
+                                   std::vector<RnnBptt> &threadBpttVectors,
+                                   std::vector<RnnWeights> &shardGradients,
+                                   double &logProbability,
+                                   int &uniqueWordCounter);
+
+  // Compute the log-probability of each token in each unroll of a sentence
+  // (0 for OOV words) using the given state, propagating each distinct
+  // prefix of the unrolls only once by walking their prefix trie.
+  // Does not modify the model, so it can be called from several threads
+  // with one state per thread.
+  void ForwardPropagateUnrolls(const Sentence &sentence,
+                               RnnState &state,
+                               std::vector<std::vector<double> > &logProbabilities) const;
+
+  // Compute the log-probability of the tokens of all the children of a node
+  // of the trie, then recurse into the children. The state is the one
+  // reached after the prefix of that node, and is restored
+  // from a snapshot for each child at branch points.
+  void ForwardPropagateTrieNode(const SentenceTrie &trie,
+                                int node,
+                                int contextWord,
+                                int contextLabel,
+                                RnnState &state,
+                                std::vector<double> &logProbNodes) const;
+
+  // Compute the log-probability of each token in each unroll of a sentence
+  // (0 for OOV words), forward-propagating up to m_batchSize unrolls together
+  void ForwardPropagateUnrollsBatch(const Sentence &sentence,
+                                    std::vector<std::vector<double> > &logProbabilities) const;
 
   // Assign the vocabulary from the corpora to the model,
   // and compute the word classes.
@@ -0,0 +1,251 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <math.h>
+#include "RnnBlas.h"
+#include "RnnKernels.h"
+
+// On x86, the AVX2 and AVX-512 kernels are compiled for their instruction
+// sets whatever the compiler flags, and selected when the program starts,
+// depending on the CPU; otherwise, the layers use BLAS
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define USE_SIMD_KERNELS
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#endif
+
+
+#ifdef USE_SIMD_KERNELS
+/**
+ * Horizontal sums of 256-bit and 512-bit registers
+ */
+TARGET_AVX2 static inline float SimdReduceAdd(__m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x1));
+  return _mm_cvtss_f32(sum);
+}
+TARGET_AVX2 static inline double SimdReduceAdd(__m256d v) {
+  __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+  sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+  return _mm_cvtsd_f64(sum);
+}
+// 256-bit half of a 512-bit register; the zero-masked extract avoids
+// the undefined pass-through operand of _mm512_extractf64x4_pd
+#define SimdExtractHalf(v, i) _mm512_maskz_extractf64x4_pd(0xFF, (v), (i))
+TARGET_AVX512 static inline float SimdReduceAdd(__m512 v) {
+  __m512d halves = _mm512_castps_pd(v);
+  return SimdReduceAdd(_mm256_add_ps(
+    _mm256_castpd_ps(SimdExtractHalf(halves, 0)),
+    _mm256_castpd_ps(SimdExtractHalf(halves, 1))));
+}
+TARGET_AVX512 static inline double SimdReduceAdd(__m512d v) {
+  return SimdReduceAdd(_mm256_add_pd(SimdExtractHalf(v, 0),
+                                     SimdExtractHalf(v, 1)));
+}
+
+
+/**
+ * SIMD registers and operations matching the precision of the type real
+ */
+#ifdef USE_FLOAT
+typedef __m256 Simd256Real;
+#define SIMD256_WIDTH 8
+#define Simd256Zero _mm256_setzero_ps
+#define Simd256Load _mm256_loadu_ps
+#define Simd256MultiplyAdd _mm256_fmadd_ps
+#define Simd256Add _mm256_add_ps
+typedef __m512 Simd512Real;
+#define SIMD512_WIDTH 16
+#define Simd512Zero _mm512_setzero_ps
+#define Simd512Load _mm512_loadu_ps
+#define Simd512MultiplyAdd _mm512_fmadd_ps
+#define Simd512Add _mm512_add_ps
+#else
+typedef __m256d Simd256Real;
+#define SIMD256_WIDTH 4
+#define Simd256Zero _mm256_setzero_pd
+#define Simd256Load _mm256_loadu_pd
+#define Simd256MultiplyAdd _mm256_fmadd_pd
+#define Simd256Add _mm256_add_pd
+typedef __m512d Simd512Real;
+#define SIMD512_WIDTH 8
+#define Simd512Zero _mm512_setzero_pd
+#define Simd512Load _mm512_loadu_pd
+#define Simd512MultiplyAdd _mm512_fmadd_pd
+#define Simd512Add _mm512_add_pd
+#endif
+
+
+/**
+ * Dot products using AVX2+FMA and AVX-512; two independent
+ * accumulators hide the latency of the FMA
+ */
+TARGET_AVX2 static real DotProductAvx2(const real *x, const real *y, int n) {
+  int k = 0;
+  Simd256Real acc0 = Simd256Zero();
+  Simd256Real acc1 = Simd256Zero();
+  for (; k + 2 * SIMD256_WIDTH <= n; k += 2 * SIMD256_WIDTH) {
+    acc0 = Simd256MultiplyAdd(Simd256Load(x + k), Simd256Load(y + k), acc0);
+    acc1 = Simd256MultiplyAdd(Simd256Load(x + k + SIMD256_WIDTH),
+                              Simd256Load(y + k + SIMD256_WIDTH), acc1);
+  }
+  if (k + SIMD256_WIDTH <= n) {
+    acc0 = Simd256MultiplyAdd(Simd256Load(x + k), Simd256Load(y + k), acc0);
+    k += SIMD256_WIDTH;
+  }
+  real sum = SimdReduceAdd(Simd256Add(acc0, acc1));
+  for (; k < n; k++) {
+    sum += x[k] * y[k];
+  }
+  return sum;
+}
+TARGET_AVX512 static real DotProductAvx512(const real *x, const real *y, int n) {
+  int k = 0;
+  Simd512Real acc0 = Simd512Zero();
+  Simd512Real acc1 = Simd512Zero();
+  for (; k + 2 * SIMD512_WIDTH <= n; k += 2 * SIMD512_WIDTH) {
+    acc0 = Simd512MultiplyAdd(Simd512Load(x + k), Simd512Load(y + k), acc0);
+    acc1 = Simd512MultiplyAdd(Simd512Load(x + k + SIMD512_WIDTH),
+                              Simd512Load(y + k + SIMD512_WIDTH), acc1);
+  }
+  if (k + SIMD512_WIDTH <= n) {
+    acc0 = Simd512MultiplyAdd(Simd512Load(x + k), Simd512Load(y + k), acc0);
+    k += SIMD512_WIDTH;
+  }
+  real sum = SimdReduceAdd(Simd512Add(acc0, acc1));
+  for (; k < n; k++) {
+    sum += x[k] * y[k];
+  }
+  return sum;
+}
+#endif
+
+
+/**
+ * Dot product of the widest SIMD instruction set supported by the CPU,
+ * or NULL when there is none
+ */
+typedef real (*DotProductFunction)(const real *x, const real *y, int n);
+static DotProductFunction SelectSimdDotProduct() {
+#ifdef USE_SIMD_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return DotProductAvx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return DotProductAvx2;
+  }
+#endif
+  return NULL;
+}
+static const DotProductFunction c_simdDotProduct = SelectSimdDotProduct();
+
+
+/**
+ * Dot product between two contiguous vectors x and y of length n
+ */
+real DotProduct(const real *x, const real *y, int n) {
+  if (c_simdDotProduct != NULL) {
+    return c_simdDotProduct(x, y, n);
+  }
+  int k = 0;
+  real sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+  for (; k + 4 <= n; k += 4) {
+    sum0 += x[k] * y[k];
+    sum1 += x[k + 1] * y[k + 1];
+    sum2 += x[k + 2] * y[k + 2];
+    sum3 += x[k + 3] * y[k + 3];
+  }
+  real sum = (sum0 + sum1) + (sum2 + sum3);
+  for (; k < n; k++) {
+    sum += x[k] * y[k];
+  }
+  return sum;
+}
+
+
+/**
+ * Apply in place the logistic sigmoid to n contiguous values.
+ * With -O3 -ffast-math, GCC vectorizes this loop using the SIMD
+ * exponential of libmvec.
+ */
+void LogisticSigmoidInPlace(real *x, int n) {
+  for (int k = 0; k < n; k++) {
+    real val = -x[k];
+    // for numerical stability
+    val = (val > 50) ? 50 : ((val < -50) ? -50 : val);
+    x[k] = 1 / (1 + exp(val));
+  }
+}
+
+
+/**
+ * Apply in place the softmax to n contiguous values
+ */
+void SoftmaxInPlace(real *x, int n) {
+  double sum = 0.0;
+  for (int k = 0; k < n; k++) {
+    double val = x[k];
+    // for numerical stability
+    val = (val > 50) ? 50 : ((val < -50) ? -50 : val);
+    val = exp(val);
+    sum += val;
+    x[k] = val;
+  }
+  for (int k = 0; k < n; k++) {
+    x[k] /= sum;
+  }
+}
+
+
+/**
+ * Fused forward propagation of a sigmoid layer
+ * y = sigmoid(coeffA * A * x + coeffU * u + coeffB * B * f)
+ */
+void ForwardSigmoidLayer(real *y,
+                         const real *matrixA,
+                         real coeffA,
+                         const real *x,
+                         int sizeX,
+                         int sizeY,
+                         const real *u,
+                         real coeffU,
+                         const real *matrixB,
+                         real coeffB,
+                         const real *f,
+                         int sizeF) {
+  if (c_simdDotProduct == NULL) {
+    // Without SIMD kernels, the matrix-vector products use BLAS
+    cblas_xgemv(CblasRowMajor, CblasNoTrans, sizeY, sizeX,
+                coeffA, matrixA, sizeX, x, 1, 0, y, 1);
+    if (u != NULL) {
+      for (int a = 0; a < sizeY; a++) {
+        y[a] += coeffU * u[a];
+      }
+    }
+    if (sizeF > 0) {
+      cblas_xgemv(CblasRowMajor, CblasNoTrans, sizeY, sizeF,
+                  coeffB, matrixB, sizeF, f, 1, 1, y, 1);
+    }
+    LogisticSigmoidInPlace(y, sizeY);
+    return;
+  }
+  for (int a = 0; a < sizeY; a++) {
+    real z = coeffA * c_simdDotProduct(matrixA + (long)a * sizeX, x, sizeX);
+    if (u != NULL) {
+      z += coeffU * u[a];
+    }
+    if (sizeF > 0) {
+      z += coeffB * c_simdDotProduct(matrixB + (long)a * sizeF, f, sizeF);
+    }
+    y[a] = z;
+  }
+  LogisticSigmoidInPlace(y, sizeY);
+}
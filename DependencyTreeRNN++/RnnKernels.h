@@ -0,0 +1,61 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____RnnKernels__
+#define __DependencyTreeRNN____RnnKernels__
+
+#include "Utils.h"
+
+
+/**
+ * Dot product between two contiguous vectors x and y of length n.
+ * Uses AVX-512 or AVX2+FMA when the CPU supports them (the kernel
+ * is selected at run time, on x86), and a portable loop otherwise.
+ */
+real DotProduct(const real *x, const real *y, int n);
+
+
+/**
+ * Apply in place the logistic sigmoid 1 / (1 + exp(-x))
+ * to n contiguous values, with x clamped to [-50, 50]
+ * (written so that the compiler vectorizes the exponential).
+ */
+void LogisticSigmoidInPlace(real *x, int n);
+
+
+/**
+ * Apply in place the softmax exp(x_k) / sum_j exp(x_j)
+ * to n contiguous values, with x clamped to [-50, 50]
+ * and the normalization accumulated in double precision.
+ */
+void SoftmaxInPlace(real *x, int n);
+
+
+/**
+ * Fused forward propagation of a sigmoid layer, in a single pass
+ * over the rows of the weight matrices:
+ * y = sigmoid(coeffA * A * x + coeffU * u + coeffB * B * f)
+ * where A is of size sizeY x sizeX and B is of size sizeY x sizeF,
+ * both stored row-major, and u is a vector of length sizeY
+ * (e.g., the row of the input weights for a one-hot input word).
+ * Vector u (resp. matrix B) is ignored when null (resp. when sizeF is 0).
+ * Without a SIMD dot product for the CPU, the matrix-vector products
+ * use BLAS, followed by a separate pass for the sigmoid.
+ */
+void ForwardSigmoidLayer(real *y,
+                         const real *matrixA,
+                         real coeffA,
+                         const real *x,
+                         int sizeX,
+                         int sizeY,
+                         const real *u,
+                         real coeffU,
+                         const real *matrixB,
+                         real coeffB,
+                         const real *f,
+                         int sizeF);
+
+#endif /* defined(__DependencyTreeRNN____RnnKernels__) */
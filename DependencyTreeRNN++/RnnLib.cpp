@@ -45,13 +45,13 @@
 #include <math.h>
 #include <time.h>
 #include <assert.h>
+#include <unistd.h>
 #include "Utils.h"
 #include "RnnLib.h"
+#include "RnnKernels.h"
 #include "CorpusWordReader.h"
-// Include BLAS
-extern "C" {
-#include <cblas.h>
-}
+#include "RnnBlas.h"
+#include "MappedModel.h"
 
 using namespace std;
 
@@ -128,7 +128,8 @@ bool RnnLM::InitializeRnnModel(int sizeVocabulary,
                                int sizeClasses,
                                int sizeCompress,
                                long long sizeDirectConnection,
-                               int orderDirectConnection) {
+                               int orderDirectConnection,
+                               bool doInitializeWeights) {
   if (!m_featureMatrixFile.empty()) {
     // feature matrix file was set
     m_featureMatrixUsed = 1;
@@ -141,18 +142,17 @@ bool RnnLM::InitializeRnnModel(int sizeVocabulary,
 
   // Initialize the input/hidden/output/compression/feature layers of the RNN
   m_state = RnnState(sizeVocabulary, sizeHidden, sizeFeature,
-                     sizeClasses, sizeCompress,
-                     sizeDirectConnection, orderDirectConnection);
+                     sizeClasses, sizeCompress, orderDirectConnection);
 
   // Initialize the weights of the neural network
   m_weights.Clear();
   m_weights = RnnWeights(sizeVocabulary, sizeHidden, sizeFeature,
                          sizeClasses, sizeCompress,
-                         sizeDirectConnection);
+                         sizeDirectConnection, doInitializeWeights);
 
   // BPTT vectors (as in Back-Propagation Through Time)
   // will be used during training
-  m_bpttVectors = RnnBptt(sizeVocabulary, sizeHidden, sizeFeature,
+  m_bpttVectors = RnnBptt(sizeHidden, sizeFeature,
                           m_numBpttSteps, m_bpttBlockSize);
 
   return true;
@@ -203,6 +203,9 @@ m_gradientCutoff(15.0),
 // BPTT of order 4, every 10 words
 m_numBpttSteps(5),
 m_bpttBlockSize(10),
+// Test sentences are scored one at a time
+m_batchSize(1),
+m_numThreads(1),
 // How many epochs was the RNN trained on?
 m_iteration(0),
 m_numTrainWords(0),
@@ -213,31 +216,48 @@ m_usesClassFile(false),
 m_areSentencesIndependent(true),
 // Temporary allocation of weights, states and BPTT vectors, vocabulary
 m_weights(1, 1, 0, 1, 0, 0),
-m_state(1, 1, 0, 1, 0, 0, 0),
-m_bpttVectors(1, 1, 0, 0, 0),
+m_state(1, 1, 0, 1, 0, 0),
+m_bpttVectors(1, 0, 0, 0),
 m_vocab(1) {
   // Load the RNN model?
   if (doLoadModel) {
     std::cout << "RnnLM\n";
-    LoadRnnModelFromFile();
+    LoadRnnModelFromFile(m_rnnModelFile);
   }
 }
 
 
-void RnnLM::LoadRnnModelFromFile() {
-  printf("# Loading RNN model from %s...\n", m_rnnModelFile.c_str());
+/**
+ * Load the model from a file (in the text or memory-mapped format)
+ */
+void RnnLM::LoadRnnModelFromFile(const string &filename) {
+  printf("# Loading RNN model from %s...\n", filename.c_str());
   char buffer[8192];
 
-  FILE *fi = fopen(m_rnnModelFile.c_str(), "rb");
+  FILE *fi = fopen(filename.c_str(), "rb");
   if (fi == NULL) {
-    throw new runtime_error("Did not find file " + m_rnnModelFile);
+    throw new runtime_error("Did not find file " + filename);
+  }
+
+  // Is the model file in the memory-mapped format?
+  char magic[sizeof(c_mappedModelMagic)] = {0};
+  if ((fread(magic, 1, sizeof(magic), fi) == sizeof(magic))
+      && (memcmp(magic, c_mappedModelMagic, sizeof(magic)) == 0)) {
+    fclose(fi);
+    shared_ptr<MappedFile> file = MappedFile::Map(filename);
+    if (file == NULL) {
+      throw new runtime_error("Cannot map file " + filename);
+    }
+    LoadMappedRnnModel(file, filename);
+    return;
   }
+  rewind(fi);
 
   GoToDelimiterInFile(':', fi);
   int ver = m_rnnModelVersion;
   fscanf(fi, "%d", &ver);
   if ((ver > m_rnnModelVersion) || (ver <= 6)) {
-    throw new runtime_error("Unknown version of file " + m_rnnModelFile);
+    throw new runtime_error("Unknown version of file " + filename);
   }
 
   GoToDelimiterInFile(':', fi);
@@ -394,6 +414,396 @@ void RnnLM::LoadRnnModelFromFile() {
 }
 
 
+/**
+ * Load a model file in the memory-mapped format (version 21).
+ * The weights are neither allocated nor initialized, but point to
+ * the pages of the file, which are loaded when first accessed
+ * and shared by all the processes mapping the same model file.
+ */
+void RnnLM::LoadMappedRnnModel(const shared_ptr<MappedFile> &file,
+                               const string &filename) {
+  const char *data = file->Data();
+  long long sizeFile = (long long)file->Size();
+  if (sizeFile < (long long)sizeof(MappedModelHeader)) {
+    throw new runtime_error("Truncated model file " + filename);
+  }
+  const MappedModelHeader &header = *((const MappedModelHeader *)data);
+  if ((header.version != c_mappedModelVersion)
+      || (header.sizeReal != (int)sizeof(real))) {
+    throw new runtime_error("Unknown version of file " + filename);
+  }
+  int sizeVocabulary = header.sizeVocabulary;
+  int sizeHidden = header.sizeHidden;
+  int sizeFeature = header.sizeFeature;
+  if ((sizeVocabulary <= 0) || (header.sizeClasses <= 0)
+      || (header.sizeClasses > sizeVocabulary) || (sizeHidden <= 0)
+      || (sizeFeature < 0) || (header.sizeCompress < 0)
+      || (header.sizeDirectConnection < 0)) {
+    throw new runtime_error("Invalid dimensions in file " + filename);
+  }
+
+  // Check that the sections are aligned and within the file
+  for (int k = 0; k < c_numMappedModelSections; k++) {
+    const MappedModelSectionHeader &section = header.sections[k];
+    if ((section.offset % c_mappedModelAlignment != 0) || (section.size < 0)
+        || (section.offset < (long long)sizeof(MappedModelHeader))
+        || (section.offset > sizeFile)
+        || (section.size > sizeFile - section.offset)) {
+      throw new runtime_error("Invalid section in file " + filename);
+    }
+  }
+  const MappedModelSectionHeader *sections = header.sections;
+  long long sizeWords = sections[c_sectionWords].size;
+  const char *words = data + sections[c_sectionWords].offset;
+  const int *wordOffsets =
+  (const int *)(data + sections[c_sectionWordOffsets].offset);
+  bool isValid =
+  (sections[c_sectionWordOffsets].size ==
+   (long long)(sizeVocabulary + 1) * (long long)sizeof(int))
+  && (sections[c_sectionWordCounts].size ==
+      (long long)sizeVocabulary * (long long)sizeof(int))
+  && (sections[c_sectionWordClasses].size ==
+      (long long)sizeVocabulary * (long long)sizeof(int))
+  && (sections[c_sectionHiddenLayer].size ==
+      (long long)sizeHidden * (long long)sizeof(real))
+  && (wordOffsets[0] == 0) && (wordOffsets[sizeVocabulary] == sizeWords);
+  for (int k = 0; (k < sizeVocabulary) && isValid; k++) {
+    isValid = (wordOffsets[k + 1] > wordOffsets[k])
+    && (words[wordOffsets[k + 1] - 1] == 0);
+  }
+  const int *wordClasses =
+  (const int *)(data + sections[c_sectionWordClasses].offset);
+  for (int k = 0; (k < sizeVocabulary) && isValid; k++) {
+    isValid = (wordClasses[k] >= 0) && (wordClasses[k] < header.sizeClasses);
+  }
+  if (!isValid) {
+    throw new runtime_error("Invalid vocabulary in file " + filename);
+  }
+
+  // Training state
+  if (!m_isTrainFileSet) {
+    m_trainFile = string(data + sections[c_sectionTrainFile].offset,
+                         (size_t)sections[c_sectionTrainFile].size);
+  }
+  m_validationFile = string(data + sections[c_sectionValidationFile].offset,
+                            (size_t)sections[c_sectionValidationFile].size);
+  m_iteration = header.iteration;
+  m_currentPosTrainFile = (long)header.currentPosTrainFile;
+  m_numTrainWords = (long)header.numTrainWords;
+  m_featureMatrixUsed = header.featureMatrixUsed;
+  m_featureGammaCoeff = header.featureGammaCoeff;
+  m_numBpttSteps = header.numBpttSteps;
+  m_bpttBlockSize = header.bpttBlockSize;
+  m_usesClassFile = (header.usesClassFile > 0);
+  m_areSentencesIndependent = (header.areSentencesIndependent > 0);
+  m_initialLearningRate = header.initialLearningRate;
+  m_learningRate = header.learningRate;
+  m_doStartReducingLearningRate = (header.doStartReducingLearningRate > 0);
+
+  // Vocabulary
+  m_vocab = Vocabulary(words, wordOffsets,
+                       (const int *)(data + sections[c_sectionWordCounts].offset),
+                       wordClasses, sizeVocabulary, header.sizeClasses);
+
+  // Allocate the states of the RNN, but not its weights
+  int a = m_featureMatrixUsed;
+  m_featureMatrixUsed = 0;
+  InitializeRnnModel(sizeVocabulary,
+                     sizeHidden,
+                     sizeFeature,
+                     header.sizeClasses,
+                     header.sizeCompress,
+                     header.sizeDirectConnection,
+                     header.orderDirectConnection,
+                     false);
+  m_featureMatrixUsed = a;
+
+  // Copy the activations on the hidden layer
+  const real *hidden =
+  (const real *)(data + sections[c_sectionHiddenLayer].offset);
+  m_state.HiddenLayer.assign(hidden, hidden + sizeHidden);
+
+  // Map the weights of the RNN
+  for (int k = 0; k < RnnWeights::c_numMatrices; k++) {
+    const MappedModelSectionHeader &section = sections[c_sectionWeights + k];
+    long long size = m_weights.MatrixSize(k);
+    if (section.size != size * (long long)sizeof(real)) {
+      throw new runtime_error("Invalid weights in file " + filename);
+    }
+    m_weights.Matrix(k).Map(file, (size_t)section.offset, (size_t)size);
+  }
+
+  // Copy the feature matrix
+  if (m_featureMatrixUsed) {
+    const MappedModelSectionHeader &section = sections[c_sectionFeatureMatrix];
+    long long size = (long long)sizeVocabulary * sizeFeature;
+    if (section.size != size * (long long)sizeof(real)) {
+      throw new runtime_error("Invalid feature matrix in file " + filename);
+    }
+    const real *features = (const real *)(data + section.offset);
+    m_featureMatrix.assign(features, features + size);
+  }
+  printf("Mapped %lld bytes of RNN model\n", sizeFile);
+
+  // Reset the state of the RNN
+  ResetHiddenRnnStateAndWordHistory(m_state, m_bpttVectors);
+  m_isModelLoaded = true;
+}
+
+
+/**
+ * Once we train the RNN model, it is nice to save it to a text or binary file.
+ * The model is written to a temporary file, flushed to disk and renamed,
+ * so that the model file is always complete, and that a process
+ * still mapping the former model file is not affected.
+ */
+bool RnnLM::SaveRnnModelToFile(const string &filename) {
+  string tmpFilename = filename + ".tmp";
+  FILE *fo = fopen(tmpFilename.c_str(), "wb");
+  if (fo == NULL) {
+    printf("Cannot create file %s\n", tmpFilename.c_str());
+    return false;
+  }
+  bool isWritten = (m_rnnModelVersion == c_mappedModelVersion) ?
+  WriteMappedRnnModel(fo) : WriteRnnModel(fo);
+  isWritten = isWritten && (fflush(fo) == 0) && (fsync(fileno(fo)) == 0);
+  isWritten = (fclose(fo) == 0) && isWritten;
+  if (!isWritten || (rename(tmpFilename.c_str(), filename.c_str()) != 0)) {
+    printf("Cannot write file %s\n", filename.c_str());
+    remove(tmpFilename.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+/**
+ * Write the RNN model in the text format (version 20):
+ * a text header and vocabulary, followed by matrices of floats
+ */
+bool RnnLM::WriteRnnModel(FILE *fo) {
+  fprintf(fo, "version: %d\n", m_rnnModelVersion);
+  fprintf(fo, "file format: 1\n\n");
+  
+  fprintf(fo, "training data file: %s\n", m_trainFile.c_str());
+  fprintf(fo, "validation data file: %s\n\n", m_validationFile.c_str());
+  
+  fprintf(fo, "last probability of validation data: %f\n", 0.0);
+  fprintf(fo, "number of finished iterations: %d\n", m_iteration);
+  
+  fprintf(fo, "current position in training data: %ld\n", m_currentPosTrainFile);
+  fprintf(fo, "current probability of training data: %f\n", 0.0);
+  // dummy used for backward compatibility
+  int anti_k = 0;
+  fprintf(fo, "save after processing # words: %d\n", anti_k);
+  fprintf(fo, "# of training words: %ld\n", m_numTrainWords);
+  
+  fprintf(fo, "input layer size: %d\n", GetInputSize());
+  fprintf(fo, "feature size: %d\n", GetFeatureSize());
+  if (!m_featureMatrixUsed) {
+    fprintf(fo, "feature matrix used: 0\n");
+  } else {
+    fprintf(fo, "feature matrix used: 1\n");
+  }
+  fprintf(fo, "feature gamma: %lf\n", m_featureGammaCoeff);
+  fprintf(fo, "hidden layer size: %d\n", GetHiddenSize());
+  fprintf(fo, "compression layer size: %d\n", GetCompressSize());
+  fprintf(fo, "output layer size: %d\n", GetOutputSize());
+  
+  fprintf(fo, "direct connections: %d\n", GetNumDirectConnection());
+  fprintf(fo, "direct order: %d\n", GetOrderDirectConnection());
+  
+  fprintf(fo, "bptt: %d\n", m_numBpttSteps);
+  fprintf(fo, "bptt block: %d\n", m_bpttBlockSize);
+  
+  fprintf(fo, "vocabulary size: %d\n", GetVocabularySize());
+  fprintf(fo, "class size: %d\n", GetNumClasses());
+  
+  fprintf(fo, "old classes: 0\n");
+  fprintf(fo, "uses class file: %d\n", m_usesClassFile ? 1 : 0);
+  fprintf(fo, "independent sentences mode: %d\n",
+          m_areSentencesIndependent ? 1 : 0);
+  
+  fprintf(fo, "starting learning rate: %f\n", m_initialLearningRate);
+  fprintf(fo, "current learning rate: %f\n", m_learningRate);
+  fprintf(fo, "learning rate decrease: %d\n", m_doStartReducingLearningRate);
+  fprintf(fo, "\n");
+  
+  // Save the vocabulary, one word per line
+  int sizeVocabulary = GetVocabularySize();
+  m_vocab.Save(fo);
+
+  int sizeHidden = GetHiddenSize();
+  printf("Saving %d hidden activations...\n", sizeHidden);
+  SaveBinaryVector(fo, sizeHidden, m_state.HiddenLayer);
+
+  // Save all the weights
+  m_weights.Save(fo);
+
+  // Save the feature matrix
+  if (m_featureMatrixUsed) {
+    int sizeFeature = GetFeatureSize();
+    printf("Saving %dx%d feature matrix...\n", sizeFeature, sizeVocabulary);
+    SaveBinaryMatrix(fo, sizeFeature, sizeVocabulary, m_featureMatrix);
+  }
+  return (ferror(fo) == 0);
+}
+
+
+/**
+ * Write the RNN model in the memory-mapped format (version 21):
+ * a binary header followed by sections aligned on 64 bytes, storing
+ * the vocabulary and the weights as they are laid out in memory.
+ */
+bool RnnLM::WriteMappedRnnModel(FILE *fo) {
+  // Fold the lazy weight decay into the weights
+  m_weights.Renormalize();
+
+  // Vocabulary arrays
+  int sizeVocabulary = GetVocabularySize();
+  string words;
+  vector<int> wordOffsets(1, 0);
+  vector<int> wordCounts(sizeVocabulary);
+  vector<int> wordClasses(sizeVocabulary);
+  for (int k = 0; k < sizeVocabulary; k++) {
+    const VocabWord &vocabWord = m_vocab.m_vocabularyStorage[k];
+    words.append(vocabWord.word.c_str(), vocabWord.word.size() + 1);
+    wordOffsets.push_back((int)words.size());
+    wordCounts[k] = vocabWord.cn;
+    wordClasses[k] = vocabWord.classIndex;
+  }
+
+  // Contents and sizes of the sections
+  const void *contents[c_numMappedModelSections];
+  MappedModelHeader header;
+  memset(&header, 0, sizeof(MappedModelHeader));
+  MappedModelSectionHeader *sections = header.sections;
+  contents[c_sectionTrainFile] = m_trainFile.data();
+  sections[c_sectionTrainFile].size = (long long)m_trainFile.size();
+  contents[c_sectionValidationFile] = m_validationFile.data();
+  sections[c_sectionValidationFile].size = (long long)m_validationFile.size();
+  contents[c_sectionWords] = words.data();
+  sections[c_sectionWords].size = (long long)words.size();
+  contents[c_sectionWordOffsets] = wordOffsets.data();
+  sections[c_sectionWordOffsets].size =
+  (long long)(wordOffsets.size() * sizeof(int));
+  contents[c_sectionWordCounts] = wordCounts.data();
+  sections[c_sectionWordCounts].size =
+  (long long)(wordCounts.size() * sizeof(int));
+  contents[c_sectionWordClasses] = wordClasses.data();
+  sections[c_sectionWordClasses].size =
+  (long long)(wordClasses.size() * sizeof(int));
+  contents[c_sectionHiddenLayer] = m_state.HiddenLayer.data();
+  sections[c_sectionHiddenLayer].size =
+  (long long)(m_state.HiddenLayer.size() * sizeof(real));
+  for (int k = 0; k < RnnWeights::c_numMatrices; k++) {
+    const WeightVector &matrix = m_weights.Matrix(k);
+    contents[c_sectionWeights + k] = matrix.data();
+    sections[c_sectionWeights + k].size =
+    (long long)(matrix.size() * sizeof(real));
+  }
+  contents[c_sectionFeatureMatrix] = m_featureMatrix.data();
+  sections[c_sectionFeatureMatrix].size = m_featureMatrixUsed ?
+  (long long)(m_featureMatrix.size() * sizeof(real)) : 0;
+
+  // Aligned offsets of the sections
+  long long offset = (long long)sizeof(MappedModelHeader);
+  for (int k = 0; k < c_numMappedModelSections; k++) {
+    offset = (offset + c_mappedModelAlignment - 1)
+    / c_mappedModelAlignment * c_mappedModelAlignment;
+    sections[k].offset = offset;
+    offset += sections[k].size;
+  }
+
+  // Header: training state and dimensions
+  memcpy(header.magic, c_mappedModelMagic, sizeof(header.magic));
+  header.version = c_mappedModelVersion;
+  header.sizeReal = (int)sizeof(real);
+  header.iteration = m_iteration;
+  header.doStartReducingLearningRate = m_doStartReducingLearningRate ? 1 : 0;
+  header.currentPosTrainFile = m_currentPosTrainFile;
+  header.numTrainWords = m_numTrainWords;
+  header.initialLearningRate = m_initialLearningRate;
+  header.learningRate = m_learningRate;
+  header.featureGammaCoeff = m_featureGammaCoeff;
+  header.featureMatrixUsed = m_featureMatrixUsed;
+  header.usesClassFile = m_usesClassFile ? 1 : 0;
+  header.areSentencesIndependent = m_areSentencesIndependent ? 1 : 0;
+  header.numBpttSteps = m_numBpttSteps;
+  header.bpttBlockSize = m_bpttBlockSize;
+  header.sizeVocabulary = sizeVocabulary;
+  header.sizeHidden = GetHiddenSize();
+  header.sizeFeature = GetFeatureSize();
+  header.sizeClasses = GetNumClasses();
+  header.sizeCompress = GetCompressSize();
+  header.orderDirectConnection = GetOrderDirectConnection();
+  header.sizeDirectConnection = (long long)m_weights.DirectNGram.size();
+
+  // Write the header and the sections, each in one block
+  static const char c_padding[c_mappedModelAlignment] = {0};
+  bool isWritten = (fwrite(&header, sizeof(MappedModelHeader), 1, fo) == 1);
+  long long position = (long long)sizeof(MappedModelHeader);
+  for (int k = 0; (k < c_numMappedModelSections) && isWritten; k++) {
+    size_t padding = (size_t)(sections[k].offset - position);
+    size_t size = (size_t)sections[k].size;
+    isWritten = (fwrite(c_padding, 1, padding, fo) == padding)
+    && (fwrite(contents[k], 1, size, fo) == size);
+    position = sections[k].offset + sections[k].size;
+  }
+  return isWritten;
+}
+
+
+/**
+ * Simply write the word projections/embeddings to a text file.
+ */
+void RnnLM::SaveWordEmbeddings(const string &filename) const {
+  FILE *fid = fopen(filename.c_str(), "wb");
+  
+  fprintf(fid, "%d %d\n", GetVocabularySize(), GetHiddenSize());
+  
+  for (int a = 0; a < GetVocabularySize(); a++) {
+    fprintf(fid, "%s ", m_vocab.GetNthWord(a).c_str());
+    for (int b = 0; b < GetHiddenSize(); b++) {
+      fprintf(fid, "%lf ", m_weights.Input2Hidden[a * GetHiddenSize() + b]);
+    }
+    fprintf(fid, "\n");
+  }
+  
+  fclose(fid);
+}
+
+
+/**
+ * Update a copy of this model, taken earlier during training,
+ * with the weights, the hidden layer and the state of the training
+ */
+void RnnLM::UpdateSnapshot(RnnLM &snapshot) const {
+  snapshot.m_weights = m_weights;
+  snapshot.m_state.HiddenLayer = m_state.HiddenLayer;
+  snapshot.m_rnnModelVersion = m_rnnModelVersion;
+  snapshot.m_iteration = m_iteration;
+  snapshot.m_currentPosTrainFile = m_currentPosTrainFile;
+  snapshot.m_numTrainWords = m_numTrainWords;
+  snapshot.m_initialLearningRate = m_initialLearningRate;
+  snapshot.m_learningRate = m_learningRate;
+  snapshot.m_doStartReducingLearningRate = m_doStartReducingLearningRate;
+}
+
+
+/**
+ * Create a new RNN state, with layers of the right sizes,
+ * the hidden layer set to 1 and an empty word history
+ */
+RnnState RnnLM::CreateState() const {
+  RnnState state(GetVocabularySize(), GetHiddenSize(), GetFeatureSize(),
+                 GetNumClasses(), GetCompressSize(),
+                 GetOrderDirectConnection());
+  ResetHiddenRnnStateAndWordHistory(state);
+  return state;
+}
+
+
 /**
  * Erase the hidden layer state and the word history.
  * Needed when processing sentences/queries in independent mode.
@@ -417,13 +827,15 @@ void RnnLM::ResetHiddenRnnStateAndWordHistory(RnnState &state,
   // Reset the BPTT history and hidden layer activation and gradient
   if (m_numBpttSteps > 0) {
     for (int a = 1; a < m_numBpttSteps + m_bpttBlockSize; a++) {
-      bpttState.History[a] = 0;
+      bpttState.History(a) = 0;
     }
     int sizeHidden = GetHiddenSize();
     for (int a = m_numBpttSteps + m_bpttBlockSize - 1; a > 1; a--) {
+      real *hiddenAtStep = bpttState.HiddenLayer(a);
+      real *gradientAtStep = bpttState.HiddenGradient(a);
       for (int b = 0; b < sizeHidden; b++) {
-        bpttState.HiddenLayer[a * sizeHidden + b] = 0;
-        bpttState.HiddenGradient[a * sizeHidden + b] = 0;
+        hiddenAtStep[b] = 0;
+        gradientAtStep[b] = 0;
       }
     }
   }
@@ -445,7 +857,7 @@ void RnnLM::ResetWordHistory(RnnState &state,
   // Reset the word history in the BPTT
   if (m_numBpttSteps > 0) {
     for (int a = 0; a < m_numBpttSteps+m_bpttBlockSize; a++) {
-      bpttState.History[a] = 0;
+      bpttState.History(a) = 0;
     }
   }
 }
@@ -483,7 +895,7 @@ void RnnLM::SaveHiddenRnnState(const RnnState &stateFrom,
  */
 void RnnLM::ForwardPropagateOneStep(int lastWord,
                                     int word,
-                                    RnnState &state) {
+                                    RnnState &state) const {
   // Nothing to do when the word is OOV
   if (word == -1) {
     return;
@@ -494,79 +906,49 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
     state.InputLayer[lastWord] = 1;
   }
 
-  // Erase activations of the hidden s(t) and hidden compression c(t) layers
+  // Forward-propagate s(t-1), w(t) and f(t) -> s(t)
+  // using the recurrent connection from the previous value s(t-1)
+  // of the hidden layer at time t-1 (copied to the recurrent input layer),
+  // the one-hot word representation w(t) at time t
+  // and the feature vector f(t) at time t
+  // Operation: s(t) = sigmoid(W * s(t-1) + U * w(t) + F * f(t))
+  // Since w(t) is one-hot, U * w(t) is the contiguous row of U for word w(t).
+  // The three terms and the sigmoid are computed in one fused pass.
+  // W and F are stored up to their (lazy weight decay) scales.
   int sizeHidden = GetHiddenSize();
   int sizeCompress = GetCompressSize();
-  state.HiddenLayer.assign(sizeHidden, 0.0);
-  state.CompressLayer.assign(sizeCompress, 0.0);
-
-  // Forward-propagate s(t-1) -> s(t)
-  // using recurrent connection,
-  // from previous value s(t-1) of the hidden layer at time t-1
-  // to the current value s(t) of the hidden layer at time t
-  // Operation: s(t) <- W * s(t-1)
-  // Note that s(t-1) was previously copied to the recurrent input layer.
-  int sizeInput = GetInputSize();
-  MultiplyMatrixXvectorBlas(state.HiddenLayer,
-                            state.RecurrentLayer,
-                            m_weights.Recurrent2Hidden,
-                            sizeHidden,
-                            0,
-                            sizeHidden);
-
-  // Forward-propagate w(t) -> s(t)
-  // from the one-hot word representation w(t) at time t
-  // to the hidden layer s(t) at time t
-  // Operation: s(t) <- s(t) + U * w(t)
-  // Note that we add to s(t) which is already non-zero.
-  if (lastWord != -1) {
-    for (int b = 0; b < sizeHidden; b++) {
-      state.HiddenLayer[b] +=
-      state.InputLayer[lastWord] * m_weights.Input2Hidden[lastWord + b * sizeInput];
-    }
-  }
-
   int sizeFeature = GetFeatureSize();
-  if (sizeFeature > 0) {
-    // Forward-propagate f(t) -> s(t)
-    // from the feature vector f(t) at time t
-    // to the hidden layer s(t) at time t
-    // Operation: s(t) <- s(t) + F * f(t)
-    // Note that we add to s(t) which is already non-zero.
-    MultiplyMatrixXvectorBlas(state.HiddenLayer,
-                              state.FeatureLayer,
-                              m_weights.Features2Hidden,
-                              sizeFeature,
-                              0,
-                              sizeHidden);
-  }
-
-  // Apply the sigmoid transfer function to the hidden values s(t)
-  // At this point, we have computed: z = W * s(t-1) + U * w(t) + F * f(t)
-  // Operation: 1 / (1 + exp(-z))
-  // We obtain: s(t) = sigmoid(W * s(t-1) + U * w(t) + F * f(t))
-  for (int a = 0; a < sizeHidden; a++) {
-    state.HiddenLayer[a] = LogisticSigmoid(state.HiddenLayer[a]);
+  const real *rowInput2Hidden = NULL;
+  real inputLastWord = 0;
+  if (lastWord != -1) {
+    rowInput2Hidden = &m_weights.Input2Hidden[lastWord * sizeHidden];
+    inputLastWord = state.InputLayer[lastWord];
   }
+  ForwardSigmoidLayer(&state.HiddenLayer[0],
+                      &m_weights.Recurrent2Hidden[0],
+                      m_weights.ScaleRecurrent2Hidden,
+                      &state.RecurrentLayer[0],
+                      sizeHidden,
+                      sizeHidden,
+                      rowInput2Hidden,
+                      inputLastWord,
+                      (sizeFeature > 0) ? &m_weights.Features2Hidden[0] : NULL,
+                      m_weights.ScaleFeatures2Hidden,
+                      (sizeFeature > 0) ? &state.FeatureLayer[0] : NULL,
+                      sizeFeature);
 
   if (sizeCompress > 0) {
     // Forward-propagate s(t) -> c(t)
     // from the hidden layer s(t) at time t
     // to the second (compression) hidden layer c(t) at time t
-    // Operation: C * s(t)
-    // TODO: check where CompressLayer was reset (should be)
-    MultiplyMatrixXvectorBlas(state.CompressLayer,
-                              state.HiddenLayer,
-                              m_weights.Hidden2Output,
-                              sizeHidden,
-                              0,
-                              sizeCompress);
-    // Apply the sigmoid transfer function to the hidden values c(t)
-    // Operation: 1 / (1 + exp(-z))
-    // We obtain: c(t) = sigmoid(C * s(t))
-    for (int a = 0; a < sizeCompress; a++) {
-      state.CompressLayer[a] = LogisticSigmoid(state.CompressLayer[a]);
-    }
+    // Operation: c(t) = sigmoid(C * s(t))
+    ForwardSigmoidLayer(&state.CompressLayer[0],
+                        &m_weights.Hidden2Output[0],
+                        1,
+                        &state.HiddenLayer[0],
+                        sizeHidden,
+                        sizeCompress,
+                        NULL, 0, NULL, 0, NULL, 0);
   }
 
   // Reset the output layer (segment that encodes the class probabilities)
@@ -620,67 +1002,16 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
   }
 
   // Apply direct connections to classes
-  // TODO: this is a horrible mess, but the problem is that models
-  // trained with this weird hashing function would be incompatible
-  // with models trained with a proper hash table (unordered_map),
-  // possibly sorted by the n-gram frequency.
-  // It would be nice to make that change (and perhaps retrain old models).
-  int sizeDirectConnection = GetNumDirectConnection();
-  int sizeDirectConnectionBy2 = sizeDirectConnection / 2;
-  int orderDirectConnection = GetOrderDirectConnection();
-  if (sizeDirectConnection > 0) {
-    // this will hold pointers to m_weightDataMain.weightsDirect
-    // that contains hash parameters
-    unsigned long long hash[c_maxNGramOrder];
-    for (int a = 0; a < orderDirectConnection; a++) {
-      hash[a] = 0;
-    }
-    for (int a = 0; a < orderDirectConnection; a++) {
-      int b = 0;
-      if (a > 0) {
-        if (state.WordHistory[a-1] == -1) {
-          // if OOV was in history, do not use this N-gram feature and higher orders
-          break;
-        }
-      }
-      hash[a] = c_Primes[0] * c_Primes[1];
-      for (b = 1; b <= a; b++) {
-        hash[a] += c_Primes[(a * c_Primes[b] + b) % c_PrimesSize] *
-        (unsigned long long)(state.WordHistory[b-1] + 1);
-        // update hash value based on words from the history
-      }
-      // make sure that starting hash index is in the first half
-      // of m_weightDataMain.weightsDirect
-      // (second part is reserved for history->words features)
-      hash[a] = hash[a] % sizeDirectConnectionBy2;
-    }
-    for (int a = sizeVocabulary; a < sizeOutput; a++) {
-      for (int b = 0; b < orderDirectConnection; b++) {
-        if (hash[b]) {
-          // apply current parameter and move to the next one
-          state.OutputLayer[a] += m_weights.DirectNGram[hash[b]];
-          hash[b]++;
-        } else {
-          break;
-        }
-      }
-    }
-  }
+  AddDirectNGramToClassOutputs(&state.WordHistory[0],
+                               &state.OutputLayer[sizeVocabulary]);
 
   // Apply the softmax transfer function to the hidden values s(t)
   // At this point, we have computed: x = V * s(t) + G * f(t)
   // Operation: exp(x_v) / sum_v exp(x_v)
   // We obtain: y(t) = softmax(V * s(t) + G * f(t) + n-gram features)
   // Note that this softmax is computed here only for classes, not words
-  double sum = 0.0;
-  for (int a = sizeVocabulary; a < sizeOutput; a++) {
-    double val = SafeExponentiate(state.OutputLayer[a]);
-    sum += val;
-    state.OutputLayer[a] = val;
-  }
-  for (int a = sizeVocabulary; a < sizeOutput; a++) {
-    state.OutputLayer[a] /= sum;
-  }
+  SoftmaxInPlace(&state.OutputLayer[sizeVocabulary],
+                 sizeOutput - sizeVocabulary);
 
   // What is the target class of the desired word?
   int targetClass = m_vocab.WordIndex2Class(word);
@@ -691,6 +1022,36 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
 }
 
 
+/**
+ * Forward-propagate the RNN through one full step from the context word
+ * to the word, return the log10-probability of the word,
+ * then store s(t) as s(t-1) and rotate the word history
+ */
+double RnnLM::ForwardPropagateWordAndAdvance(int &contextWord,
+                                             int word,
+                                             RnnState &state) const {
+  // Run one step of the RNN
+  ForwardPropagateOneStep(contextWord, word, state);
+
+  // Compute the log-probability of the current word
+  double logProbabilityWord = 0;
+  if (word >= 0) {
+    int outputNodeClass = m_vocab.WordIndex2Class(word) + GetVocabularySize();
+    double condProbaClass = state.OutputLayer[outputNodeClass];
+    double condProbaWordGivenClass = state.OutputLayer[word];
+    logProbabilityWord = log10(condProbaClass * condProbaWordGivenClass);
+  }
+
+  // Store the current state s(t) at the end of the input layer vector
+  // so that it can be used as s(t-1) at the next step
+  ForwardPropagateRecurrentConnectionOnly(state);
+
+  // Rotate the word history by one
+  ForwardPropagateWordHistory(state, contextWord, word);
+  return logProbabilityWord;
+}
+
+
 /**
  * Given a target word class, compute the conditional distribution
  * of all words within that class. The hidden state activation s(t)
@@ -701,7 +1062,7 @@ void RnnLM::ForwardPropagateOneStep(int lastWord,
  * Updates the RnnState object (but not the weights).
  */
 void RnnLM::ComputeRnnOutputsForGivenClass(int targetClass,
-                                           RnnState &state) {
+                                           RnnState &state) const {
   // How many words in that target class?
   int targetClassCount = m_vocab.SizeTargetClass(targetClass);
   // At which index in output layer y(t) position do the words
@@ -764,56 +1125,324 @@ void RnnLM::ComputeRnnOutputsForGivenClass(int targetClass,
   }
 
   // Apply direct connections to words
+  AddDirectNGramToWordOutputs(targetClass,
+                              &state.WordHistory[0],
+                              &state.OutputLayer[minIndexWithinClass]);
+
+  // Apply the softmax transfer function to the hidden values s(t)
+  // At this point, we have computed: x = V * s(t) + G * f(t)
+  // Operation: exp(x_v) / sum_v exp(x_v)
+  // We obtain: y(t) = softmax(V * s(t) + G * f(t) + n-gram features)
+  // Note that this operation is done only on the words
+  // in the class-specific vocabulary
+  SoftmaxInPlace(&state.OutputLayer[minIndexWithinClass], targetClassCount);
+}
+
+
+/**
+ * Add the direct n-gram connections, hashed from the word history,
+ * to the outputs of the classes.
+ */
+void RnnLM::AddDirectNGramToClassOutputs(const int *wordHistory,
+                                         real *classOutputs) const {
+  // TODO: this is a horrible mess, but the problem is that models
+  // trained with this weird hashing function would be incompatible
+  // with models trained with a proper hash table (unordered_map),
+  // possibly sorted by the n-gram frequency.
+  // It would be nice to make that change (and perhaps retrain old models).
   int sizeDirectConnection = GetNumDirectConnection();
   int sizeDirectConnectionBy2 = sizeDirectConnection / 2;
   int orderDirectConnection = GetOrderDirectConnection();
-  if (sizeDirectConnection > 0) {
-    unsigned long long hash[c_maxNGramOrder];
-    for (int a = 0; a < orderDirectConnection; a++) {
-      hash[a] = 0;
+  if (sizeDirectConnection == 0) {
+    return;
+  }
+  // this will hold pointers to m_weightDataMain.weightsDirect
+  // that contains hash parameters
+  unsigned long long hash[c_maxNGramOrder];
+  for (int a = 0; a < orderDirectConnection; a++) {
+    hash[a] = 0;
+  }
+  for (int a = 0; a < orderDirectConnection; a++) {
+    int b = 0;
+    if (a > 0) {
+      if (wordHistory[a-1] == -1) {
+        // if OOV was in history, do not use this N-gram feature and higher orders
+        break;
+      }
     }
-    for (int a = 0; a < orderDirectConnection; a++) {
-      int b = 0;
-      if ((a > 0) && (state.WordHistory[a-1] == -1)) {
+    hash[a] = c_Primes[0] * c_Primes[1];
+    for (b = 1; b <= a; b++) {
+      hash[a] += c_Primes[(a * c_Primes[b] + b) % c_PrimesSize] *
+      (unsigned long long)(wordHistory[b-1] + 1);
+      // update hash value based on words from the history
+    }
+    // make sure that starting hash index is in the first half
+    // of m_weightDataMain.weightsDirect
+    // (second part is reserved for history->words features)
+    hash[a] = hash[a] % sizeDirectConnectionBy2;
+  }
+  int sizeClasses = GetNumClasses();
+  for (int a = 0; a < sizeClasses; a++) {
+    for (int b = 0; b < orderDirectConnection; b++) {
+      if (hash[b]) {
+        // apply current parameter and move to the next one
+        classOutputs[a] += m_weights.DirectNGram[hash[b]];
+        hash[b]++;
+      } else {
         break;
       }
-      hash[a] = c_Primes[0] * c_Primes[1] * (unsigned long long)(targetClass+1);
-      for (b = 1; b <= a; b++) {
-        hash[a] += c_Primes[(a * c_Primes[b] + b) % c_PrimesSize] *
-        (unsigned long long)(state.WordHistory[b-1] + 1);
+    }
+  }
+}
+
+
+/**
+ * Add the direct n-gram connections, hashed from the word history
+ * and the target class, to the outputs of the words in the target class.
+ */
+void RnnLM::AddDirectNGramToWordOutputs(int targetClass,
+                                        const int *wordHistory,
+                                        real *wordOutputs) const {
+  int sizeDirectConnection = GetNumDirectConnection();
+  int sizeDirectConnectionBy2 = sizeDirectConnection / 2;
+  int orderDirectConnection = GetOrderDirectConnection();
+  if (sizeDirectConnection == 0) {
+    return;
+  }
+  unsigned long long hash[c_maxNGramOrder];
+  for (int a = 0; a < orderDirectConnection; a++) {
+    hash[a] = 0;
+  }
+  for (int a = 0; a < orderDirectConnection; a++) {
+    int b = 0;
+    if ((a > 0) && (wordHistory[a-1] == -1)) {
+      break;
+    }
+    hash[a] = c_Primes[0] * c_Primes[1] * (unsigned long long)(targetClass+1);
+    for (b = 1; b <= a; b++) {
+      hash[a] += c_Primes[(a * c_Primes[b] + b) % c_PrimesSize] *
+      (unsigned long long)(wordHistory[b-1] + 1);
+    }
+    hash[a] = (hash[a] % sizeDirectConnectionBy2) + sizeDirectConnectionBy2;
+  }
+  int targetClassCount = m_vocab.SizeTargetClass(targetClass);
+  for (int c = 0; c < targetClassCount; c++) {
+    for (int b = 0; b < orderDirectConnection; b++) {
+      if (hash[b]) {
+        wordOutputs[c] += m_weights.DirectNGram[hash[b]];
+        hash[b]++;
+        hash[b] = hash[b] % sizeDirectConnection;
+      } else {
+        break;
       }
-      hash[a] = (hash[a] % sizeDirectConnectionBy2) + sizeDirectConnectionBy2;
     }
-    for (int c = 0; c < targetClassCount; c++) {
-      int a = m_vocab.GetNthWordInClass(targetClass, c);
-      for (int b = 0; b < orderDirectConnection; b++) {
-        if (hash[b]) {
-          state.OutputLayer[a] += m_weights.DirectNGram[hash[b]];
-          hash[b]++;
-          hash[b] = hash[b] % sizeDirectConnection;
-        } else {
-          break;
-        }
+  }
+}
+
+
+/**
+ * Erase the hidden layer state, the feature vector and the word history
+ * of one stream in a batch of streams.
+ */
+void RnnLM::ResetBatchStream(RnnBatchState &batch, int stream) const {
+  int sizeHidden = GetHiddenSize();
+  int sizeFeature = GetFeatureSize();
+  // Set hidden unit activations to 1.0 and copy them to the recurrent input
+  for (int a = 0; a < sizeHidden; a++) {
+    batch.HiddenLayer[stream * sizeHidden + a] = 1.0;
+    batch.RecurrentLayer[stream * sizeHidden + a] = 1.0;
+  }
+  for (int a = 0; a < sizeFeature; a++) {
+    batch.FeatureLayer[stream * sizeFeature + a] = 0;
+  }
+  for (int a = 0; a < c_maxNGramOrder; a++) {
+    batch.WordHistory[stream * c_maxNGramOrder + a] = 0;
+  }
+}
+
+
+/**
+ * Forward-propagate a batch of independent streams through one full step.
+ */
+void RnnLM::ForwardPropagateBatch(const vector<int> &lastWords,
+                                  const vector<int> &words,
+                                  RnnBatchState &batch) const {
+  int batchSize = batch.GetBatchSize();
+  int sizeHidden = GetHiddenSize();
+  int sizeFeature = GetFeatureSize();
+  int sizeCompress = GetCompressSize();
+  int sizeVocabulary = GetVocabularySize();
+  int sizeClasses = GetNumClasses();
+  bool useFeatures2Output = ((sizeFeature > 0) && m_useFeatures2Output);
+
+  // Forward-propagate S(t-1) -> S(t) for all the streams at once,
+  // where each row of S is the hidden layer of one stream
+  // Operation: S(t) <- S(t-1) * W'
+  cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+              batchSize, sizeHidden, sizeHidden,
+              m_weights.ScaleRecurrent2Hidden,
+              &batch.RecurrentLayer[0], sizeHidden,
+              &m_weights.Recurrent2Hidden[0], sizeHidden,
+              0.0, &batch.HiddenLayer[0], sizeHidden);
+
+  // Forward-propagate w(t) -> s(t) for each stream,
+  // adding the row of U for the (one-hot) word w(t)
+  for (int i = 0; i < batchSize; i++) {
+    if ((words[i] != -1) && (lastWords[i] != -1)) {
+      real *hidden = &batch.HiddenLayer[i * sizeHidden];
+      const real *rowInput2Hidden =
+      &m_weights.Input2Hidden[lastWords[i] * sizeHidden];
+      for (int b = 0; b < sizeHidden; b++) {
+        hidden[b] += rowInput2Hidden[b];
       }
     }
   }
 
-  // Apply the softmax transfer function to the hidden values s(t)
-  // At this point, we have computed: x = V * s(t) + G * f(t)
-  // Operation: exp(x_v) / sum_v exp(x_v)
-  // We obtain: y(t) = softmax(V * s(t) + G * f(t) + n-gram features)
-  // Note that this operation is done only on the words
-  // in the class-specific vocabulary
-  double sum = 0;
-  for (int c = 0; c < targetClassCount; c++) {
-    int wordIndex = m_vocab.GetNthWordInClass(targetClass, c);
-    double val = SafeExponentiate(state.OutputLayer[wordIndex]);
-    sum += val;
-    state.OutputLayer[wordIndex] = val;
+  if (sizeFeature > 0) {
+    // Forward-propagate F(t) -> S(t)
+    // Operation: S(t) <- S(t) + F(t) * F'
+    cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                batchSize, sizeHidden, sizeFeature,
+                m_weights.ScaleFeatures2Hidden,
+                &batch.FeatureLayer[0], sizeFeature,
+                &m_weights.Features2Hidden[0], sizeFeature,
+                1.0, &batch.HiddenLayer[0], sizeHidden);
   }
-  for (int c = 0; c < targetClassCount; c++) {
-    int wordIndex = m_vocab.GetNthWordInClass(targetClass, c);
-    state.OutputLayer[wordIndex] /= sum;
+
+  // Apply the sigmoid transfer function to the hidden values of all streams
+  LogisticSigmoidInPlace(&batch.HiddenLayer[0], batchSize * sizeHidden);
+
+  // Streams without target word keep their state s(t) = s(t-1)
+  for (int i = 0; i < batchSize; i++) {
+    if (words[i] == -1) {
+      for (int b = 0; b < sizeHidden; b++) {
+        batch.HiddenLayer[i * sizeHidden + b] =
+        batch.RecurrentLayer[i * sizeHidden + b];
+      }
+    }
+  }
+
+  // Inputs X to the output layer: either S(t) or C(t) = sigmoid(S(t) * C')
+  real *inputs = &batch.HiddenLayer[0];
+  int sizeInputs = sizeHidden;
+  const real *weightsOutput = &m_weights.Hidden2Output[0];
+  if (sizeCompress > 0) {
+    cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                batchSize, sizeCompress, sizeHidden,
+                1.0, &batch.HiddenLayer[0], sizeHidden,
+                &m_weights.Hidden2Output[0], sizeHidden,
+                0.0, &batch.CompressLayer[0], sizeCompress);
+    LogisticSigmoidInPlace(&batch.CompressLayer[0], batchSize * sizeCompress);
+    inputs = &batch.CompressLayer[0];
+    sizeInputs = sizeCompress;
+    weightsOutput = &m_weights.Compress2Output[0];
+  }
+
+  // Forward-propagate X(t) -> Y(t) on the class outputs only
+  // Operation: Y(t) <- X(t) * V' + F(t) * G'
+  cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+              batchSize, sizeClasses, sizeInputs,
+              1.0, inputs, sizeInputs,
+              weightsOutput + (long)sizeVocabulary * sizeInputs, sizeInputs,
+              0.0, &batch.ClassOutputs[0], sizeClasses);
+  if (useFeatures2Output) {
+    cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                batchSize, sizeClasses, sizeFeature,
+                1.0, &batch.FeatureLayer[0], sizeFeature,
+                &m_weights.Features2Output[(long)sizeVocabulary * sizeFeature],
+                sizeFeature,
+                1.0, &batch.ClassOutputs[0], sizeClasses);
+  }
+
+  // Direct connections and softmax on the classes of each stream;
+  // group the streams by target class
+  vector<pair<int, int> > streamsByClass;
+  for (int i = 0; i < batchSize; i++) {
+    if (words[i] == -1) {
+      continue;
+    }
+    real *classOutputs = &batch.ClassOutputs[i * sizeClasses];
+    AddDirectNGramToClassOutputs(&batch.WordHistory[i * c_maxNGramOrder],
+                                 classOutputs);
+    SoftmaxInPlace(classOutputs, sizeClasses);
+    int targetClass = m_vocab.WordIndex2Class(words[i]);
+    batch.ClassProbability[i] = classOutputs[targetClass];
+    streamsByClass.push_back(pair<int, int>(targetClass, i));
+  }
+  sort(streamsByClass.begin(), streamsByClass.end());
+
+  // Compute the word outputs of all the streams sharing a target class
+  // with a single matrix-matrix product
+  size_t idxFrom = 0;
+  while (idxFrom < streamsByClass.size()) {
+    int targetClass = streamsByClass[idxFrom].first;
+    size_t idxTo = idxFrom;
+    while ((idxTo < streamsByClass.size()) &&
+           (streamsByClass[idxTo].first == targetClass)) {
+      idxTo++;
+    }
+    int numStreams = (int)(idxTo - idxFrom);
+    int targetClassCount = m_vocab.SizeTargetClass(targetClass);
+    int minIndexWithinClass = m_vocab.GetNthWordInClass(targetClass, 0);
+
+    // Gather the inputs (and features) of these streams
+    batch.ClassInputs.resize(numStreams * sizeInputs);
+    batch.ClassFeatures.resize(numStreams * sizeFeature);
+    for (int k = 0; k < numStreams; k++) {
+      int i = streamsByClass[idxFrom + k].second;
+      copy(inputs + i * sizeInputs, inputs + (i + 1) * sizeInputs,
+           batch.ClassInputs.begin() + k * sizeInputs);
+      copy(batch.FeatureLayer.begin() + i * sizeFeature,
+           batch.FeatureLayer.begin() + (i + 1) * sizeFeature,
+           batch.ClassFeatures.begin() + k * sizeFeature);
+    }
+
+    // Operation: Y_class(t) <- X_class(t) * V_class' + F_class(t) * G_class'
+    batch.WordOutputs.resize(numStreams * targetClassCount);
+    cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                numStreams, targetClassCount, sizeInputs,
+                1.0, &batch.ClassInputs[0], sizeInputs,
+                weightsOutput + (long)minIndexWithinClass * sizeInputs,
+                sizeInputs,
+                0.0, &batch.WordOutputs[0], targetClassCount);
+    if (useFeatures2Output) {
+      cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                  numStreams, targetClassCount, sizeFeature,
+                  1.0, &batch.ClassFeatures[0], sizeFeature,
+                  &m_weights.Features2Output[(long)minIndexWithinClass *
+                                             sizeFeature],
+                  sizeFeature,
+                  1.0, &batch.WordOutputs[0], targetClassCount);
+    }
+
+    // Direct connections and softmax on the words of each stream
+    for (int k = 0; k < numStreams; k++) {
+      int i = streamsByClass[idxFrom + k].second;
+      real *wordOutputs = &batch.WordOutputs[k * targetClassCount];
+      AddDirectNGramToWordOutputs(targetClass,
+                                  &batch.WordHistory[i * c_maxNGramOrder],
+                                  wordOutputs);
+      SoftmaxInPlace(wordOutputs, targetClassCount);
+      batch.WordProbability[i] = wordOutputs[words[i] - minIndexWithinClass];
+    }
+    idxFrom = idxTo;
+  }
+}
+
+
+/**
+ * Copy the hidden layer activations of all streams to the recurrent
+ * connections, then shift the word history of each stream.
+ */
+void RnnLM::ForwardPropagateBatchWordHistory(const vector<int> &words,
+                                             RnnBatchState &batch) const {
+  batch.RecurrentLayer = batch.HiddenLayer;
+  for (int i = 0; i < batch.GetBatchSize(); i++) {
+    int *wordHistory = &batch.WordHistory[i * c_maxNGramOrder];
+    for (int a = c_maxNGramOrder - 1; a > 0; a--) {
+      wordHistory[a] = wordHistory[a-1];
+    }
+    wordHistory[0] = words[i];
   }
 }
 
@@ -826,18 +1455,18 @@ void RnnLM::ComputeRnnOutputsForGivenClass(int targetClass,
  * i in [idxYFrom, idxYTo[ of vector y
  * and on a contiguous subset of indices j in [idxXFrom, idxXTo[ of vector x.
  */
-void RnnLM::MultiplyMatrixXvectorBlas(vector<double> &vectorY,
-                                      vector<double> &vectorX,
-                                      vector<double> &matrixA,
+void RnnLM::MultiplyMatrixXvectorBlas(vector<real> &vectorY,
+                                      const vector<real> &vectorX,
+                                      const WeightVector &matrixA,
                                       int widthMatrix,
                                       int idxYFrom,
                                       int idxYTo) const {
-  double *vecX = &vectorX[0];
+  const real *vecX = &vectorX[0];
   int idxAFrom = idxYFrom * widthMatrix;
-  double *matA = &matrixA[idxAFrom];
+  const real *matA = &matrixA[idxAFrom];
   int heightMatrix = idxYTo - idxYFrom;
-  double *vecY = &vectorY[idxYFrom];
-  cblas_dgemv(CblasRowMajor, CblasNoTrans,
+  real *vecY = &vectorY[idxYFrom];
+  cblas_xgemv(CblasRowMajor, CblasNoTrans,
               heightMatrix, widthMatrix, 1.0, matA, widthMatrix,
               vecX, 1,
               1.0, vecY, 1);
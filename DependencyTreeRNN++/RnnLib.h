@@ -37,6 +37,7 @@
 #ifndef __DependencyTreeRNN____rnnlmlib__
 #define __DependencyTreeRNN____rnnlmlib__
 
+#include <math.h>
 #include <vector>
 #include <map>
 #include <set>
@@ -44,6 +45,7 @@
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
+#include <memory>
 #include "RnnState.h"
 #include "RnnWeights.h"
 #include "CorpusWordReader.h"
@@ -64,9 +66,37 @@ public:
         bool doLoadModel);
 
   /**
-   * Load the model.
+   * Load the model from a file (in the text or memory-mapped format).
    */
-  void LoadRnnModelFromFile();
+  void LoadRnnModelFromFile(const std::string &filename);
+
+  /**
+   * Once we train the RNN model, it is nice to save it to a text or binary
+   * file (in the format of version m_rnnModelVersion). The model is written
+   * to a temporary file, flushed to disk, then renamed.
+   */
+  bool SaveRnnModelToFile(const std::string &filename);
+
+  /**
+   * Simply write the word projections/embeddings to a text file.
+   */
+  void SaveWordEmbeddings(const std::string &filename) const;
+
+  /**
+   * Update a copy of this model, taken earlier during training, with what
+   * training changes: the weights, the hidden layer, the position
+   * and the learning rate of the training, and the format of the file.
+   * The vocabulary and the sizes must not have changed; the weights
+   * are copied into the buffers of the copy, without reallocating them.
+   */
+  void UpdateSnapshot(RnnLM &snapshot) const;
+
+  /**
+   * Set the version of the format in which the model is saved:
+   * 20 (text header and matrices of floats)
+   * or 21 (memory-mapped, see MappedModel.h)
+   */
+  void SetModelVersion(int val) { m_rnnModelVersion = val; }
 
   /**
    * Return the number of words/entity tokens in the vocabulary.
@@ -117,6 +147,16 @@ public:
    */
   int GetNumClasses() const { return m_weights.GetNumClasses(); }
 
+  /**
+   * Create a new RNN state, with layers of the right sizes, the hidden
+   * layer set to 1 and an empty word history. The forward-propagation
+   * functions are const and modify only the state given as argument,
+   * so that several threads can score with the same model (weights
+   * and vocabulary), as long as each thread uses its own state
+   * (see RnnScorer).
+   */
+  RnnState CreateState() const;
+
 protected:
 
   /**
@@ -153,9 +193,9 @@ protected:
    * i in [idxYFrom, idxYTo[ of vector y
    * and on a contiguous subset of indices j in [idxXFrom, idxXTo[ of vector x.
    */
-  void MultiplyMatrixXvectorBlas(std::vector<double> &vectorY,
-                                 std::vector<double> &vectorX,
-                                 std::vector<double> &matrixA,
+  void MultiplyMatrixXvectorBlas(std::vector<real> &vectorY,
+                                 const std::vector<real> &vectorX,
+                                 const WeightVector &matrixA,
                                  int widthMatrix,
                                  int idxYFrom,
                                  int idxYTo) const;
@@ -179,6 +219,8 @@ public:
    * It is not thread safe yet because there is this file (m_featureMatrixFile)
    * that contains the topic model for the words (LDA-style, see the paper),
    * that is loaded by the function. It also modifies the vocabulary hash tables.
+   * The weights are neither allocated nor initialized when
+   * doInitializeWeights is false (i.e., when they are mapped from a file).
    */
   bool InitializeRnnModel(int sizeInput,
                           int sizeHidden,
@@ -186,7 +228,22 @@ public:
                           int sizeClasses,
                           int sizeCompress,
                           long long sizeDirectConnection,
-                          int orderDirectConnection);
+                          int orderDirectConnection,
+                          bool doInitializeWeights = true);
+
+  /**
+   * Load a model file in the memory-mapped format (version 21):
+   * the weights are not copied but mapped from the file.
+   */
+  void LoadMappedRnnModel(const std::shared_ptr<MappedFile> &file,
+                          const std::string &filename);
+
+  /**
+   * Write the model in the text format (version 20)
+   * or in the memory-mapped format (version 21)
+   */
+  bool WriteRnnModel(FILE *fo);
+  bool WriteMappedRnnModel(FILE *fo);
 
   /**
    * Erase the hidden layer state and the word history.
@@ -219,7 +276,7 @@ public:
    */
   void ForwardPropagateOneStep(int lastWord,
                                int word,
-                               RnnState &state);
+                               RnnState &state) const;
 
   /**
    * Given a target word class, compute the conditional distribution
@@ -231,7 +288,62 @@ public:
    * Updates the RnnState object (but not the weights).
    */
   void ComputeRnnOutputsForGivenClass(const int targetClass,
-                                      RnnState &state);
+                                      RnnState &state) const;
+
+  /**
+   * Forward-propagate the RNN through one full step from the context word
+   * to the word, and return the log10-probability of the word
+   * (0 if the word is -1, i.e. OOV). Then store s(t) as s(t-1) and
+   * rotate the word history, so that the word becomes the context word.
+   * Updates the RnnState object and the context word (but not the weights).
+   */
+  double ForwardPropagateWordAndAdvance(int &contextWord,
+                                        int word,
+                                        RnnState &state) const;
+
+  /**
+   * Erase the hidden layer state, the feature vector and the word history
+   * of one stream in a batch of streams.
+   */
+  void ResetBatchStream(RnnBatchState &batch, int stream) const;
+
+  /**
+   * Forward-propagate a batch of independent streams through one full step,
+   * as ForwardPropagateOneStep does for a single stream, but using
+   * matrix-matrix products over all the streams for the hidden layer
+   * and for the class outputs, and over the streams sharing
+   * the same target class for the word outputs.
+   * Streams whose target word is -1 (OOV or finished) keep their state.
+   * Stores the conditional probabilities of the target class and of
+   * the target word given its class in the RnnBatchState object.
+   */
+  void ForwardPropagateBatch(const std::vector<int> &lastWords,
+                             const std::vector<int> &words,
+                             RnnBatchState &batch) const;
+
+  /**
+   * Copy the hidden layer activations of all streams to the recurrent
+   * connections, then shift the word history of each stream by one,
+   * adding the word from words.
+   */
+  void ForwardPropagateBatchWordHistory(const std::vector<int> &words,
+                                        RnnBatchState &batch) const;
+
+  /**
+   * Add the direct n-gram connections, hashed from the word history,
+   * to the outputs of the classes (classOutputs[k] for class k)
+   */
+  void AddDirectNGramToClassOutputs(const int *wordHistory,
+                                    real *classOutputs) const;
+
+  /**
+   * Add the direct n-gram connections, hashed from the word history
+   * and the target class, to the outputs of the words in the target class
+   * (wordOutputs[c] for the c-th word of the class)
+   */
+  void AddDirectNGramToWordOutputs(int targetClass,
+                                   const int *wordHistory,
+                                   real *wordOutputs) const;
 
   /**
    * Copies the hidden layer activation s(t) to the recurrent connections.
@@ -343,7 +455,7 @@ protected:
    * where W = number of words (m_vocabSize)
    * and T = number of topics (m_featureSize)
    */
-  std::vector<double> m_featureMatrix;
+  std::vector<real> m_featureMatrix;
 
   /**
    * RNN model learning parameters. All this information will simply
@@ -358,6 +470,17 @@ protected:
   int m_numBpttSteps;
   int m_bpttBlockSize;
 
+  /**
+   * Number of independent sentences (or sentence unrolls)
+   * that are forward-propagated together at test time
+   */
+  int m_batchSize;
+
+  /**
+   * Number of threads scoring independent sentences at test time
+   */
+  int m_numThreads;
+
   /**
    * Information relative to the training of the RNN
    */
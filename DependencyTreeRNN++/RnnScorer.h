@@ -0,0 +1,82 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____RnnScorer__
+#define __DependencyTreeRNN____RnnScorer__
+
+#include <vector>
+#include "RnnLib.h"
+#include "RnnState.h"
+
+
+/**
+ * Lightweight scoring context for one caller (e.g., one thread):
+ * stores the state of the RNN and the context word, and scores words
+ * against a model that it does not modify. Several scorers can share
+ * one loaded model, and be used concurrently from different threads.
+ */
+class RnnScorer {
+public:
+
+  /**
+   * Constructor
+   */
+  RnnScorer(const RnnLM &model)
+  : m_model(model),
+  m_state(model.CreateState()),
+  m_contextWord(0) {
+  }
+
+  /**
+   * Erase the hidden layer state and the word history,
+   * and reset the context word to </s> (end of sentence)
+   */
+  void Reset() {
+    m_model.ResetHiddenRnnStateAndWordHistory(m_state);
+    m_contextWord = 0;
+  }
+
+  /**
+   * Return the log10-probability of the next word (0 if the word is -1),
+   * given the history of words, then append that word to the history
+   */
+  double NextWord(int word) {
+    return m_model.ForwardPropagateWordAndAdvance(m_contextWord, word,
+                                                  m_state);
+  }
+
+  /**
+   * Reset the history and return the log10-probability of a sentence
+   * (a sequence of word indexes, ending with </s>),
+   * ignoring the OOV words (of index -1)
+   */
+  double ScoreSentence(const std::vector<int> &words) {
+    Reset();
+    double logProbability = 0;
+    for (size_t k = 0; k < words.size(); k++) {
+      logProbability += NextWord(words[k]);
+    }
+    return logProbability;
+  }
+
+  /**
+   * Access the state of the RNN (e.g., to set the feature vector)
+   */
+  RnnState &GetState() { return m_state; }
+
+protected:
+
+  // Model, shared by all the scorers
+  const RnnLM &m_model;
+
+  // State of the RNN, specific to this scorer
+  RnnState m_state;
+
+  // Last word (context word)
+  int m_contextWord;
+};
+
+#endif /* defined(__DependencyTreeRNN____RnnScorer__) */
@@ -39,6 +39,9 @@
 
 #include <vector>
 #include <algorithm>
+#include "Utils.h"
+#include "WeightVector.h"
+#include "RnnWeights.h"
 
 
 /**
@@ -62,7 +65,6 @@ public:
            int sizeFeature,
            int sizeClasses,
            int sizeCompress,
-           long long sizeDirectConnection,
            int orderDirectConnection)
   : m_orderDirectConnection(orderDirectConnection) {
     int sizeInput = sizeVocabulary;
@@ -83,30 +85,30 @@ public:
   }
 
   // Input layer (i.e., words)
-  std::vector<double> InputLayer;
+  std::vector<real> InputLayer;
   // Input feature layer (e.g., topics)
-  std::vector<double> FeatureLayer;
+  std::vector<real> FeatureLayer;
   // Hidden layer at previous time step
-  std::vector<double> RecurrentLayer;
+  std::vector<real> RecurrentLayer;
   // Hidden layer
-  std::vector<double> HiddenLayer;
+  std::vector<real> HiddenLayer;
   // Second (compression) hidden layer
-  std::vector<double> CompressLayer;
+  std::vector<real> CompressLayer;
   // Output layer
-  std::vector<double> OutputLayer;
+  std::vector<real> OutputLayer;
 
   // Gradient to the words in input layer
-  std::vector<double> InputGradient;
+  std::vector<real> InputGradient;
   // Gradient to the features in input layer
-  std::vector<double> FeatureGradient;
+  std::vector<real> FeatureGradient;
   // Gradient to the hidden state at previous time step
-  std::vector<double> RecurrentGradient;
+  std::vector<real> RecurrentGradient;
   // Gradient to the hidden layer
-  std::vector<double> HiddenGradient;
+  std::vector<real> HiddenGradient;
   // Gradient to the second (compression) hidden layer
-  std::vector<double> CompressGradient;
+  std::vector<real> CompressGradient;
   // Gradient to the output layer
-  std::vector<double> OutputGradient;
+  std::vector<real> OutputGradient;
 
   // Word history
   std::vector<int> WordHistory;
@@ -162,21 +164,80 @@ protected:
 };
 
 
+/**
+ * State of a batch of independent streams (e.g., the candidate sentences
+ * of a question or the unrolls of a sentence) that are forward-propagated
+ * together through the RNN at test time. Each activation is stored
+ * as a matrix with one contiguous row per stream.
+ */
+class RnnBatchState {
+public:
+
+  /**
+   * Constructor
+   */
+  RnnBatchState(int batchSize, int sizeHidden, int sizeFeature,
+                int sizeCompress, int sizeClasses)
+  : m_batchSize(batchSize) {
+    HiddenLayer.assign(batchSize * sizeHidden, 0.0);
+    RecurrentLayer.assign(batchSize * sizeHidden, 0.0);
+    FeatureLayer.assign(batchSize * sizeFeature, 0.0);
+    CompressLayer.assign(batchSize * sizeCompress, 0.0);
+    ClassOutputs.assign(batchSize * sizeClasses, 0.0);
+    ClassProbability.assign(batchSize, 0.0);
+    WordProbability.assign(batchSize, 0.0);
+    WordHistory.assign(batchSize * c_maxNGramOrder, 0);
+  }
+
+  /**
+   * Number of streams in the batch
+   */
+  int GetBatchSize() const { return m_batchSize; }
+
+  // Hidden layer activations s(t) of each stream
+  std::vector<real> HiddenLayer;
+  // Previous hidden layer activations s(t-1) of each stream
+  std::vector<real> RecurrentLayer;
+  // Feature layer activations f(t) of each stream
+  std::vector<real> FeatureLayer;
+  // Compression layer activations c(t) of each stream
+  std::vector<real> CompressLayer;
+  // Class outputs (after softmax) of each stream
+  std::vector<real> ClassOutputs;
+  // Conditional probability of the target class of each stream
+  std::vector<real> ClassProbability;
+  // Conditional probability of the target word given its class
+  std::vector<real> WordProbability;
+  // Word history of each stream
+  std::vector<int> WordHistory;
+
+  // Work buffers for the word outputs of the streams of a same class
+  std::vector<real> ClassInputs;
+  std::vector<real> ClassFeatures;
+  std::vector<real> WordOutputs;
+
+protected:
+  // Number of streams
+  int m_batchSize;
+};
+
+
 class RnnBptt {
 public:
 
   /**
    * Constructor
    */
-  RnnBptt(int sizeVocabulary, int sizeHidden, int sizeFeature,
+  RnnBptt(int sizeHidden, int sizeFeature,
           int numBpttSteps, int bpttBlockSize)
-  : m_bpttSteps(numBpttSteps), m_bpttBlock(bpttBlockSize),
-  m_sizeHidden(sizeHidden), m_sizeFeature(sizeFeature),
-  m_steps(0) {
+  : m_bpttSteps(numBpttSteps), m_bpttBlock(bpttBlockSize), m_steps(0),
+  m_sizeHidden(sizeHidden), m_sizeFeature(sizeFeature), m_head(0) {
     Reset();
-    WeightsInput2Hidden.assign(sizeVocabulary * sizeHidden, 0);
-    WeightsRecurrent2Hidden.assign(sizeHidden * sizeHidden, 0);
-    WeightsFeature2Hidden.assign(sizeFeature * sizeHidden, 0);
+    m_gradientWords.reserve(NumSlots());
+    m_gradientInput2Hidden.reserve(NumSlots() * sizeHidden);
+    StepHiddenGradients.assign(NumSlots() * sizeHidden, 0);
+    StepRecurrentLayers.assign(NumSlots() * sizeHidden, 0);
+    StepFeatureLayers.assign(NumSlots() * sizeFeature, 0);
   }
 
 
@@ -191,63 +252,157 @@ public:
    */
   void Reset() {
     m_steps = 0;
-    History.assign(m_bpttSteps + m_bpttBlock + 10, -1);
-    FeatureLayer.assign((m_bpttSteps + m_bpttBlock + 2) * m_sizeFeature, 0);
-    HiddenLayer.assign((m_bpttSteps + m_bpttBlock + 1) * m_sizeHidden, 0);
-    HiddenGradient.assign((m_bpttSteps + m_bpttBlock + 1) * m_sizeHidden, 0);
+    m_head = 0;
+    m_history.assign(NumSlots(), -1);
+    m_featureLayer.assign(NumSlots() * m_sizeFeature, 0);
+    m_hiddenLayer.assign(NumSlots() * m_sizeHidden, 0);
+    m_hiddenGradient.assign(NumSlots() * m_sizeHidden, 0);
   }
 
 
   /**
-   * Shift the BPTT memory by one
+   * Reset the gradients to the weights accumulated by BPTT
+   */
+  void ResetGradients() {
+    m_gradientWords.clear();
+    m_gradientInput2Hidden.clear();
+  }
+
+
+  /**
+   * Shift the BPTT memory by one: the slot of the oldest step
+   * becomes the slot of step 0 (only the head of the circular
+   * buffer moves) and receives the last word
    */
   void Shift(int lastWord) {
     if (m_bpttSteps > 0) {
-      // Shift the history of words
-      for (int a = m_bpttSteps + m_bpttBlock - 1; a > 0; a--) {
-        History[a] = History[a - 1];
+      m_head = (m_head == 0) ? (NumSlots() - 1) : (m_head - 1);
+      m_history[m_head] = lastWord;
+    }
+    // Keep track of the number of that can be considered for BPTT
+    m_steps++;
+    m_steps = std::min(m_steps, m_bpttSteps + m_bpttBlock);
+  }
+
+
+  /**
+   * Word at step k in the past (k = 0 for the current step)
+   */
+  int &History(int k) { return m_history[Slot(k)]; }
+
+  /**
+   * Feature inputs at step k in the past
+   */
+  real *FeatureLayer(int k) { return &m_featureLayer[Slot(k) * m_sizeFeature]; }
+
+  /**
+   * Hidden layer activations at step k in the past
+   */
+  real *HiddenLayer(int k) { return &m_hiddenLayer[Slot(k) * m_sizeHidden]; }
+
+  /**
+   * Gradients to the hidden layer at step k in the past
+   */
+  real *HiddenGradient(int k) {
+    return &m_hiddenGradient[Slot(k) * m_sizeHidden];
+  }
+
+
+  /**
+   * Row of the gradients to the input weights of a word
+   * (zero when the word was not seen since the last update)
+   */
+  real *GradientInput2Hidden(int word) {
+    for (size_t k = 0; k < m_gradientWords.size(); k++) {
+      if (m_gradientWords[k] == word) {
+        return &m_gradientInput2Hidden[k * m_sizeHidden];
       }
-      History[0] = lastWord;
+    }
+    m_gradientWords.push_back(word);
+    m_gradientInput2Hidden.resize(m_gradientWords.size() * m_sizeHidden, 0);
+    return &m_gradientInput2Hidden[m_gradientInput2Hidden.size() - m_sizeHidden];
+  }
 
-      // Shift the history of hidden layer activations
-      for (int a = m_bpttSteps + m_bpttBlock - 1; a > 0; a--) {
+
+  /**
+   * Add the gradients to the rows of the (word-major) input weights
+   * of the words in the BPTT history, decaying each row by coeffSGD
+   * once per occurrence of its word, then clear the gradients
+   */
+  void ApplyGradientsInput2Hidden(RnnWeights &weights,
+                                  real coeffSGD) {
+    for (int step = 0; step < m_steps - 2; step++) {
+      int word = History(step);
+      if (word != -1) {
+        real *rowInput2Hidden = weights.Input2HiddenRow(word);
+        real *rowGradInput2Hidden = GradientInput2Hidden(word);
         for (int b = 0; b < m_sizeHidden; b++) {
-          HiddenLayer[a * m_sizeHidden + b] =
-          HiddenLayer[(a - 1) * m_sizeHidden + b];
-          HiddenGradient[a * m_sizeHidden + b] =
-          HiddenGradient[(a - 1) * m_sizeHidden + b];
+          rowInput2Hidden[b] =
+          rowGradInput2Hidden[b] + coeffSGD * rowInput2Hidden[b];
+          rowGradInput2Hidden[b] = 0;
         }
       }
+    }
+    m_gradientWords.clear();
+    m_gradientInput2Hidden.clear();
+  }
 
-      // Shift the history of feature activations
-      for (int a = m_bpttSteps + m_bpttBlock - 1; a > 0; a--) {
-        for (int b = 0; b < m_sizeFeature; b++) {
-          FeatureLayer[a * m_sizeFeature + b] =
-          FeatureLayer[(a - 1) * m_sizeFeature + b];
-        }
+
+  /**
+   * Add the gradients to the rows of the (word-major) input weights
+   * of the words seen since the last update, decaying each row
+   * by coeffSGD, then clear the gradients
+   */
+  void ApplyTouchedGradientsInput2Hidden(RnnWeights &weights,
+                                         real coeffSGD) {
+    for (size_t k = 0; k < m_gradientWords.size(); k++) {
+      real *rowInput2Hidden = weights.Input2HiddenRow(m_gradientWords[k]);
+      const real *rowGradInput2Hidden = &m_gradientInput2Hidden[k * m_sizeHidden];
+      for (int b = 0; b < m_sizeHidden; b++) {
+        rowInput2Hidden[b] =
+        rowGradInput2Hidden[b] + coeffSGD * rowInput2Hidden[b];
       }
     }
-    // Keep track of the number of that can be considered for BPTT
-    m_steps++;
-    m_steps = std::min(m_steps, m_bpttSteps + m_bpttBlock);
+    m_gradientWords.clear();
+    m_gradientInput2Hidden.clear();
   }
 
 
-  // Word history
-  std::vector<int> History;
-  // History of feature inputs
-  std::vector<double> FeatureLayer;
-  // History of hidden layer inputs
-  std::vector<double> HiddenLayer;
-  // History of gradients to the hidden layer
-  std::vector<double> HiddenGradient;
-  // Gradients to the weights, to be added to the SGD gradients
-  std::vector<double> WeightsInput2Hidden;
-  std::vector<double> WeightsRecurrent2Hidden;
-  std::vector<double> WeightsFeature2Hidden;
+  // Hidden gradients, previous hidden activations and feature inputs
+  // at each step of back-propagation through time (one row per step),
+  // from which the gradients to the weights to the hidden layer
+  // are computed once for all the steps
+  std::vector<real> StepHiddenGradients;
+  std::vector<real> StepRecurrentLayers;
+  std::vector<real> StepFeatureLayers;
 
 
 protected:
+
+  /**
+   * Number of slots of the circular buffers
+   */
+  int NumSlots() const { return m_bpttSteps + m_bpttBlock; }
+
+  /**
+   * Slot of the circular buffers storing step k in the past
+   */
+  int Slot(int k) const {
+    int slot = m_head + k;
+    return (slot < NumSlots()) ? slot : (slot - NumSlots());
+  }
+
+  // Circular buffers (starting at slot m_head) of the word history,
+  // of the feature inputs, of the hidden layer inputs
+  // and of the gradients to the hidden layer
+  std::vector<int> m_history;
+  std::vector<real> m_featureLayer;
+  std::vector<real> m_hiddenLayer;
+  std::vector<real> m_hiddenGradient;
+  // Gradients to the input weights, only for the rows of the words
+  // seen in the BPTT history since the last update
+  std::vector<int> m_gradientWords;
+  std::vector<real> m_gradientInput2Hidden;
   // Number of steps gradients are back-propagated through time
   int m_bpttSteps;
   // How many steps (words) do we wait between consecutive BPTT?
@@ -258,6 +413,8 @@ protected:
   int m_sizeHidden;
   // Number of features
   int m_sizeFeature;
+  // Slot of the current step in the circular buffers
+  int m_head;
 };
 
 #endif
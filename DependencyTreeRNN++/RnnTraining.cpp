@@ -50,10 +50,9 @@
 #include "RnnState.h"
 #include "RnnTraining.h"
 #include "CorpusWordReader.h"
-// Include BLAS
-extern "C" {
-#include <cblas.h>
-}
+#include "RnnBlas.h"
+#include "WorkStealingScheduler.h"
+#include "CheckpointWriter.h"
 
 using namespace std;
 
@@ -145,85 +144,6 @@ bool RnnLMTraining::LearnVocabularyFromTrainFile(int numClasses) {
 }
 
 
-/**
- * Once we train the RNN model, it is nice to save it to a text or binary file
- */
-bool RnnLMTraining::SaveRnnModelToFile() {
-  FILE *fo = fopen(m_rnnModelFile.c_str(), "wb");
-  if (fo == NULL) {
-    printf("Cannot create file %s\n", m_rnnModelFile.c_str());
-    return false;
-  }
-  fprintf(fo, "version: %d\n", m_rnnModelVersion);
-  fprintf(fo, "file format: 1\n\n");
-  
-  fprintf(fo, "training data file: %s\n", m_trainFile.c_str());
-  fprintf(fo, "validation data file: %s\n\n", m_validationFile.c_str());
-  
-  fprintf(fo, "last probability of validation data: %f\n", 0.0);
-  fprintf(fo, "number of finished iterations: %d\n", m_iteration);
-  
-  fprintf(fo, "current position in training data: %ld\n", m_currentPosTrainFile);
-  fprintf(fo, "current probability of training data: %f\n", 0.0);
-  // dummy used for backward compatibility
-  int anti_k = 0;
-  fprintf(fo, "save after processing # words: %d\n", anti_k);
-  fprintf(fo, "# of training words: %ld\n", m_numTrainWords);
-  
-  fprintf(fo, "input layer size: %d\n", GetInputSize());
-  fprintf(fo, "feature size: %d\n", GetFeatureSize());
-  if (!m_featureMatrixUsed) {
-    fprintf(fo, "feature matrix used: 0\n");
-  } else {
-    fprintf(fo, "feature matrix used: 1\n");
-  }
-  fprintf(fo, "feature gamma: %lf\n", m_featureGammaCoeff);
-  fprintf(fo, "hidden layer size: %d\n", GetHiddenSize());
-  fprintf(fo, "compression layer size: %d\n", GetCompressSize());
-  fprintf(fo, "output layer size: %d\n", GetOutputSize());
-  
-  fprintf(fo, "direct connections: %d\n", GetNumDirectConnection());
-  fprintf(fo, "direct order: %d\n", GetOrderDirectConnection());
-  
-  fprintf(fo, "bptt: %d\n", m_numBpttSteps);
-  fprintf(fo, "bptt block: %d\n", m_bpttBlockSize);
-  
-  fprintf(fo, "vocabulary size: %d\n", GetVocabularySize());
-  fprintf(fo, "class size: %d\n", GetNumClasses());
-  
-  fprintf(fo, "old classes: 0\n");
-  fprintf(fo, "uses class file: %d\n", m_usesClassFile ? 1 : 0);
-  fprintf(fo, "independent sentences mode: %d\n",
-          m_areSentencesIndependent ? 1 : 0);
-  
-  fprintf(fo, "starting learning rate: %f\n", m_initialLearningRate);
-  fprintf(fo, "current learning rate: %f\n", m_learningRate);
-  fprintf(fo, "learning rate decrease: %d\n", m_doStartReducingLearningRate);
-  fprintf(fo, "\n");
-  
-  // Save the vocabulary, one word per line
-  int sizeVocabulary = GetVocabularySize();
-  m_vocab.Save(fo);
-
-  int sizeHidden = GetHiddenSize();
-  printf("Saving %d hidden activations...\n", sizeHidden);
-  SaveBinaryVector(fo, sizeHidden, m_state.HiddenLayer);
-
-  // Save all the weights
-  m_weights.Save(fo);
-
-  // Save the feature matrix
-  if (m_featureMatrixUsed) {
-    int sizeFeature = GetFeatureSize();
-    printf("Saving %dx%d feature matrix...\n", sizeFeature, sizeVocabulary);
-    SaveBinaryMatrix(fo, sizeFeature, sizeVocabulary, m_featureMatrix);
-  }
-  fclose(fo);
-
-  return true;
-}
-
-
 /**
  * Cleans all activations and error vectors, in the input, hidden,
  * compression, feature and output layers, and resets word history
@@ -265,24 +185,23 @@ void RnnLMTraining::ResetAllRnnActivations(RnnState &state) const {
 
 
 /**
- * One step of backpropagation of the errors through the RNN
- * (optionally, backpropagation through time, BPTT) and of gradient descent.
+ * Back-propagation of the errors from the output layer to the hidden layer
+ * (the gradient is left in state.HiddenGradient) and one step
+ * of gradient descent on the weights to the output layer.
  */
-void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWord,
-                                                                  int word) {
-  // No learning step if OOV word
-  if (word == -1) {
-    return;
-  }
-  
+void RnnLMTraining::BackPropagateOutputLayer(int word,
+                                             double learningRate,
+                                             double regularizationRate,
+                                             int numDecaySteps,
+                                             RnnState &state,
+                                             RnnWeights &updatedWeights) {
   // Learning rates, with and without regularization
-  double beta = m_regularizationRate * m_learningRate;
-  double alpha = m_learningRate;
-  // Regularization is done every 10th step
-  double coeffSGD = ((m_wordCounter % 10) == 0) ? (1.0 - beta) : 1.0;
+  double beta = regularizationRate * learningRate;
+  double alpha = learningRate;
+  // Regularization is done every 10th step (the caller counts the steps)
+  double coeffSGD = pow(1.0 - beta, numDecaySteps);
   
   // Matrix sizes
-  int sizeInput = GetInputSize();
   int sizeFeature = GetFeatureSize();
   int sizeOutput = GetOutputSize();
   int sizeHidden = GetHiddenSize();
@@ -310,20 +229,20 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
   // 1) Backprop on words within the target class
   for (int c = 0; c < numWordsInClass; c++) {
     int a = m_vocab.GetNthWordInClass(targetClass, c);
-    m_state.OutputGradient[a] = (0 - m_state.OutputLayer[a]);
+    state.OutputGradient[a] = (0 - state.OutputLayer[a]);
   }
-  m_state.OutputGradient[word] = (1 - m_state.OutputLayer[word]);
+  state.OutputGradient[word] = (1 - state.OutputLayer[word]);
   
   // 2) Backprop on all classes
   for (int a = sizeVocabulary; a < sizeOutput; a++) {
-    m_state.OutputGradient[a] = (0 - m_state.OutputLayer[a]);
+    state.OutputGradient[a] = (0 - state.OutputLayer[a]);
   }
   int wordClassIdx = targetClass + sizeVocabulary;
-  m_state.OutputGradient[wordClassIdx] = (1 - m_state.OutputLayer[wordClassIdx]);
+  state.OutputGradient[wordClassIdx] = (1 - state.OutputLayer[wordClassIdx]);
   
   // Reset gradients on hidden layers
-  m_state.HiddenGradient.assign(sizeHidden, 0);
-  m_state.CompressGradient.assign(sizeCompress, 0);
+  state.HiddenGradient.assign(sizeHidden, 0);
+  state.CompressGradient.assign(sizeCompress, 0);
   
   // learn direct connections between words
   if (sizeDirectConnection > 0) {
@@ -334,12 +253,12 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
       }
       for (int a = 0; a < orderDirectConnection; a++) {
         int b = 0;
-        if ((a > 0) && (m_state.WordHistory[a-1] == -1)) {
+        if ((a > 0) && (state.WordHistory[a-1] == -1)) {
           break;
         }
         hash[a] = c_Primes[0]*c_Primes[1]*(unsigned long long)(targetClass+1);
         for (b=1; b<=a; b++) {
-          hash[a]+=c_Primes[(a*c_Primes[b]+b)%c_PrimesSize]*(unsigned long long)(m_state.WordHistory[b-1]+1);
+          hash[a]+=c_Primes[(a*c_Primes[b]+b)%c_PrimesSize]*(unsigned long long)(state.WordHistory[b-1]+1);
         }
         hash[a] = (hash[a]%(sizeDirectConnection/2))+(sizeDirectConnection)/2;
       }
@@ -347,8 +266,8 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
         int a = m_vocab.GetNthWordInClass(targetClass, c);
         for (int b = 0; b < orderDirectConnection; b++) {
           if (hash[b]) {
-            m_weights.DirectNGram[hash[b]] +=
-            alpha * m_state.OutputGradient[a] - m_weights.DirectNGram[hash[b]]*beta;
+            real &weight = updatedWeights.DirectNGramWeight(hash[b]);
+            weight += alpha * state.OutputGradient[a] - weight*beta;
             hash[b]++;
             hash[b] = hash[b]%sizeDirectConnection;
           } else {
@@ -364,18 +283,18 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     unsigned long long hash[c_maxNGramOrder] = {0};
     for (int a = 0; a < orderDirectConnection; a++) {
       int b = 0;
-      if (a>0) if (m_state.WordHistory[a-1] == -1) break;
+      if (a>0) if (state.WordHistory[a-1] == -1) break;
       hash[a] = c_Primes[0]*c_Primes[1];
       for (b=1; b<=a; b++) {
-        hash[a] += c_Primes[(a*c_Primes[b]+b)%c_PrimesSize]*(unsigned long long)(m_state.WordHistory[b-1]+1);
+        hash[a] += c_Primes[(a*c_Primes[b]+b)%c_PrimesSize]*(unsigned long long)(state.WordHistory[b-1]+1);
       }
       hash[a] = hash[a]%(sizeDirectConnection/2);
     }
     for (int a = sizeVocabulary; a < sizeOutput; a++) {
       for (int b = 0; b < orderDirectConnection; b++) {
         if (hash[b]) {
-          m_weights.DirectNGram[hash[b]] +=
-          alpha * m_state.OutputGradient[a] - m_weights.DirectNGram[hash[b]]*beta;
+          real &weight = updatedWeights.DirectNGramWeight(hash[b]);
+          weight += alpha * state.OutputGradient[a] - weight*beta;
           hash[b]++;
         } else {
           break;
@@ -387,9 +306,10 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
   if (sizeCompress > 0) {
     // Back-propagate gradients coming from loss on words in target class
     // w.r.t. the compression layer
-    GradientMatrixXvectorBlas(m_state.CompressGradient,
-                              m_state.OutputGradient,
+    GradientMatrixXvectorBlas(state.CompressGradient,
+                              state.OutputGradient,
                               m_weights.Compress2Output,
+                              1.0,
                               sizeCompress,
                               idxWordClass,
                               idxWordClass + numWordsInClass);
@@ -399,12 +319,11 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
     //   <- (1-beta) * V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
     //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * c(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.CompressLayer,
-                              m_weights.Compress2Output,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.CompressLayer,
+                              updatedWeights.Compress2Output,
                               alpha,
                               coeffSGD,
-                              sizeOutput,
                               1,
                               sizeCompress,
                               idxWordClass,
@@ -412,9 +331,10 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     
     // Back-propagate gradients coming from loss on word classes
     // w.r.t. the compression layer
-    GradientMatrixXvectorBlas(m_state.CompressGradient,
-                              m_state.OutputGradient,
+    GradientMatrixXvectorBlas(state.CompressGradient,
+                              state.OutputGradient,
                               m_weights.Compress2Output,
+                              1.0,
                               sizeCompress,
                               sizeVocabulary,
                               sizeOutput);
@@ -424,12 +344,11 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //   <- (1-beta) * V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //      + alpha * dOut[[sizeVocabulary, sizeOutput], 1] * c(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.CompressLayer,
-                              m_weights.Compress2Output,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.CompressLayer,
+                              updatedWeights.Compress2Output,
                               alpha,
                               coeffSGD,
-                              sizeOutput,
                               1,
                               sizeCompress,
                               sizeVocabulary,
@@ -437,9 +356,10 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     
     // Back-propagate gradients coming from loss on compression layer
     // w.r.t. the hidden layer
-    GradientMatrixXvectorBlas(m_state.HiddenGradient,
-                              m_state.CompressGradient,
+    GradientMatrixXvectorBlas(state.HiddenGradient,
+                              state.CompressGradient,
                               m_weights.Hidden2Output,
+                              1.0,
                               sizeHidden,
                               0,
                               sizeCompress);
@@ -449,12 +369,11 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[1, sizeHidden] x [1, sizeHidden]]
     //   <- (1-beta) * V[[1, sizeHidden] x [1, sizeHidden]]
     //      + alpha * dc(t)[[1, sizeHidden], 1] * h(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.CompressGradient,
-                              m_state.HiddenLayer,
-                              m_weights.Hidden2Output,
+    MultiplyMatrixXmatrixBlas(state.CompressGradient,
+                              state.HiddenLayer,
+                              updatedWeights.Hidden2Output,
                               alpha,
                               1.0,
-                              sizeHidden,
                               1,
                               sizeCompress,
                               0,
@@ -462,9 +381,10 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
   } else {
     // Back-propagate gradients coming from loss on words in target class
     // w.r.t. the hidden layer
-    GradientMatrixXvectorBlas(m_state.HiddenGradient,
-                              m_state.OutputGradient,
+    GradientMatrixXvectorBlas(state.HiddenGradient,
+                              state.OutputGradient,
                               m_weights.Hidden2Output,
+                              1.0,
                               sizeHidden,
                               idxWordClass,
                               idxWordClass + numWordsInClass);
@@ -474,12 +394,11 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
     //   <- (1-beta) * V[[classIdx, classIdx+numWordsClass] x [1, sizeHidden]]
     //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * h(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.HiddenLayer,
-                              m_weights.Hidden2Output,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.HiddenLayer,
+                              updatedWeights.Hidden2Output,
                               alpha,
                               coeffSGD,
-                              sizeOutput,
                               1,
                               sizeHidden,
                               idxWordClass,
@@ -487,9 +406,10 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     
     // Back-propagate gradients coming from loss on word classes
     // w.r.t. the hidden layer
-    GradientMatrixXvectorBlas(m_state.HiddenGradient,
-                              m_state.OutputGradient,
+    GradientMatrixXvectorBlas(state.HiddenGradient,
+                              state.OutputGradient,
                               m_weights.Hidden2Output,
+                              1.0,
                               sizeHidden,
                               sizeVocabulary,
                               sizeOutput);
@@ -499,12 +419,11 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //   <- (1-beta) * V[[sizeVocabulary, sizeOutput] x [1, sizeHidden]]
     //      + alpha * dOut[[sizeVocabulary, sizeOutput], 1] * h(t)[1, [1, sizeHidden]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.HiddenLayer,
-                              m_weights.Hidden2Output,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.HiddenLayer,
+                              updatedWeights.Hidden2Output,
                               alpha,
                               coeffSGD,
-                              sizeOutput,
                               1,
                               sizeHidden,
                               sizeVocabulary,
@@ -517,12 +436,11 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // G[[classIdx, classIdx+numWordsClass] x [1, sizeFeature]]
     //   <- G[[classIdx, classIdx+numWordsClass] x [1, sizeFeature]]
     //      + alpha * dOut[[classIdx, classIdx+numWordsClass], 1] * f(t)[1, [1, sizeFeature]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.FeatureLayer,
-                              m_weights.Features2Output,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.FeatureLayer,
+                              updatedWeights.Features2Output,
                               alpha,
                               1.0,
-                              sizeOutput,
                               1,
                               sizeFeature,
                               idxWordClass,
@@ -533,186 +451,231 @@ void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWor
     // G[[sizeVocabulary, sizeOutput] x [1, sizeFeature]]
     //   <- G[[sizeVocabulary, sizeOutput] x [1, sizeFeature]]
     //      + alpha * dOut[[sizeVocabulary, sizeOutput], 1] * f(t)[1, [1, sizeFeature]]
-    MultiplyMatrixXmatrixBlas(m_state.OutputGradient,
-                              m_state.FeatureLayer,
-                              m_weights.Features2Output,
+    MultiplyMatrixXmatrixBlas(state.OutputGradient,
+                              state.FeatureLayer,
+                              updatedWeights.Features2Output,
                               alpha,
                               1.0,
-                              sizeOutput,
                               1,
                               sizeFeature,
                               sizeVocabulary,
                               sizeOutput);
   }
+}
+
+
+/**
+ * One step of backpropagation of the errors through the RNN
+ * (optionally, backpropagation through time, BPTT) and of gradient descent.
+ */
+void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWord,
+                                                                  int word) {
+  BackPropagateErrorsThenOneStepGradientDescent(contextWord, word,
+                                                m_learningRate,
+                                                m_regularizationRate,
+                                                m_wordCounter,
+                                                m_state, m_bpttVectors,
+                                                m_weights);
+}
+void RnnLMTraining::BackPropagateErrorsThenOneStepGradientDescent(int contextWord,
+                                                                  int word,
+                                                                  double learningRate,
+                                                                  double regularizationRate,
+                                                                  long wordCounter,
+                                                                  RnnState &state,
+                                                                  RnnBptt &bpttState,
+                                                                  RnnWeights &updatedWeights) {
+  // No learning step if OOV word
+  if (word == -1) {
+    return;
+  }
+
+  // Back-propagate the errors from the output layer to the hidden layer
+  // and update the weights to the output layer
+  // (regularization is done every 10th step)
+  BackPropagateOutputLayer(word, learningRate, regularizationRate,
+                           ((wordCounter % 10) == 0) ? 1 : 0,
+                           state, updatedWeights);
+  
+  // Learning rates, with and without regularization
+  double beta = regularizationRate * learningRate;
+  double alpha = learningRate;
+  // Regularization is done every 10th step
+  double coeffSGD = ((wordCounter % 10) == 0) ? (1.0 - beta) : 1.0;
+  
+  // Matrix sizes
+  int sizeFeature = GetFeatureSize();
+  int sizeHidden = GetHiddenSize();
 
   if (m_numBpttSteps <= 1) {
     // If BPTT == 1, do normal BP
 
     // Gradient w.r.t. hidden layer
     for (int a = 0; a < sizeHidden; a++) {
-      double dLdSa = m_state.HiddenLayer[a];
-      m_state.HiddenGradient[a] =
-      m_state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
+      double dLdSa = state.HiddenLayer[a];
+      state.HiddenGradient[a] =
+      state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
     }
     
     // Backprop and weight update hidden(t) -> input(t)
     int a = contextWord;
     if (a != -1) {
+      real *rowInput2Hidden = updatedWeights.Input2HiddenRow(a);
+      real alphaInput = alpha * state.InputLayer[a];
       for (int b = 0; b < sizeHidden; b++) {
-        int node = a + b * sizeInput;
-        m_weights.Input2Hidden[node] =
-        alpha * m_state.HiddenGradient[b] * m_state.InputLayer[a]
-        + coeffSGD * m_weights.Input2Hidden[node];
+        rowInput2Hidden[b] =
+        alphaInput * state.HiddenGradient[b]
+        + coeffSGD * rowInput2Hidden[b];
       }
     }
     
+    // Lazy weight decay of the weights to the hidden layer,
+    // which are then updated up to their scales
+    updatedWeights.DecayHiddenLayerWeights(coeffSGD);
+
     // Backprop and weight update hidden(t) -> hidden(t-1)
-    MultiplyMatrixXmatrixBlas(m_state.HiddenGradient,
-                              m_state.RecurrentLayer,
-                              m_weights.Recurrent2Hidden,
-                              alpha,
-                              coeffSGD,
-                              sizeHidden,
+    MultiplyMatrixXmatrixBlas(state.HiddenGradient,
+                              state.RecurrentLayer,
+                              updatedWeights.Recurrent2Hidden,
+                              alpha / updatedWeights.ScaleRecurrent2Hidden,
+                              1.0,
                               1,
                               sizeHidden,
                               0,
                               sizeHidden);
     
     // Backprop and weight update hidden(t) -> feature(t)
-    MultiplyMatrixXmatrixBlas(m_state.HiddenGradient,
-                              m_state.FeatureLayer,
-                              m_weights.Features2Hidden,
-                              alpha,
-                              coeffSGD,
-                              sizeHidden,
+    MultiplyMatrixXmatrixBlas(state.HiddenGradient,
+                              state.FeatureLayer,
+                              updatedWeights.Features2Hidden,
+                              alpha / updatedWeights.ScaleFeatures2Hidden,
+                              1.0,
                               1,
                               sizeFeature,
                               0,
                               sizeHidden);
   } else {
     // BPTT
+    real *bpttHiddenNow = bpttState.HiddenLayer(0);
+    real *bpttGradientNow = bpttState.HiddenGradient(0);
+    real *bpttFeaturesNow = bpttState.FeatureLayer(0);
     for (int b = 0; b < sizeHidden; b++) {
-      m_bpttVectors.HiddenLayer[b] = m_state.HiddenLayer[b];
+      bpttHiddenNow[b] = state.HiddenLayer[b];
     }
     for (int b = 0; b < sizeHidden; b++) {
-      m_bpttVectors.HiddenGradient[b] = m_state.HiddenGradient[b];
+      bpttGradientNow[b] = state.HiddenGradient[b];
     }
     for (int b = 0; b < sizeFeature; b++) {
-      m_bpttVectors.FeatureLayer[b] = m_state.FeatureLayer[b];
+      bpttFeaturesNow[b] = state.FeatureLayer[b];
     }
 
-    if (((m_wordCounter % m_bpttBlockSize) == 0) ||
+    if (((wordCounter % m_bpttBlockSize) == 0) ||
         (m_areSentencesIndependent && (word == 0))) {
-      for (int step = 0; step < m_bpttVectors.NumSteps() - 2; step++) {
+      // The gradients w.r.t. the hidden layer are computed step by step,
+      // but the gradients w.r.t. the weights to the hidden layer
+      // are computed once for all the steps, from the hidden gradients,
+      // the previous hidden activations and the features at each step,
+      // stored as the rows of three matrices
+      int numSteps = std::max(bpttState.NumSteps() - 2, 0);
+      for (int step = 0; step < numSteps; step++) {
         // Gradient w.r.t. hidden layer
+        real *gradientAtStep = &bpttState.StepHiddenGradients[step * sizeHidden];
         for (int a = 0; a < sizeHidden; a++) {
-          double dLdSa = m_state.HiddenLayer[a];
-          m_state.HiddenGradient[a] =
-          m_state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
+          double dLdSa = state.HiddenLayer[a];
+          state.HiddenGradient[a] =
+          state.HiddenGradient[a] * dLdSa * (1 - dLdSa);
+          gradientAtStep[a] = state.HiddenGradient[a];
+        }
+        real *recurrentAtStep =
+        &bpttState.StepRecurrentLayers[step * sizeHidden];
+        for (int a = 0; a < sizeHidden; a++) {
+          recurrentAtStep[a] = state.RecurrentLayer[a];
         }
-
         if (sizeFeature > 0) {
-          // Backprop and weight update hidden(t) -> feature(t)
-          for (int b = 0; b < sizeHidden; b++) {
-            for (int a = 0; a < sizeFeature; a++) {
-              m_bpttVectors.WeightsFeature2Hidden[a + b * sizeFeature] +=
-              alpha * m_state.HiddenGradient[b] *
-              m_bpttVectors.FeatureLayer[a + step * sizeFeature];
-            }
+          const real *featuresAtStep = bpttState.FeatureLayer(step);
+          real *stepFeatures = &bpttState.StepFeatureLayers[step * sizeFeature];
+          for (int a = 0; a < sizeFeature; a++) {
+            stepFeatures[a] = featuresAtStep[a];
           }
         }
 
         // Backprop and weight update hidden -> input
-        int a = m_bpttVectors.History[step];
+        int a = bpttState.History(step);
         if (a != -1) {
-          for (int b = 0; b < sizeHidden; b++)
-          {
-            m_bpttVectors.WeightsInput2Hidden[a + b * sizeInput] +=
-            alpha * m_state.HiddenGradient[b];
+          real *rowGradInput2Hidden = bpttState.GradientInput2Hidden(a);
+          for (int b = 0; b < sizeHidden; b++) {
+            rowGradInput2Hidden[b] += alpha * state.HiddenGradient[b];
           }
         }
         
-        // Backprop and weight update hidden -> recurrent
-        m_state.HiddenGradient.assign(sizeHidden, 0);
-        GradientMatrixXvectorBlas(m_state.RecurrentGradient,
-                                  m_state.HiddenGradient,
+        // Backprop hidden -> recurrent
+        state.RecurrentGradient.assign(sizeHidden, 0);
+        GradientMatrixXvectorBlas(state.RecurrentGradient,
+                                  state.HiddenGradient,
                                   m_weights.Recurrent2Hidden,
-                                  sizeHidden,
-                                  0,
-                                  sizeHidden);
-        
-        MultiplyMatrixXmatrixBlas(m_state.HiddenGradient,
-                                  m_state.RecurrentLayer,
-                                  m_bpttVectors.WeightsRecurrent2Hidden,
-                                  alpha,
-                                  1.0,
-                                  sizeHidden,
-                                  1,
+                                  m_weights.ScaleRecurrent2Hidden,
                                   sizeHidden,
                                   0,
                                   sizeHidden);
         
         // Backpropagate error from time T-n to T-n-1
+        const real *gradientAtPreviousStep = bpttState.HiddenGradient(step + 1);
         for (int a = 0; a < sizeHidden; a++) {
-          m_state.HiddenGradient[a] =
-          m_state.RecurrentGradient[a] +
-          m_bpttVectors.HiddenGradient[(step+1) * sizeHidden+a];
+          state.HiddenGradient[a] =
+          state.RecurrentGradient[a] + gradientAtPreviousStep[a];
         }
         
-        if (step < m_bpttVectors.NumSteps() - 3) {
+        if (step < bpttState.NumSteps() - 3) {
+          const real *hiddenAtPreviousStep = bpttState.HiddenLayer(step + 1);
+          const real *hiddenAtStepBefore = bpttState.HiddenLayer(step + 2);
           for (int a = 0; a < sizeHidden; a++) {
-            m_state.HiddenLayer[a] =
-            m_bpttVectors.HiddenLayer[(step+1) * sizeHidden+a];
-            m_state.RecurrentLayer[a] =
-            m_bpttVectors.HiddenLayer[(step+2) * sizeHidden+a];
+            state.HiddenLayer[a] = hiddenAtPreviousStep[a];
+            state.RecurrentLayer[a] = hiddenAtStepBefore[a];
           }
         }
       }
 
       // Reset BPTT accumulated gradients
-      for (int a = 0; a < m_bpttVectors.NumSteps() * sizeHidden; a++) {
-        m_bpttVectors.HiddenGradient[a] = 0;
+      for (int step = 0; step < bpttState.NumSteps(); step++) {
+        real *gradientAtStep = bpttState.HiddenGradient(step);
+        for (int a = 0; a < sizeHidden; a++) {
+          gradientAtStep[a] = 0;
+        }
       }
       
       // Restore hidden layer after BPTT
       for (int b = 0; b < sizeHidden; b++) {
-        m_state.HiddenLayer[b] = m_bpttVectors.HiddenLayer[b];
+        state.HiddenLayer[b] = bpttHiddenNow[b];
       }
       
-      // Weight update for recurrent weights, using BPTT accumulated gradients
-      AddMatrixToMatrixBlas(m_bpttVectors.WeightsRecurrent2Hidden,
-                            m_weights.Recurrent2Hidden,
-                            1.0,
-                            coeffSGD,
-                            sizeHidden,
-                            sizeHidden);
-      m_bpttVectors.WeightsRecurrent2Hidden.assign(sizeHidden * sizeHidden, 0);
+      // Lazy weight decay of the weights to the hidden layer,
+      // which are then updated up to their scales
+      updatedWeights.DecayHiddenLayerWeights(coeffSGD);
+
+      // Weight update for recurrent weights, summing over the steps
+      // the hidden gradients times the previous hidden activations
+      MultiplyTransposedMatrixXmatrixBlas(bpttState.StepHiddenGradients,
+                                          bpttState.StepRecurrentLayers,
+                                          updatedWeights.Recurrent2Hidden,
+                                          alpha / updatedWeights.ScaleRecurrent2Hidden,
+                                          numSteps,
+                                          sizeHidden,
+                                          sizeHidden);
       
-      // Weight update for feature-hidden weights, using BPTT accumulated grads
+      // Weight update for feature-hidden weights, summing over the steps
+      // the hidden gradients times the features
       if (sizeFeature > 0) {
-        AddMatrixToMatrixBlas(m_bpttVectors.WeightsFeature2Hidden,
-                              m_weights.Features2Hidden,
-                              1.0,
-                              coeffSGD,
-                              sizeHidden,
-                              sizeFeature);
-        m_bpttVectors.WeightsFeature2Hidden.assign(sizeHidden * sizeFeature, 0);
+        MultiplyTransposedMatrixXmatrixBlas(bpttState.StepHiddenGradients,
+                                            bpttState.StepFeatureLayers,
+                                            updatedWeights.Features2Hidden,
+                                            alpha / updatedWeights.ScaleFeatures2Hidden,
+                                            numSteps,
+                                            sizeHidden,
+                                            sizeFeature);
       }
       
       // Weight update for input weights, using BPTT accumulated gradients
-      for (int step = 0; step < m_bpttVectors.NumSteps() - 2; step++) {
-        int wordAtStep = m_bpttVectors.History[step];
-        if (wordAtStep != -1) {
-          for (int b = 0; b < sizeHidden; b++)
-          {
-            int node = wordAtStep + b * sizeInput;
-            m_weights.Input2Hidden[node] =
-            m_bpttVectors.WeightsInput2Hidden[node]
-            + coeffSGD * m_weights.Input2Hidden[node];
-            m_bpttVectors.WeightsInput2Hidden[node] = 0;
-          }
-        }
-      }
+      bpttState.ApplyGradientsInput2Hidden(updatedWeights, coeffSGD);
     }
   }
 }
@@ -737,6 +700,9 @@ bool RnnLMTraining::TrainRnnModel() {
   Log("Starting training sequential LM using file " +
       m_trainFile + "...\n", logFilename);
 
+  // The model is saved in the background while training continues
+  CheckpointWriter checkpointWriter;
+
   // Do we use an external file with feature vectors for each
   // consecutive word in the test set?
   // Only if feature matrix (LDA/LSA topic model or Word2Vec) was not set
@@ -774,6 +740,7 @@ bool RnnLMTraining::TrainRnnModel() {
         
     // Start an iteration
     clock_t start = clock();
+    long nextCheckpointWords = m_wordCounter + m_numCheckpointWords;
     bool loopTrain = true;
     while (loopTrain) {
       // Read next word
@@ -845,6 +812,15 @@ bool RnnLMTraining::TrainRnnModel() {
             ConvString(1000000 * (m_wordCounter/((double)(now-start)))) + "\n",
             logFilename);
       }
+
+      // Checkpoint of the model during the epoch
+      // (postponed while the previous checkpoint is being written)
+      if ((m_numCheckpointWords > 0) && (m_wordCounter >= nextCheckpointWords)
+          && !checkpointWriter.IsBusy()) {
+        m_currentPosTrainFile = m_wordCounter;
+        checkpointWriter.Save(*this, m_rnnModelFile + ".checkpoint", "");
+        nextCheckpointWords = m_wordCounter + m_numCheckpointWords;
+      }
     }
     
     // Close the feature file
@@ -918,8 +894,8 @@ bool RnnLMTraining::TrainRnnModel() {
       m_iteration++;
       // Save the best model
       if (validAccuracy > bestValidAccuracy) {
-        SaveRnnModelToFile();
-        SaveWordEmbeddings(m_rnnModelFile + ".word_embeddings.txt");
+        checkpointWriter.Save(*this, m_rnnModelFile,
+                              m_rnnModelFile + ".word_embeddings.txt");
         Log("Saved the best model so far\n");
         bestValidAccuracy = validAccuracy;
         bestValidLogProbability = validLogProbability;
@@ -981,8 +957,6 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
   // Create a word reader on the test file
   WordReader wordReaderTest(testFile);
   
-  // Last word set to end of sentence
-  int contextWord = 0;
   // Reset the log-likelihood
   logProbability = 0.0;
   double sentenceLogProbability = 0.0;
@@ -997,75 +971,123 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
   if (m_areSentencesIndependent) {
     ResetHiddenRnnStateAndWordHistory(m_state);
   }
-  
-  // Iterate over the test file
+
+  // Independent sentences can be forward-propagated together as a batch,
+  // and batches can be scored by several threads, unless their features
+  // are read sequentially from a feature file or computed by the topic model
+  // from the previous words
+  int batchSize = 1;
+  int numThreads = 1;
+  if (m_areSentencesIndependent && !isFeatureFileUsed && !m_featureMatrixUsed) {
+    batchSize = m_batchSize;
+    numThreads = m_numThreads;
+  }
+  WorkStealingScheduler scheduler(numThreads);
+  // Each thread scores sentences using its own state
+  vector<RnnState> threadStates;
+  for (int k = 1; k < numThreads; k++) {
+    threadStates.push_back(CreateState());
+  }
+  // Read enough sentences at a time to keep all the threads busy
+  int numSentencesToRead = batchSize;
+  if (numThreads > 1) {
+    numSentencesToRead *= 16 * numThreads;
+  }
+
+  // Iterate over the test file, numSentencesToRead sentences at a time
   bool loopTest = true;
   while (loopTest) {
-    // Get the index of the next word (or -1 if OOV or -2 if end of file)
-    int targetWord = ReadWordIndexFromFile(wordReaderTest);
-    loopTest = (targetWord > m_eof);
-    
-    if (loopTest) {
-      // Use the pre-computed feature file?
-      if (isFeatureFileUsed) {
-        LoadFeatureVectorAtCurrentWord(featureFileId, m_state);
+    // Read the next sentences; each one ends with </s>,
+    // except maybe the last one, which ends with the end of file
+    vector<vector<int> > sentences;
+    while (loopTest && ((int)sentences.size() < numSentencesToRead)) {
+      vector<int> sentence;
+      bool endOfSentence = false;
+      while (loopTest && !endOfSentence) {
+        // Get the index of the next word (or -1 if OOV or -2 if end of file)
+        int targetWord = ReadWordIndexFromFile(wordReaderTest);
+        loopTest = (targetWord > m_eof);
+        if (loopTest) {
+          sentence.push_back(targetWord);
+          endOfSentence = (targetWord == 0);
+        }
       }
-      // Use the topic-model features coming from a word embedding matrix?
-      if (m_featureMatrixUsed) {
-        UpdateFeatureVectorUsingTopicModel(contextWord, m_state);
+      if (!sentence.empty()) {
+        sentences.push_back(sentence);
       }
-      
-      // Run one step of the RNN
-      ForwardPropagateOneStep(contextWord, targetWord, m_state);
-      
-      // For perplexity, we do not count OOV words and beginning of sentence...
-      if ((targetWord >= 0) && (targetWord != m_oov)) {
-        // Compute the log-probability of the current word
-        int targetClass = m_vocab.WordIndex2Class(targetWord);
-        int outputNodeClass = targetClass + GetVocabularySize();
-        double condProbaClass = m_state.OutputLayer[outputNodeClass];
-        double condProbaWordGivenClass =  m_state.OutputLayer[targetWord];
-        double logProbabilityWord =
-        log10(condProbaClass * condProbaWordGivenClass);
-        logProbability += logProbabilityWord;
-        sentenceLogProbability += logProbabilityWord;
-        uniqueWordCounter++;
-
-        // Verbose
-        if (m_debugMode) {
-          Log(ConvString(targetWord) + "\t" +
-              ConvString(logProbabilityWord) + "\t" +
-              m_vocab.Word2WordIndex(contextWord) + "\t" +
-              m_vocab.Word2WordIndex(targetWord) + "\t" +
-              ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
-              ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
+    }
+
+    // Run the RNN on these sentences, batchSize sentences per task
+    vector<vector<double> > logProbabilities(sentences.size());
+    int numSentences = (int)(sentences.size());
+    int numTasks = (numSentences + batchSize - 1) / batchSize;
+    scheduler.Run(numTasks, [&](int idxTask, int idxThread) {
+      int idxFrom = idxTask * batchSize;
+      int idxTo = min(idxFrom + batchSize, numSentences);
+      if (batchSize > 1) {
+        vector<vector<int> > batch(sentences.begin() + idxFrom,
+                                   sentences.begin() + idxTo);
+        vector<vector<double> > logProbabilitiesBatch;
+        ForwardPropagateSentencesBatch(batch, logProbabilitiesBatch);
+        for (int k = idxFrom; k < idxTo; k++) {
+          logProbabilities[k].swap(logProbabilitiesBatch[k - idxFrom]);
         }
       } else {
-        if (m_debugMode) {
-          // Out-of-vocabulary words have probability 0 and index -1
-          Log("-1\t0\t" +
-              m_vocab.Word2WordIndex(contextWord) + "\t" +
-              m_vocab.Word2WordIndex(targetWord) + "\t-1\t-1\n");
+        RnnState &state =
+        (idxThread == 0) ? m_state : threadStates[idxThread - 1];
+        for (int k = idxFrom; k < idxTo; k++) {
+          ForwardPropagateSentence(sentences[k],
+                                   featureFileId,
+                                   state,
+                                   logProbabilities[k]);
         }
-        numUnk++;
       }
-      
-      // Store the current state s(t) at the end of the input layer vector
-      // so that it can be used as s(t-1) at the next step
-      ForwardPropagateRecurrentConnectionOnly(m_state);
-      
-      // Rotate the word history by one
-      ForwardPropagateWordHistory(m_state, contextWord, targetWord);
-      
-      // Did we reach the end of the sentence?
-      // If so, we need to reset the state of the neural net
-      // and to save the current sentence score
-      if (m_areSentencesIndependent && (targetWord == 0)) {
-        ResetHiddenRnnStateAndWordHistory(m_state);
-        sentenceScores.push_back(sentenceLogProbability);
-        // Write the sentence score to a file
-        Log(ConvString(sentenceLogProbability) + "\n", scoresFilename);
-        sentenceLogProbability = 0.0;
+    });
+
+    // Accumulate the log-probabilities of the words, in the file order
+    for (size_t idxSentence = 0; idxSentence < sentences.size(); idxSentence++) {
+      const vector<int> &sentence = sentences[idxSentence];
+      // Last word set to end of sentence
+      int contextWord = 0;
+      for (size_t idxWord = 0; idxWord < sentence.size(); idxWord++) {
+        int targetWord = sentence[idxWord];
+
+        // For perplexity, we do not count OOV words and beginning of sentence...
+        if ((targetWord >= 0) && (targetWord != m_oov)) {
+          // Log-probability of the current word
+          double logProbabilityWord = logProbabilities[idxSentence][idxWord];
+          logProbability += logProbabilityWord;
+          sentenceLogProbability += logProbabilityWord;
+          uniqueWordCounter++;
+
+          // Verbose
+          if (IsLogged(LogDebug)) {
+            Log(ConvString(targetWord) + "\t" +
+                ConvString(logProbabilityWord) + "\t" +
+                m_vocab.Word2WordIndex(contextWord) + "\t" +
+                m_vocab.Word2WordIndex(targetWord) + "\t" +
+                ConvString(m_vocab.WordIndex2Class(targetWord)) + "\t" +
+                ConvString(m_vocab.WordIndex2Class(contextWord)) + "\n");
+          }
+        } else {
+          if (IsLogged(LogDebug)) {
+            // Out-of-vocabulary words have probability 0 and index -1
+            Log("-1\t0\t" +
+                m_vocab.Word2WordIndex(contextWord) + "\t" +
+                m_vocab.Word2WordIndex(targetWord) + "\t-1\t-1\n");
+          }
+          numUnk++;
+        }
+        contextWord = targetWord;
+
+        // Did we reach the end of the sentence?
+        // If so, we need to save the current sentence score
+        if (m_areSentencesIndependent && (targetWord == 0)) {
+          sentenceScores.push_back(sentenceLogProbability);
+          // Write the sentence score to a file
+          Log(ConvString(sentenceLogProbability) + "\n", scoresFilename);
+          sentenceLogProbability = 0.0;
+        }
       }
     }
   }
@@ -1097,11 +1119,105 @@ bool RnnLMTraining::TestRnnModel(const string &testFile,
   accuracy = AccuracyNBestList(sentenceScores, m_correctSentenceLabels);
   Log("Accuracy: " + ConvString(accuracy * 100) + "% on " +
       ConvString(sentenceScores.size()) + " sentences\n", logFilename);
+  // The scores and the log are complete when the test returns
+  FlushLog();
 
   return true;
 }
 
 
+/**
+ * Compute the log-probability of each word of a sentence,
+ * continuing from the current state of the RNN
+ */
+void RnnLMTraining::ForwardPropagateSentence(const vector<int> &sentence,
+                                             FILE *featureFileId,
+                                             RnnState &state,
+                                             vector<double> &logProbabilities) const {
+  logProbabilities.assign(sentence.size(), 0.0);
+  // Last word set to end of sentence
+  int contextWord = 0;
+  for (size_t idxWord = 0; idxWord < sentence.size(); idxWord++) {
+    int targetWord = sentence[idxWord];
+    // Use the pre-computed feature file?
+    if (featureFileId != NULL) {
+      LoadFeatureVectorAtCurrentWord(featureFileId, state);
+    }
+    // Use the topic-model features coming from a word embedding matrix?
+    if (m_featureMatrixUsed) {
+      UpdateFeatureVectorUsingTopicModel(contextWord, state);
+    }
+
+    // Run one step of the RNN, compute the log-probability
+    // of the current word and rotate the word history by one
+    double logProbabilityWord =
+    ForwardPropagateWordAndAdvance(contextWord, targetWord, state);
+    if (targetWord != m_oov) {
+      logProbabilities[idxWord] = logProbabilityWord;
+    }
+
+    // Did we reach the end of the sentence?
+    // If so, we need to reset the state of the neural net
+    if (m_areSentencesIndependent && (targetWord == 0)) {
+      ResetHiddenRnnStateAndWordHistory(state);
+    }
+  }
+}
+
+
+/**
+ * Compute the log-probability of each word of several independent
+ * sentences, forward-propagated together through the RNN
+ */
+void RnnLMTraining::ForwardPropagateSentencesBatch(const vector<vector<int> > &sentences,
+                                                   vector<vector<double> > &logProbabilities) const {
+  int numSentences = (int)sentences.size();
+  if (numSentences == 0) {
+    return;
+  }
+  RnnBatchState batch(numSentences, GetHiddenSize(), GetFeatureSize(),
+                      GetCompressSize(), GetNumClasses());
+  logProbabilities.resize(numSentences);
+  size_t maxLength = 0;
+  for (int i = 0; i < numSentences; i++) {
+    ResetBatchStream(batch, i);
+    logProbabilities[i].assign(sentences[i].size(), 0.0);
+    maxLength = max(maxLength, sentences[i].size());
+  }
+
+  // Last word of each sentence set to end of sentence
+  vector<int> contextWords(numSentences, 0);
+  vector<int> targetWords(numSentences, -1);
+  for (size_t idxWord = 0; idxWord < maxLength; idxWord++) {
+    // Sentences that are already finished do not have a target word
+    for (int i = 0; i < numSentences; i++) {
+      targetWords[i] =
+      (idxWord < sentences[i].size()) ? sentences[i][idxWord] : -1;
+    }
+
+    // Run one step of the RNN on all the sentences
+    ForwardPropagateBatch(contextWords, targetWords, batch);
+
+    // Compute the log-probability of the current words
+    for (int i = 0; i < numSentences; i++) {
+      int targetWord = targetWords[i];
+      if ((targetWord >= 0) && (targetWord != m_oov)) {
+        double condProbaClass = batch.ClassProbability[i];
+        double condProbaWordGivenClass = batch.WordProbability[i];
+        logProbabilities[i][idxWord] =
+        log10(condProbaClass * condProbaWordGivenClass);
+      }
+      if (idxWord < sentences[i].size()) {
+        contextWords[i] = targetWord;
+      }
+    }
+
+    // Rotate the word histories by one
+    ForwardPropagateBatchWordHistory(contextWords, batch);
+  }
+}
+
+
 /**
  * Load a file containing the classification labels
  */
@@ -1159,7 +1275,7 @@ double RnnLMTraining::AccuracyNBestList(std::vector<double> scores,
  * TODO: convert to ifstream
  */
 bool RnnLMTraining::LoadFeatureVectorAtCurrentWord(FILE *f,
-                                                   RnnState &state) {
+                                                   RnnState &state) const {
   int sizeFeature = GetFeatureSize();
   for (int a = 0; a < sizeFeature; a++) {
     float fl;
@@ -1167,53 +1283,34 @@ bool RnnLMTraining::LoadFeatureVectorAtCurrentWord(FILE *f,
       // reached end of file
       return false;
     }
-    m_state.FeatureLayer[a] = fl;
+    state.FeatureLayer[a] = fl;
   }
   return true;
 }
 
 
-/**
- * Simply write the word projections/embeddings to a text file.
- */
-void RnnLMTraining::SaveWordEmbeddings(const string &filename) {
-  FILE *fid = fopen(filename.c_str(), "wb");
-  
-  fprintf(fid, "%d %d\n", GetVocabularySize(), GetHiddenSize());
-  
-  for (int a = 0; a < GetVocabularySize(); a++) {
-    fprintf(fid, "%s ", m_vocab.GetNthWord(a).c_str());
-    for (int b = 0; b < GetHiddenSize(); b++) {
-      fprintf(fid, "%lf ", m_weights.Input2Hidden[a + b * GetInputSize()]);
-    }
-    fprintf(fid, "\n");
-  }
-  
-  fclose(fid);
-}
-
-
 /**
  * Matrix-vector multiplication routine, somewhat accelerated using loop
- * unrolling over 8 registers. Computes x <- x + A' * y,
+ * unrolling over 8 registers. Computes x <- x + alpha * A' * y,
  * i.e., the "inverse" operation to y = A * x (adding the result to x)
  * where A is of size N x M, x is of length M and y is of length N.
  * The operation can done on a contiguous subset of indices
  * j in [idxYFrom, idxYTo[ of vector y.
  */
-void RnnLMTraining::GradientMatrixXvectorBlas(vector<double> &vectorX,
-                                              vector<double> &vectorY,
-                                              vector<double> &matrixA,
+void RnnLMTraining::GradientMatrixXvectorBlas(vector<real> &vectorX,
+                                              vector<real> &vectorY,
+                                              const WeightVector &matrixA,
+                                              double alpha,
                                               int widthMatrix,
                                               int idxYFrom,
                                               int idxYTo) const {
-  double *vecX = &vectorX[0];
+  real *vecX = &vectorX[0];
   int idxAFrom = idxYFrom * widthMatrix;
-  double *matA = &matrixA[idxAFrom];
+  const real *matA = &matrixA[idxAFrom];
   int heightMatrix = idxYTo - idxYFrom;
-  double *vecY = &vectorY[idxYFrom];
-  cblas_dgemv(CblasRowMajor, CblasTrans,
-              heightMatrix, widthMatrix, 1.0, matA, widthMatrix,
+  real *vecY = &vectorY[idxYFrom];
+  cblas_xgemv(CblasRowMajor, CblasTrans,
+              heightMatrix, widthMatrix, alpha, matA, widthMatrix,
               vecY, 1,
               1.0, vecX, 1);
   // The point of gradient cutoff is to avoid too large values
@@ -1237,12 +1334,11 @@ void RnnLMTraining::GradientMatrixXvectorBlas(vector<double> &vectorX,
  * The operation can done on a contiguous subset of row indices
  * j in [idxRowCFrom, idxRowCTo[ in matrix A and C.
  */
-void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
-                                              std::vector<double> &matrixB,
-                                              std::vector<double> &matrixC,
+void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<real> &matrixA,
+                                              std::vector<real> &matrixB,
+                                              WeightVector &matrixC,
                                               double alpha,
                                               double beta,
-                                              int numRowsA,
                                               int numRowsB,
                                               int numColsC,
                                               int idxRowCFrom,
@@ -1250,10 +1346,10 @@ void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
   int idxCFrom = idxRowCFrom * numColsC;
   int idxAFrom = idxRowCFrom * numRowsB;
   int heighMatrixAC = idxRowCTo - idxRowCFrom;
-  double *matA = &matrixA[idxAFrom];
-  double *matB = &matrixB[0];
-  double *matC = &matrixC[idxCFrom];
-  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+  real *matA = &matrixA[idxAFrom];
+  real *matB = &matrixB[0];
+  real *matC = &matrixC[idxCFrom];
+  cblas_xgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
               heighMatrixAC, numColsC, numRowsB,
               alpha, matA, 1, matB, numColsC,
               beta, matC, numColsC);
@@ -1261,22 +1357,44 @@ void RnnLMTraining::MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
 }
 
 
+/**
+ * Matrix-matrix multiplication routine, accelerated using BLAS.
+ * Computes C <- C + alpha * A' * B, where A is of size N x M,
+ * B is of size N x K and C is of size M x K (all row-major).
+ */
+void RnnLMTraining::MultiplyTransposedMatrixXmatrixBlas(const std::vector<real> &matrixA,
+                                                        const std::vector<real> &matrixB,
+                                                        WeightVector &matrixC,
+                                                        double alpha,
+                                                        int numRows,
+                                                        int numColsA,
+                                                        int numColsB) const {
+  if (numRows == 0) {
+    return;
+  }
+  cblas_xgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+              numColsA, numColsB, numRows,
+              alpha, &matrixA[0], numColsA, &matrixB[0], numColsB,
+              1.0, &matrixC[0], numColsB);
+}
+
+
 /**
  * Matrix-matrix or vector-vector addition routine using BLAS.
  * Computes Y <- alpha * X + beta * Y.
  */
-void RnnLMTraining::AddMatrixToMatrixBlas(std::vector<double> &matrixX,
-                                          std::vector<double> &matrixY,
+void RnnLMTraining::AddMatrixToMatrixBlas(std::vector<real> &matrixX,
+                                          std::vector<real> &matrixY,
                                           double alpha,
                                           double beta,
                                           int numRows,
                                           int numCols) const {
-  double *matX = &matrixX[0];
-  double *matY = &matrixY[0];
+  real *matX = &matrixX[0];
+  real *matY = &matrixY[0];
   int numElem = numRows * numCols;
   // Scale matrix Y?
   if (beta != 1.0) {
-    cblas_dscal(numElem, beta, matY, 1);
+    cblas_xscal(numElem, beta, matY, 1);
   }
-  cblas_daxpy(numElem, alpha, matX, 1, matY, 1);
+  cblas_xaxpy(numElem, alpha, matX, 1, matY, 1);
 }
@@ -67,8 +67,10 @@ public:
   m_minWordOccurrences(5),
   m_oov(1),
   m_eof(-2),
+  m_numCheckpointWords(0),
   m_fileCorrectSentenceLabels("") {
     Log("RnnLMTraining: debug mode is " + ConvString(debugMode) + "\n");
+    SetLogSeverity(debugMode ? LogDebug : LogInfo);
   }
   
   void SetTrainFile(const std::string &str) { m_trainFile = str; }
@@ -115,8 +117,7 @@ public:
    */
   void SetNumStepsBPTT(int val) {
     m_numBpttSteps = val;
-    m_bpttVectors = RnnBptt(GetVocabularySize(), GetHiddenSize(),
-                            GetFeatureSize(),
+    m_bpttVectors = RnnBptt(GetHiddenSize(), GetFeatureSize(),
                             m_numBpttSteps, m_bpttBlockSize);
   }
   
@@ -125,14 +126,36 @@ public:
    */
   void SetBPTTBlock(int val) {
     m_bpttBlockSize = val;
-    m_bpttVectors = RnnBptt(GetVocabularySize(), GetHiddenSize(),
-                            GetFeatureSize(),
+    m_bpttVectors = RnnBptt(GetHiddenSize(), GetFeatureSize(),
                             m_numBpttSteps, m_bpttBlockSize);
   }
   
-  void SetDebugMode(bool mode) { m_debugMode = mode; }
+  void SetDebugMode(bool mode) {
+    m_debugMode = mode;
+    SetLogSeverity(mode ? LogDebug : LogInfo);
+  }
   
   void SetFeatureGamma(double val) { m_featureGammaCoeff = val; }
+
+  /**
+   * Set the number of independent sentences (or sentence unrolls)
+   * that are forward-propagated together at test time
+   */
+  void SetBatchSize(int val) { m_batchSize = (val < 1) ? 1 : val; }
+
+  /**
+   * Set the number of threads scoring independent sentences
+   * (or the sentences of a book of unrolls) at test time
+   */
+  void SetNumThreads(int val) { m_numThreads = (val < 1) ? 1 : val; }
+
+  /**
+   * Set the number of training words between two checkpoints
+   * of the model saved during an epoch (0 for no such checkpoints)
+   */
+  void SetCheckpointWords(long val) {
+    m_numCheckpointWords = (val < 0) ? 0 : val;
+  }
   
 public:
   
@@ -168,16 +191,6 @@ public:
     return m_usesClassFile;
   }
   
-  /**
-   * Once we train the RNN model, it is nice to save it to a text or binary file
-   */
-  bool SaveRnnModelToFile();
-  
-  /**
-   * Simply write the word projections/embeddings to a text file.
-   */
-  void SaveWordEmbeddings(const std::string &filename);
-  
   /**
    * Main function to test the RNN model
    */
@@ -218,19 +231,70 @@ protected:
    */
   void SortVocabularyByClass();
   
+  /**
+   * Back-propagation of the errors on the target word through the output
+   * layer, leaving the gradient w.r.t. the hidden layer in the state
+   * (in state.HiddenGradient), and one step of gradient descent
+   * on the weights to the output layer (updates applied to updatedWeights),
+   * after numDecaySteps steps of weight decay
+   */
+  void BackPropagateOutputLayer(int word,
+                                double learningRate,
+                                double regularizationRate,
+                                int numDecaySteps,
+                                RnnState &state,
+                                RnnWeights &updatedWeights);
+
   /**
    * One step of backpropagation of the errors through the RNN
    * (optionally, backpropagation through time, BPTT) and of gradient descent.
    */
   void BackPropagateErrorsThenOneStepGradientDescent(int last_word, int word);
+
+  /**
+   * Same as above, but using a given learning rate, regularization rate,
+   * word counter (for the regularization and BPTT schedules) and state
+   * and BPTT buffers, e.g., private to a training thread.
+   * The gradients are back-propagated through the weights m_weights,
+   * and the updates are applied to updatedWeights: either m_weights
+   * itself (SGD), or a buffer of gradients (initially zero)
+   * in which case the regularization rate should be 0.
+   */
+  void BackPropagateErrorsThenOneStepGradientDescent(int last_word,
+                                                     int word,
+                                                     double learningRate,
+                                                     double regularizationRate,
+                                                     long wordCounter,
+                                                     RnnState &state,
+                                                     RnnBptt &bpttState,
+                                                     RnnWeights &updatedWeights);
   
+  /**
+   * Compute the log-probability of each word of a sentence,
+   * continuing from the given state of the RNN, which is reset
+   * at the end of the sentence if sentences are independent.
+   * OOV words get a log-probability of 0.
+   */
+  void ForwardPropagateSentence(const std::vector<int> &sentence,
+                                FILE *featureFileId,
+                                RnnState &state,
+                                std::vector<double> &logProbabilities) const;
+
+  /**
+   * Compute the log-probability of each word of several independent
+   * sentences, forward-propagated together through the RNN as a batch.
+   * OOV words get a log-probability of 0.
+   */
+  void ForwardPropagateSentencesBatch(const std::vector<std::vector<int> > &sentences,
+                                      std::vector<std::vector<double> > &logProbabilities) const;
+
   /**
    * Read the feature vector for the current word
    * in the train/test/valid file and update the feature vector
    * in the state
    * TODO: convert to ifstream
    */
-  bool LoadFeatureVectorAtCurrentWord(FILE *f, RnnState &state);
+  bool LoadFeatureVectorAtCurrentWord(FILE *f, RnnState &state) const;
   
   /**
    * Compute the accuracy of selecting the top candidate (based on score)
@@ -247,15 +311,16 @@ protected:
   
   /**
    * Matrix-vector multiplication routine, accelerated using BLAS.
-   * Computes x <- x + A' * y,
+   * Computes x <- x + alpha * A' * y,
    * i.e., the "inverse" operation to y = A * x (adding the result to x)
    * where A is of size N x M, x is of length M and y is of length N.
    * The operation can done on a contiguous subset of indices
    * j in [idxYFrom, idxYTo[ of vector y.
    */
-  void GradientMatrixXvectorBlas(std::vector<double> &vectorX,
-                                 std::vector<double> &vectorY,
-                                 std::vector<double> &matrixA,
+  void GradientMatrixXvectorBlas(std::vector<real> &vectorX,
+                                 std::vector<real> &vectorY,
+                                 const WeightVector &matrixA,
+                                 double alpha,
                                  int widthMatrix,
                                  int idxYFrom,
                                  int idxYTo) const;
@@ -266,23 +331,36 @@ protected:
    * The operation can done on a contiguous subset of row indices
    * j in [idxRowCFrom, idxRowCTo[ in matrix A and C.
    */
-  void MultiplyMatrixXmatrixBlas(std::vector<double> &matrixA,
-                                 std::vector<double> &matrixB,
-                                 std::vector<double> &matrixC,
+  void MultiplyMatrixXmatrixBlas(std::vector<real> &matrixA,
+                                 std::vector<real> &matrixB,
+                                 WeightVector &matrixC,
                                  double alpha,
                                  double beta,
-                                 int numRowsA,
                                  int numRowsB,
                                  int numColsC,
                                  int idxRowCFrom,
                                  int idxRowCTo) const;
   
+  /**
+   * Matrix-matrix multiplication routine, accelerated using BLAS.
+   * Computes C <- C + alpha * A' * B, where A is of size N x M,
+   * B is of size N x K and C is of size M x K, e.g., to sum
+   * over N time steps the outer products of the rows of A and B.
+   */
+  void MultiplyTransposedMatrixXmatrixBlas(const std::vector<real> &matrixA,
+                                           const std::vector<real> &matrixB,
+                                           WeightVector &matrixC,
+                                           double alpha,
+                                           int numRows,
+                                           int numColsA,
+                                           int numColsB) const;
+  
   /**
    * Matrix-matrix or vector-vector addition routine using BLAS.
    * Computes Y <- alpha * X + beta * Y.
    */
-  void AddMatrixToMatrixBlas(std::vector<double> &matrixX,
-                             std::vector<double> &matrixY,
+  void AddMatrixToMatrixBlas(std::vector<real> &matrixX,
+                             std::vector<real> &matrixY,
                              double alpha,
                              double beta,
                              int numRows,
@@ -305,6 +383,9 @@ protected:
   // Minimum number of word occurrences
   int m_minWordOccurrences;
 
+  // Number of training words between two checkpoints during an epoch
+  long m_numCheckpointWords;
+
   // Classification labels
   std::vector<int> m_correctSentenceLabels;
   
@@ -44,6 +44,21 @@
 
 using namespace std;
 
+
+/**
+ * Scale of lazily decayed weights under which it is folded into the weights
+ */
+static const double c_minWeightScale = 1e-6;
+
+
+/**
+ * Scale of lazily decayed weights shared by several threads under which
+ * the weights (stored divided by it) could overflow; these scales are
+ * only folded into the weights between books
+ */
+static const double c_minSharedWeightScale = 1e-30;
+
+
 /**
  * Constructor
  */
@@ -52,7 +67,8 @@ RnnWeights::RnnWeights(int sizeVocabulary,
                        int sizeFeature,
                        int sizeClasses,
                        int sizeCompress,
-                       long long sizeDirectConnection)
+                       long long sizeDirectConnection,
+                       bool doInitialize)
 : m_sizeVocabulary(sizeVocabulary),
 m_sizeHidden(sizeHidden),
 m_sizeFeature(sizeFeature),
@@ -71,6 +87,14 @@ m_sizeOutput(sizeVocabulary + sizeClasses) {
   << m_sizeFeature << " features, "
   << m_sizeCompress << " compressed, "
   << m_sizeDirectConnection << " n-grams\n";
+  ScaleRecurrent2Hidden = 1;
+  ScaleFeatures2Hidden = 1;
+  IsSharedByThreads = false;
+  m_hasScaleUnderflow = false;
+  m_isSparseGradient = false;
+  if (!doInitialize) {
+    return;
+  }
 
   // Allocate the weights connecting those layers
   // (will be assigned random values later)
@@ -87,7 +111,13 @@ m_sizeOutput(sizeVocabulary + sizeClasses) {
   }
   // Change that to proper normal distribution
   // http://en.cppreference.com/w/cpp/numeric/random/normal_distribution
-  RandomizeVector(Input2Hidden);
+  // Input2Hidden is stored word-major (one row of sizeHidden weights
+  // per word), but the random numbers are drawn in the file order
+  for (int b = 0; b < m_sizeHidden; b++) {
+    for (int a = 0; a < m_sizeInput; a++) {
+      Input2Hidden[a * m_sizeHidden + b] = GenerateNormalRandomNumber();
+    }
+  }
   RandomizeVector(Recurrent2Hidden);
   if (sizeFeature > 0) {
     RandomizeVector(Features2Hidden);
@@ -103,6 +133,38 @@ m_sizeOutput(sizeVocabulary + sizeClasses) {
 } // RnnWeights()
 
 
+/**
+ * Weight matrices, in the order in which they are stored
+ * in the memory-mapped model file
+ */
+WeightVector &RnnWeights::Matrix(int k) {
+  WeightVector *matrices[c_numMatrices] = {
+    &Input2Hidden, &Recurrent2Hidden, &Features2Hidden, &Features2Output,
+    &Hidden2Output, &Compress2Output, &DirectNGram};
+  assert((k >= 0) && (k < c_numMatrices));
+  return *(matrices[k]);
+}
+
+
+/**
+ * Expected number of weights of each matrix
+ */
+long long RnnWeights::MatrixSize(int k) const {
+  long long sizeHidden2Output =
+  (long long)m_sizeHidden * ((m_sizeCompress == 0) ? m_sizeOutput : m_sizeCompress);
+  long long sizes[c_numMatrices] = {
+    (long long)m_sizeInput * m_sizeHidden,
+    (long long)m_sizeHidden * m_sizeHidden,
+    (long long)m_sizeFeature * m_sizeHidden,
+    (long long)m_sizeFeature * m_sizeOutput,
+    sizeHidden2Output,
+    (long long)m_sizeCompress * m_sizeOutput,
+    m_sizeDirectConnection};
+  assert((k >= 0) && (k < c_numMatrices));
+  return sizes[k];
+}
+
+
 /**
  * Clear all the weights (before loading a new copy), to save memory
  */
@@ -121,6 +183,204 @@ void RnnWeights::Clear() {
 }
 
 
+/**
+ * Set all the weights to zero (e.g., to use the object as a gradient buffer)
+ */
+void RnnWeights::SetToZero() {
+  if (m_isSparseGradient) {
+    // Only the rows and hashes written since the last call are stored
+    for (size_t k = 0; k < m_sparseRowWords.size(); k++) {
+      m_sparseRowOfWord[m_sparseRowWords[k]] = -1;
+    }
+    m_sparseRowWords.clear();
+    m_sparseInput2Hidden.clear();
+    m_sparseDirectNGram.clear();
+  } else {
+    Input2Hidden.assign(Input2Hidden.size(), 0);
+    DirectNGram.assign(DirectNGram.size(), 0);
+  }
+  Recurrent2Hidden.assign(Recurrent2Hidden.size(), 0);
+  Features2Hidden.assign(Features2Hidden.size(), 0);
+  Features2Output.assign(Features2Output.size(), 0);
+  Hidden2Output.assign(Hidden2Output.size(), 0);
+  Compress2Output.assign(Compress2Output.size(), 0);
+  ScaleRecurrent2Hidden = 1;
+  ScaleFeatures2Hidden = 1;
+}
+
+
+/**
+ * Create an empty sparse gradient buffer with the same dimensions
+ */
+RnnWeights RnnWeights::CreateSparseGradient() const {
+  RnnWeights gradients(m_sizeVocabulary, m_sizeHidden, m_sizeFeature,
+                       m_sizeClasses, m_sizeCompress, m_sizeDirectConnection,
+                       false);
+  gradients.Recurrent2Hidden.assign(Recurrent2Hidden.size(), 0);
+  gradients.Features2Hidden.assign(Features2Hidden.size(), 0);
+  gradients.Features2Output.assign(Features2Output.size(), 0);
+  gradients.Hidden2Output.assign(Hidden2Output.size(), 0);
+  gradients.Compress2Output.assign(Compress2Output.size(), 0);
+  gradients.m_isSparseGradient = true;
+  gradients.m_sparseRowOfWord.assign(m_sizeInput, -1);
+  return gradients;
+}
+
+
+/**
+ * Row of Input2Hidden of a word in a sparse gradient buffer
+ */
+real *RnnWeights::SparseInput2HiddenRow(int word) {
+  int row = m_sparseRowOfWord[word];
+  if (row == -1) {
+    row = (int)m_sparseRowWords.size();
+    m_sparseRowOfWord[word] = row;
+    m_sparseRowWords.push_back(word);
+    m_sparseInput2Hidden.resize(m_sparseInput2Hidden.size() + m_sizeHidden, 0);
+  }
+  return &m_sparseInput2Hidden[(long)row * m_sizeHidden];
+}
+
+
+/**
+ * Add, element by element, the weights of another object
+ * of the same dimensions: W <- W + scale * G
+ */
+static void AddVector(WeightVector &w, const WeightVector &g,
+                      real scale = 1) {
+  for (size_t k = 0; k < w.size(); k++) {
+    w[k] += scale * g[k];
+  }
+}
+void RnnWeights::Add(const RnnWeights &other) {
+  Renormalize();
+  if (other.m_isSparseGradient) {
+    // Sum only the rows and hashes stored in the other buffer
+    for (size_t k = 0; k < other.m_sparseRowWords.size(); k++) {
+      real *row = Input2HiddenRow(other.m_sparseRowWords[k]);
+      const real *rowOther = &other.m_sparseInput2Hidden[k * m_sizeHidden];
+      for (int b = 0; b < m_sizeHidden; b++) {
+        row[b] += rowOther[b];
+      }
+    }
+    unordered_map<unsigned long long, real>::const_iterator it;
+    for (it = other.m_sparseDirectNGram.begin();
+         it != other.m_sparseDirectNGram.end(); ++it) {
+      DirectNGramWeight(it->first) += it->second;
+    }
+  } else {
+    AddVector(Input2Hidden, other.Input2Hidden);
+    AddVector(DirectNGram, other.DirectNGram);
+  }
+  AddVector(Recurrent2Hidden, other.Recurrent2Hidden,
+            other.ScaleRecurrent2Hidden);
+  AddVector(Features2Hidden, other.Features2Hidden,
+            other.ScaleFeatures2Hidden);
+  AddVector(Features2Output, other.Features2Output);
+  AddVector(Hidden2Output, other.Hidden2Output);
+  AddVector(Compress2Output, other.Compress2Output);
+}
+
+
+/**
+ * Apply a buffer of (learning rate-scaled) gradients to the weights,
+ * with weight decay: W <- decay * W + G
+ * (the weights from the features to the outputs are not decayed;
+ * with a sparse buffer, as in SGD, only the rows of Input2Hidden
+ * and the hashes of DirectNGram that have gradients are decayed)
+ */
+static void UpdateVector(WeightVector &w, const WeightVector &g,
+                         real decay, real scale = 1) {
+  for (size_t k = 0; k < w.size(); k++) {
+    w[k] = decay * w[k] + scale * g[k];
+  }
+}
+void RnnWeights::Update(const RnnWeights &gradients, double decay) {
+  Renormalize();
+  if (gradients.m_isSparseGradient) {
+    for (size_t k = 0; k < gradients.m_sparseRowWords.size(); k++) {
+      real *row = Input2HiddenRow(gradients.m_sparseRowWords[k]);
+      const real *rowGradient =
+      &gradients.m_sparseInput2Hidden[k * m_sizeHidden];
+      for (int b = 0; b < m_sizeHidden; b++) {
+        row[b] = decay * row[b] + rowGradient[b];
+      }
+    }
+    unordered_map<unsigned long long, real>::const_iterator it;
+    for (it = gradients.m_sparseDirectNGram.begin();
+         it != gradients.m_sparseDirectNGram.end(); ++it) {
+      real &weight = DirectNGramWeight(it->first);
+      weight = decay * weight + it->second;
+    }
+  } else {
+    UpdateVector(Input2Hidden, gradients.Input2Hidden, decay);
+    UpdateVector(DirectNGram, gradients.DirectNGram, decay);
+  }
+  UpdateVector(Recurrent2Hidden, gradients.Recurrent2Hidden, decay,
+               gradients.ScaleRecurrent2Hidden);
+  UpdateVector(Features2Hidden, gradients.Features2Hidden, decay,
+               gradients.ScaleFeatures2Hidden);
+  UpdateVector(Features2Output, gradients.Features2Output, 1);
+  UpdateVector(Hidden2Output, gradients.Hidden2Output, decay);
+  UpdateVector(Compress2Output, gradients.Compress2Output, decay);
+}
+
+
+/**
+ * Lazy weight decay of the weights to the hidden layer
+ */
+static double DecaySharedScale(double &scale, double coeff) {
+  // Compare-and-swap loop, so that no decay step of a thread is lost
+  double expected, desired;
+  __atomic_load(&scale, &expected, __ATOMIC_RELAXED);
+  do {
+    desired = expected * coeff;
+  } while (!__atomic_compare_exchange(&scale, &expected, &desired, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return desired;
+}
+void RnnWeights::DecayHiddenLayerWeights(double coeff) {
+  if (IsSharedByThreads) {
+    // The other threads are reading and updating the weights up to
+    // the current scales, which therefore cannot be folded here
+    double scaleRecurrent = DecaySharedScale(ScaleRecurrent2Hidden, coeff);
+    double scaleFeatures = DecaySharedScale(ScaleFeatures2Hidden, coeff);
+    if ((scaleRecurrent < c_minSharedWeightScale) ||
+        (scaleFeatures < c_minSharedWeightScale)) {
+      // Exceptions cannot leave the threads: the caller checks the flag
+      __atomic_store_n(&m_hasScaleUnderflow, true, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+  ScaleRecurrent2Hidden *= coeff;
+  ScaleFeatures2Hidden *= coeff;
+  if ((ScaleRecurrent2Hidden < c_minWeightScale) ||
+      (ScaleFeatures2Hidden < c_minWeightScale)) {
+    Renormalize();
+  }
+}
+
+
+/**
+ * Fold the scales of the lazily decayed weights into the weights
+ */
+static void ScaleVector(WeightVector &w, real scale) {
+  for (size_t k = 0; k < w.size(); k++) {
+    w[k] *= scale;
+  }
+}
+void RnnWeights::Renormalize() {
+  if (ScaleRecurrent2Hidden != 1) {
+    ScaleVector(Recurrent2Hidden, ScaleRecurrent2Hidden);
+    ScaleRecurrent2Hidden = 1;
+  }
+  if (ScaleFeatures2Hidden != 1) {
+    ScaleVector(Features2Hidden, ScaleFeatures2Hidden);
+    ScaleFeatures2Hidden = 1;
+  }
+}
+
+
 /**
  * Load the weights matrices from a file
  */
@@ -128,15 +388,17 @@ void RnnWeights::Load(FILE *fi) {
   // Read the weights of input -> hidden connections
   Log("Reading " + ConvString(m_sizeHidden) +
       "x" + ConvString(m_sizeInput) + " input->hidden weights...\n");
-  ReadBinaryMatrix(fi, m_sizeInput, m_sizeHidden, Input2Hidden);
+  ReadBinaryMatrixTransposed(fi, m_sizeInput, m_sizeHidden, Input2Hidden);
   // Read the weights of recurrent hidden -> hidden connections
   Log("Reading " + ConvString(m_sizeHidden) + "x" + ConvString(m_sizeHidden) +
       " recurrent hidden->hidden weights...\n");
   ReadBinaryMatrix(fi, m_sizeHidden, m_sizeHidden, Recurrent2Hidden);
+  ScaleRecurrent2Hidden = 1;
   // Read the weights of feature -> hidden connections
   Log("Reading " + ConvString(m_sizeHidden) + "x" + ConvString(m_sizeFeature) +
       " feature->hidden weights...\n");
   ReadBinaryMatrix(fi, m_sizeFeature, m_sizeHidden, Features2Hidden);
+  ScaleFeatures2Hidden = 1;
   // Read the weights of feature -> output connections
   Log("Reading " + ConvString(m_sizeOutput) + "x" + ConvString(m_sizeFeature) +
       " feature->output weights...\n");
@@ -170,10 +432,12 @@ void RnnWeights::Load(FILE *fi) {
  */
 void RnnWeights::Save(FILE *fo) {
   string logFilename = "log_saving.txt";
+  // Save the actual weights, not up to their scales
+  Renormalize();
   // Save the weights U: input -> hidden (i.e., the word embeddings)
   Log("Saving " + ConvString(m_sizeHidden) + "x" + ConvString(m_sizeInput) +
       " input->hidden weights...\n", logFilename);
-  SaveBinaryMatrix(fo, m_sizeInput, m_sizeHidden, Input2Hidden);
+  SaveBinaryMatrixTransposed(fo, m_sizeInput, m_sizeHidden, Input2Hidden);
   // Save the weights W: recurrent hidden -> hidden (i.e., the time-delay)
   Log("Saving " + ConvString(m_sizeHidden) + "x" + ConvString(m_sizeHidden) +
       " recurrent hidden->hidden weights...\n", logFilename);
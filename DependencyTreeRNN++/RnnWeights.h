@@ -40,7 +40,9 @@
 #include <stdio.h>
 #include <vector>
 #include <sstream>
+#include <unordered_map>
 #include "Utils.h"
+#include "WeightVector.h"
 
 
 /**
@@ -60,14 +62,16 @@ class RnnWeights {
 public:
 
   /**
-   * Constructor
+   * Constructor (without allocating nor initializing the weights
+   * when doInitialize is false, e.g., before mapping them from a file)
    */
   RnnWeights(int sizeVocabulary,
              int sizeHidden,
              int sizeFeature,
              int sizeClasses,
              int sizeCompress,
-             long long sizeDirectConnection);
+             long long sizeDirectConnection,
+             bool doInitialize = true);
 
   /**
    * Load the weights matrices from a file
@@ -84,21 +88,110 @@ public:
    */
   void Save(FILE *fo);
 
-  // Weights between input and hidden layer
-  std::vector<double> Input2Hidden;
-  // Weights between former hidden state and current hidden layer
-  std::vector<double> Recurrent2Hidden;
-  // weights between features and hidden layer
-  std::vector<double> Features2Hidden;
+  /**
+   * Set all the weights to zero (e.g., to use the object as a buffer
+   * accumulating the gradients of the weights)
+   */
+  void SetToZero();
+
+  /**
+   * Add the weights (or gradients) of another object of same dimensions
+   */
+  void Add(const RnnWeights &other);
+
+  /**
+   * Apply a buffer of (learning rate-scaled) gradients to the weights,
+   * with weight decay: W <- decay * W + G
+   * (the weights from the features to the outputs are not decayed)
+   */
+  void Update(const RnnWeights &gradients, double decay);
+
+  /**
+   * Create an empty buffer of gradients with the same dimensions,
+   * whose gradients to Input2Hidden and DirectNGram are sparse: only
+   * the rows and the n-gram hashes written by training are stored
+   * (the other, smaller, matrices are dense and set to zero)
+   */
+  RnnWeights CreateSparseGradient() const;
+
+  /**
+   * Row of Input2Hidden (word-major) of a word; in a sparse gradient
+   * buffer, the row is created (set to zero) when first written
+   */
+  real *Input2HiddenRow(int word) {
+    if (m_isSparseGradient) {
+      return SparseInput2HiddenRow(word);
+    }
+    return &Input2Hidden[(long)word * m_sizeHidden];
+  }
+
+  /**
+   * Weight of DirectNGram at an n-gram hash; in a sparse gradient buffer,
+   * the weight is created (set to zero) when first written
+   */
+  real &DirectNGramWeight(unsigned long long hash) {
+    if (m_isSparseGradient) {
+      return m_sparseDirectNGram[hash];
+    }
+    return DirectNGram[hash];
+  }
+
+  /**
+   * Lazy weight decay of the weights to the hidden layer from the former
+   * hidden state and from the features: only their scales are multiplied
+   * by coeff (the scales are folded into the weights when too small,
+   * unless the weights are shared by several threads: the underflow
+   * is then only recorded, see HasScaleUnderflow)
+   */
+  void DecayHiddenLayerWeights(double coeff);
+
+  /**
+   * Did the scales underflow while the weights were shared by several
+   * threads? To be checked once the threads are done (it is not reset)
+   */
+  bool HasScaleUnderflow() const {
+    return __atomic_load_n(&m_hasScaleUnderflow, __ATOMIC_RELAXED);
+  }
+
+  /**
+   * Fold the scales of the lazily decayed weights into the weights
+   */
+  void Renormalize();
+
+  // Weights between input and hidden layer, stored word-major
+  // (the sizeHidden weights of word w start at w * sizeHidden)
+  WeightVector Input2Hidden;
+  // Weights between former hidden state and current hidden layer,
+  // up to the scale ScaleRecurrent2Hidden
+  WeightVector Recurrent2Hidden;
+  // weights between features and hidden layer,
+  // up to the scale ScaleFeatures2Hidden
+  WeightVector Features2Hidden;
   // Weights between features and output layer
-  std::vector<double> Features2Output;
+  WeightVector Features2Output;
   // Weights between hidden and output layer (or hidden and compression if compression>0)
-  std::vector<double> Hidden2Output;
+  WeightVector Hidden2Output;
   // Optional weights between compression and output layer
-  std::vector<double> Compress2Output;
+  WeightVector Compress2Output;
   // Direct parameters between input and output layer
   // (similar to Maximum Entropy model parameters)
-  std::vector<double> DirectNGram;
+  WeightVector DirectNGram;
+  // Scales of the lazily decayed weights Recurrent2Hidden
+  // and Features2Hidden (the actual weights are scale * weights)
+  double ScaleRecurrent2Hidden;
+  double ScaleFeatures2Hidden;
+  // Are the weights updated by several threads at once (Hogwild-style)?
+  // The scales are then decayed atomically, and only folded into
+  // the weights by Renormalize, while no thread is updating them
+  bool IsSharedByThreads;
+
+  /**
+   * Weight matrices, in the order in which they are stored
+   * in the memory-mapped model file, and their expected numbers of weights
+   */
+  static const int c_numMatrices = 7;
+  WeightVector &Matrix(int k);
+  long long MatrixSize(int k) const;
 
   /**
    * Return the number of direct connections between input words
@@ -132,6 +225,24 @@ protected:
   long long m_sizeDirectConnection;
   int m_sizeInput;
   int m_sizeOutput;
+
+  // Did the scales underflow while the weights were shared by threads?
+  bool m_hasScaleUnderflow;
+
+  /**
+   * Row of Input2Hidden of a word in a sparse gradient buffer
+   */
+  real *SparseInput2HiddenRow(int word);
+
+  // Is the object a sparse gradient buffer? If so, the words whose rows
+  // of Input2Hidden were written since the last SetToZero, the index
+  // of the row of each word (-1 if none), the rows themselves
+  // (one after the other), and the gradients of the written n-gram hashes
+  bool m_isSparseGradient;
+  std::vector<int> m_sparseRowWords;
+  std::vector<int> m_sparseRowOfWord;
+  std::vector<real> m_sparseInput2Hidden;
+  std::unordered_map<unsigned long long, real> m_sparseDirectNGram;
 }; // class RnnWeights
 
 #endif
@@ -0,0 +1,137 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <string.h>
+#include <assert.h>
+#include <climits>
+#include "StringTable.h"
+
+using namespace std;
+
+
+/**
+ * Hash (64-bit FNV-1a) of a string
+ */
+unsigned long long StringTable::Hash(const char *text, size_t length) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)text[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+/**
+ * Return the index of a string, or -1 if not found
+ */
+int StringTable::Find(const char *text, size_t length) const {
+  if (_slots.empty()) {
+    return -1;
+  }
+  size_t mask = _slots.size() - 1;
+  size_t slot = (size_t)Hash(text, length) & mask;
+  // There is always an empty slot, which ends the probing
+  while (_slots[slot] >= 0) {
+    int k = _slots[slot];
+    if (((size_t)(_offsets[k + 1] - _offsets[k] - 1) == length)
+        && (memcmp(&(_blob[_offsets[k]]), text, length) == 0)) {
+      return k;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+
+/**
+ * Insert a string, if new, and return its index
+ */
+int StringTable::Insert(const string &text) {
+  int k = Find(text);
+  if (k >= 0) {
+    return k;
+  }
+  // Append the string to the blob
+  assert(_blob.size() + text.size() + 1 <= (size_t)INT_MAX);
+  k = Size();
+  _blob.insert(_blob.end(), text.begin(), text.end());
+  _blob.push_back(0);
+  _offsets.push_back((int)(_blob.size()));
+  _counts.push_back(0.0);
+  // Keep the hash table at most half full
+  if (2 * _counts.size() > _slots.size()) {
+    Rehash(_slots.empty() ? 16 : (int)(2 * _slots.size()));
+  } else {
+    InsertSlot(k);
+  }
+  return k;
+}
+
+
+/**
+ * Store string k in the first free slot after its hash
+ */
+void StringTable::InsertSlot(int k) {
+  size_t mask = _slots.size() - 1;
+  size_t slot = (size_t)Hash(&(_blob[_offsets[k]]),
+                             _offsets[k + 1] - _offsets[k] - 1) & mask;
+  while (_slots[slot] >= 0) {
+    slot = (slot + 1) & mask;
+  }
+  _slots[slot] = k;
+}
+
+
+/**
+ * Rebuild the hash table with a given number of slots (a power of 2)
+ */
+void StringTable::Rehash(int numSlots) {
+  _slots.assign(numSlots, -1);
+  for (int k = 0; k < Size(); k++) {
+    InsertSlot(k);
+  }
+}
+
+
+/**
+ * Replace the content of the table by copies of given arrays.
+ * Returns false if the arrays are not consistent.
+ */
+bool StringTable::Assign(const char *blob, size_t blobSize,
+                         const int *offsets, const double *counts,
+                         int numStrings,
+                         const int *slots, int numSlots) {
+  // Check the offsets of the strings in the blob
+  if ((numStrings < 0) || (offsets[0] != 0)
+      || ((size_t)offsets[numStrings] != blobSize)) {
+    return false;
+  }
+  for (int k = 0; k < numStrings; k++) {
+    if ((offsets[k + 1] <= offsets[k]) || (blob[offsets[k + 1] - 1] != 0)) {
+      return false;
+    }
+  }
+  // Check that the hash table is a power of 2, holding each string once
+  if ((numSlots < 2 * numStrings) || (numSlots & (numSlots - 1))) {
+    return false;
+  }
+  int numUsedSlots = 0;
+  for (int i = 0; i < numSlots; i++) {
+    if ((slots[i] < -1) || (slots[i] >= numStrings)) {
+      return false;
+    }
+    numUsedSlots += (slots[i] >= 0) ? 1 : 0;
+  }
+  if (numUsedSlots != numStrings) {
+    return false;
+  }
+  _blob.assign(blob, blob + blobSize);
+  _offsets.assign(offsets, offsets + numStrings + 1);
+  _counts.assign(counts, counts + numStrings);
+  _slots.assign(slots, slots + numSlots);
+  return true;
+}
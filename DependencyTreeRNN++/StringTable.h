@@ -0,0 +1,113 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____StringTable__
+#define __DependencyTreeRNN____StringTable__
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Compact table of interned strings (words or labels): each string has
+ * a dense index (in order of insertion) and a (discounted) count.
+ * The strings are stored one after the other (each terminated by 0)
+ * in a single blob, with an array of offsets, and are looked up through
+ * an open-addressing hash table (linear probing) of string indexes.
+ * The table is made of flat arrays only, so that it can be saved
+ * and loaded in bulk. Once built, a table is not modified any more,
+ * and can be shared between the corpora.
+ */
+class StringTable {
+public:
+
+  /**
+   * Constructor: empty table
+   */
+  StringTable() : _offsets(1, 0) { }
+
+  /**
+   * Number of strings
+   */
+  int Size() const { return (int)(_counts.size()); }
+
+  /**
+   * Return the index of a string, or -1 if not found
+   */
+  int Find(const char *text, size_t length) const;
+  int Find(const std::string &text) const {
+    return Find(text.data(), text.size());
+  }
+
+  /**
+   * Insert a string, if new, and return its index
+   */
+  int Insert(const std::string &text);
+
+  /**
+   * Return string k (an empty string if k is not a valid index)
+   */
+  const char *String(int k) const {
+    return ((k >= 0) && (k < Size())) ? &(_blob[_offsets[k]]) : "";
+  }
+
+  /**
+   * Return the count of string k
+   */
+  double Count(int k) const { return _counts[k]; }
+  double &Count(int k) { return _counts[k]; }
+
+  /**
+   * Accessors to the arrays of the table
+   */
+  const std::vector<char> &Blob() const { return _blob; }
+  const std::vector<int> &Offsets() const { return _offsets; }
+  const std::vector<double> &Counts() const { return _counts; }
+  const std::vector<int> &Slots() const { return _slots; }
+
+  /**
+   * Replace the content of the table by copies of given arrays
+   * (numStrings + 1 offsets, numStrings counts, numSlots slots).
+   * Returns false if the arrays are not consistent.
+   */
+  bool Assign(const char *blob, size_t blobSize,
+              const int *offsets, const double *counts, int numStrings,
+              const int *slots, int numSlots);
+
+protected:
+
+  /**
+   * Hash (64-bit FNV-1a) of a string
+   */
+  static unsigned long long Hash(const char *text, size_t length);
+
+  /**
+   * Store string k in the first free slot after its hash
+   */
+  void InsertSlot(int k);
+
+  /**
+   * Rebuild the hash table with a given number of slots (a power of 2)
+   */
+  void Rehash(int numSlots);
+
+protected:
+
+  // Strings, each terminated by 0, and their offsets in the blob
+  // (number of strings + 1)
+  std::vector<char> _blob;
+  std::vector<int> _offsets;
+
+  // Counts of the strings
+  std::vector<double> _counts;
+
+  // Hash table of string indexes (-1 for an empty slot),
+  // whose size is a power of 2, and at least twice the number of strings
+  std::vector<int> _slots;
+};
+
+#endif /* defined(__DependencyTreeRNN____StringTable__) */
@@ -46,39 +46,50 @@
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
+#include "Logger.h"
 
 
 /**
- * Log to screen and to file (append)
- */
-static void Log(std::string str, std::string logFilename) {
-  std::ostringstream buf;
-  std::ofstream logFile(logFilename, std::fstream::app);
-  buf << str;
-  logFile << buf.str() << std::flush;
-  std::cout << buf.str() << std::flush;
-  buf.str("");
-  buf.clear();
-}
+ * Floating-point type used to store the weights and activations of the RNN.
+ * Single precision halves the memory footprint of the weight matrices
+ * and doubles the SIMD/BLAS throughput; it is selected at compile time
+ * with -DUSE_FLOAT (see PRECISIONFLAGS in the Makefiles).
+ * Accumulators of log-probabilities and entropies remain in double.
+ */
+#ifdef USE_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
 
 
 /**
- * Log to screen only
- */
-static void Log(std::string str) {
-  std::ostringstream buf;
-  buf << str;
-  std::cout << buf.str() << std::flush;
-  buf.str("");
-  buf.clear();
+ * Read a matrix of floats in binary format
+ */
+template <class Vector>
+static void ReadBinaryMatrix(FILE *fi, int sizeIn, int sizeOut,
+                             Vector &vec) {
+  if (sizeIn * sizeOut == 0) {
+    return;
+  }
+  for (int idxOut = 0; idxOut < sizeOut; idxOut++) {
+    for (int idxIn = 0; idxIn < sizeIn; idxIn++) {
+      float val;
+      fread(&val, 4, 1, fi);
+      vec[idxIn + idxOut * sizeIn] = val;
+    }
+  }
 }
 
 
 /**
- * Read a matrix of floats in binary format
+ * Read a matrix of floats in binary format, stored in the file
+ * in the same order as in ReadBinaryMatrix, and transpose it in memory
+ * (i.e., row idxIn of the matrix in memory is contiguous)
  */
-static void ReadBinaryMatrix(FILE *fi, int sizeIn, int sizeOut,
-                             std::vector<double> &vec) {
+template <class Vector>
+static void ReadBinaryMatrixTransposed(FILE *fi, int sizeIn, int sizeOut,
+                                       Vector &vec) {
   if (sizeIn * sizeOut == 0) {
     return;
   }
@@ -86,7 +97,7 @@ static void ReadBinaryMatrix(FILE *fi, int sizeIn, int sizeOut,
     for (int idxIn = 0; idxIn < sizeIn; idxIn++) {
       float val;
       fread(&val, 4, 1, fi);
-      vec[idxIn + idxOut * sizeIn] = val;
+      vec[idxIn * sizeOut + idxOut] = val;
     }
   }
 }
@@ -95,8 +106,9 @@ static void ReadBinaryMatrix(FILE *fi, int sizeIn, int sizeOut,
 /**
  * Read a vector of floats in binary format
  */
+template <class Vector>
 static void ReadBinaryVector(FILE *fi, long long size,
-                             std::vector<double> &vec) {
+                             Vector &vec) {
   for (long long aa = 0; aa < size; aa++) {
     float val;
     fread(&val, 4, 1, fi);
@@ -108,8 +120,9 @@ static void ReadBinaryVector(FILE *fi, long long size,
 /**
  * Save a matrix of floats in binary format
  */
+template <class Vector>
 static void SaveBinaryMatrix(FILE *fo, int sizeIn, int sizeOut,
-                             const std::vector<double> &vec) {
+                             const Vector &vec) {
   if (sizeIn * sizeOut == 0) {
     return;
   }
@@ -122,11 +135,32 @@ static void SaveBinaryMatrix(FILE *fo, int sizeIn, int sizeOut,
 }
 
 
+/**
+ * Save a matrix of floats in binary format, stored in memory transposed
+ * (see ReadBinaryMatrixTransposed), using the same file order
+ * as SaveBinaryMatrix
+ */
+template <class Vector>
+static void SaveBinaryMatrixTransposed(FILE *fo, int sizeIn, int sizeOut,
+                                       const Vector &vec) {
+  if (sizeIn * sizeOut == 0) {
+    return;
+  }
+  for (int idxOut = 0; idxOut < sizeOut; idxOut++) {
+    for (int idxIn = 0; idxIn < sizeIn; idxIn++) {
+      float val = (float)(vec[idxIn * sizeOut + idxOut]);
+      fwrite(&val, 4, 1, fo);
+    }
+  }
+}
+
+
 /**
  * Save a vector of floats in binary format
  */
+template <class Vector>
 static void SaveBinaryVector(FILE *fo, long long size,
-                             const std::vector<double> &vec) {
+                             const Vector &vec) {
   for (long long aa = 0; aa < size; aa++) {
     float val = vec[aa];
     fwrite(&val, 4, 1, fo);
@@ -156,7 +190,8 @@ static double GenerateNormalRandomNumber() {
 /**
  * Randomize a vector with small numbers to get zero-mean random numbers
  */
-static void RandomizeVector(std::vector<double> &vec) {
+template <class Vector>
+static void RandomizeVector(Vector &vec) {
   for (size_t k = 0; k < vec.size(); k++) {
     vec[k] = GenerateNormalRandomNumber();
   }
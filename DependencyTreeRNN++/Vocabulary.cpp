@@ -76,9 +76,8 @@ Vocabulary::Vocabulary(FILE *fi, int sizeVocabulary, int numClasses) {
     m_vocabularyStorage[a].classIndex = classIndex;
     m_mapWord2Class[word] = classIndex;
 
-    // Associate the word (string) to the word token number using two maps
+    // Associate the word (string) to the word token number
     m_mapWord2Index[word] = wordIndex;
-    m_mapIndex2Word[wordIndex] = word;
   }
 
   // Store which words are in which class, using a vector
@@ -90,6 +89,33 @@ Vocabulary::Vocabulary(FILE *fi, int sizeVocabulary, int numClasses) {
 }
 
 
+/**
+ * Constructor from the arrays of a memory-mapped model file
+ */
+Vocabulary::Vocabulary(const char *words, const int *offsets,
+                       const int *counts, const int *classes,
+                       int sizeVocabulary, int numClasses) {
+  m_vocabularyStorage.resize(sizeVocabulary);
+  m_mapWord2Index.reserve(sizeVocabulary);
+  m_mapWord2Class.reserve(sizeVocabulary);
+  for (int a = 0; a < sizeVocabulary; a++) {
+    std::string word(words + offsets[a]);
+    m_vocabularyStorage[a].word = word;
+    m_vocabularyStorage[a].cn = counts[a];
+    m_vocabularyStorage[a].prob = 0;
+    m_vocabularyStorage[a].classIndex = classes[a];
+    m_mapWord2Class[word] = classes[a];
+    m_mapWord2Index[word] = a;
+  }
+
+  // Store which words are in which class
+  m_numClasses = numClasses;
+  StoreClassAssociations();
+
+  m_useClassFile = false;
+}
+
+
 /**
  * Save the vocabulary to a model file
  */
@@ -128,7 +154,6 @@ int Vocabulary::AddWordToVocabulary(const std::string& word)
     // We need to store the word - index pair in the hash table word -> index
     // but we will rewrite that map later after sorting the vocabulary by frequency
     m_mapWord2Index[word] = index;
-    m_mapIndex2Word[index] = word;
   } else {
     // ... otherwise simply increase its count
     m_vocabularyStorage[index].cn++;
@@ -170,15 +195,13 @@ void Vocabulary::SortVocabularyByFrequency() {
             OrderWordCounts);
   m_vocabularyStorage[indexEos].cn = countEos;
 
-  // Rebuild the the maps of word <-> word index
+  // Rebuild the map of word -> word index
+  // (index -> word is given by the vocabulary storage)
   m_mapWord2Index.clear();
-  m_mapIndex2Word.clear();
   for (int index = 0; index < GetVocabularySize(); index++) {
-    std::string word = m_vocabularyStorage[index].word;
+    const std::string &word = m_vocabularyStorage[index].word;
     // Add the word to the hash table word -> index
     m_mapWord2Index[word] = index;
-    // Add the word to the hash table index -> word
-    m_mapIndex2Word[index] = word;
   }
 }
 
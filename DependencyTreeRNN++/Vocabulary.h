@@ -74,6 +74,15 @@ public:
    */
   Vocabulary(FILE *fi, int sizeVocabulary, int numClasses);
 
+  /**
+   * Constructor from the arrays of a memory-mapped model file:
+   * blob of 0-terminated words, offsets of the words in the blob,
+   * word counts and word classes.
+   */
+  Vocabulary(const char *words, const int *offsets,
+             const int *counts, const int *classes,
+             int sizeVocabulary, int numClasses);
+
   /**
    * Save the vocabulary to a model file.
    */
@@ -159,9 +168,6 @@ public:
   // Vocabulary representation (word -> index of the word)
   std::unordered_map<std::string, int> m_mapWord2Index;
 
-  // Inverse vocabulary representation (index of the word -> word)
-  std::unordered_map<int, std::string> m_mapIndex2Word;
-
   // Hash table enabling a look-up of the class of a word
   // (word -> word class)
   std::unordered_map<std::string, int> m_mapWord2Class;
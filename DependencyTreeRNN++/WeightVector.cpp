@@ -0,0 +1,46 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "WeightVector.h"
+
+using namespace std;
+
+
+/**
+ * Map a file in memory (returns NULL if it cannot be mapped).
+ * The mapping is private (copy-on-write) and readable and writable,
+ * so that mapped weights can also be trained further.
+ */
+shared_ptr<MappedFile> MappedFile::Map(const string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return shared_ptr<MappedFile>();
+  }
+  struct stat fileStat;
+  if ((fstat(fd, &fileStat) != 0) || (fileStat.st_size <= 0)) {
+    close(fd);
+    return shared_ptr<MappedFile>();
+  }
+  size_t size = (size_t)fileStat.st_size;
+  void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return shared_ptr<MappedFile>();
+  }
+  return shared_ptr<MappedFile>(new MappedFile((char *)data, size));
+}
+
+
+/**
+ * Destructor: unmap the file
+ */
+MappedFile::~MappedFile() {
+  munmap(m_data, m_size);
+}
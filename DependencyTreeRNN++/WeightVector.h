@@ -0,0 +1,189 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____WeightVector__
+#define __DependencyTreeRNN____WeightVector__
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Utils.h"
+
+
+/**
+ * Memory mapping of a whole file, private and copy-on-write:
+ * the pages that are only read are shared with the page cache (and thus
+ * between all the processes mapping the same file), and are only loaded
+ * when first accessed. The file is unmapped with the last reference.
+ */
+class MappedFile {
+public:
+
+  /**
+   * Map a file in memory (returns NULL if it cannot be mapped)
+   */
+  static std::shared_ptr<MappedFile> Map(const std::string &filename);
+
+  /**
+   * Destructor: unmap the file
+   */
+  ~MappedFile();
+
+  /**
+   * Address and size of the mapping
+   */
+  char *Data() const { return m_data; }
+  size_t Size() const { return m_size; }
+
+protected:
+
+  MappedFile(char *data, size_t size) : m_data(data), m_size(size) { }
+
+  // Address and size of the mapping
+  char *m_data;
+  size_t m_size;
+};
+
+
+/**
+ * Vector of weights, which either owns its elements (like std::vector)
+ * or is a view on the elements stored in a mapped model file.
+ * Mapped weights are loaded lazily, page by page, and shared between
+ * the processes scoring with the same model file; writing to them
+ * only copies the pages that are written. A copy of a weight vector
+ * always owns its elements.
+ */
+class WeightVector {
+public:
+
+  /**
+   * Constructors
+   */
+  WeightVector() : m_data(NULL), m_size(0) { }
+  WeightVector(const WeightVector &other)
+  : m_storage(other.m_data, other.m_data + other.m_size) {
+    Own();
+  }
+  WeightVector(WeightVector &&other)
+  : m_storage(std::move(other.m_storage)),
+  m_file(std::move(other.m_file)),
+  m_data(other.m_data),
+  m_size(other.m_size) {
+    other.m_storage.clear();
+    other.Own();
+  }
+
+  /**
+   * Assignments
+   */
+  WeightVector &operator=(const WeightVector &other) {
+    if (this != &other) {
+      m_storage.assign(other.m_data, other.m_data + other.m_size);
+      m_file.reset();
+      Own();
+    }
+    return *this;
+  }
+  WeightVector &operator=(WeightVector &&other) {
+    if (this != &other) {
+      m_storage = std::move(other.m_storage);
+      m_file = std::move(other.m_file);
+      m_data = other.m_data;
+      m_size = other.m_size;
+      other.m_storage.clear();
+      other.Own();
+    }
+    return *this;
+  }
+
+  /**
+   * Access to the elements
+   */
+  size_t size() const { return m_size; }
+  bool empty() const { return (m_size == 0); }
+  real *data() { return m_data; }
+  const real *data() const { return m_data; }
+  real &operator[](size_t k) { return m_data[k]; }
+  const real &operator[](size_t k) const { return m_data[k]; }
+
+  /**
+   * Resize the vector, which then owns its elements
+   */
+  void resize(size_t size) {
+    Detach();
+    m_storage.resize(size);
+    Own();
+  }
+
+  /**
+   * Set the vector to size copies of value, which it then owns
+   */
+  void assign(size_t size, real value) {
+    m_file.reset();
+    m_storage.assign(size, value);
+    Own();
+  }
+
+  /**
+   * Release the elements
+   */
+  void clear() {
+    m_file.reset();
+    std::vector<real>().swap(m_storage);
+    Own();
+  }
+
+  /**
+   * View size elements of a mapped file, starting at a given offset
+   * (in bytes, aligned on the size of real)
+   */
+  void Map(const std::shared_ptr<MappedFile> &file,
+           size_t offset, size_t size) {
+    std::vector<real>().swap(m_storage);
+    m_file = file;
+    m_data = (real *)(file->Data() + offset);
+    m_size = size;
+  }
+
+  /**
+   * Is the vector a view on a mapped file?
+   */
+  bool IsMapped() const { return (m_file != NULL); }
+
+protected:
+
+  /**
+   * Point to the elements owned by the vector
+   */
+  void Own() {
+    m_data = m_storage.data();
+    m_size = m_storage.size();
+  }
+
+  /**
+   * Copy the elements of a mapped file, so that the vector owns them
+   */
+  void Detach() {
+    if (m_file != NULL) {
+      m_storage.assign(m_data, m_data + m_size);
+      m_file.reset();
+    }
+  }
+
+  // Elements owned by the vector
+  std::vector<real> m_storage;
+
+  // Mapped file whose elements are viewed, if any
+  std::shared_ptr<MappedFile> m_file;
+
+  // First element and number of elements
+  real *m_data;
+  size_t m_size;
+};
+
+#endif /* defined(__DependencyTreeRNN____WeightVector__) */
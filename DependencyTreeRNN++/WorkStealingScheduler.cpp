@@ -0,0 +1,141 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#include <algorithm>
+#include "WorkStealingScheduler.h"
+
+using namespace std;
+
+
+/**
+ * Constructor: start the worker threads, which wait for tasks
+ */
+WorkStealingScheduler::WorkStealingScheduler(int numThreads)
+: m_numThreads((numThreads < 1) ? 1 : numThreads),
+m_queues(m_numThreads),
+m_task(NULL),
+m_numRuns(0),
+m_numBusyWorkers(0),
+m_isStopped(false) {
+  for (int idxThread = 1; idxThread < m_numThreads; idxThread++) {
+    m_threads.push_back(thread(&WorkStealingScheduler::Work, this, idxThread));
+  }
+}
+
+
+/**
+ * Destructor: stop the worker threads
+ */
+WorkStealingScheduler::~WorkStealingScheduler() {
+  {
+    lock_guard<mutex> guard(m_mutex);
+    m_isStopped = true;
+  }
+  m_runStarted.notify_all();
+  for (size_t k = 0; k < m_threads.size(); k++) {
+    m_threads[k].join();
+  }
+}
+
+
+/**
+ * Take the next task from the front of the queue of thread idxThread,
+ * or steal one from the back of the queue of another thread
+ */
+int WorkStealingScheduler::NextTask(int idxThread) {
+  {
+    lock_guard<mutex> guard(m_queues[idxThread].lock);
+    if (!m_queues[idxThread].tasks.empty()) {
+      int idxTask = m_queues[idxThread].tasks.front();
+      m_queues[idxThread].tasks.pop_front();
+      return idxTask;
+    }
+  }
+  for (int k = 1; k < m_numThreads; k++) {
+    TaskQueue &victim = m_queues[(idxThread + k) % m_numThreads];
+    lock_guard<mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      int idxTask = victim.tasks.back();
+      victim.tasks.pop_back();
+      return idxTask;
+    }
+  }
+  // No task is added during a run, so there is nothing left to do
+  return -1;
+}
+
+
+/**
+ * Run the tasks of each call to Run on a worker thread
+ */
+void WorkStealingScheduler::Work(int idxThread) {
+  long numRuns = 0;
+  while (true) {
+    const function<void(int, int)> *task = NULL;
+    {
+      unique_lock<mutex> guard(m_mutex);
+      m_runStarted.wait(guard, [this, numRuns]() {
+        return m_isStopped || (m_numRuns != numRuns);
+      });
+      if (m_isStopped) {
+        return;
+      }
+      numRuns = m_numRuns;
+      task = m_task;
+    }
+    for (int idxTask = NextTask(idxThread); idxTask >= 0;
+         idxTask = NextTask(idxThread)) {
+      (*task)(idxTask, idxThread);
+    }
+    {
+      lock_guard<mutex> guard(m_mutex);
+      m_numBusyWorkers--;
+      if (m_numBusyWorkers == 0) {
+        m_runFinished.notify_one();
+      }
+    }
+  }
+}
+
+
+/**
+ * Run task(idxTask, idxThread) for all idxTask in [0, numTasks[
+ */
+void WorkStealingScheduler::Run(int numTasks,
+                                const function<void(int, int)> &task) {
+  if ((m_numThreads <= 1) || (numTasks <= 1)) {
+    for (int idxTask = 0; idxTask < numTasks; idxTask++) {
+      task(idxTask, 0);
+    }
+    return;
+  }
+
+  // Deal contiguous ranges of tasks to the threads
+  // (the worker threads are all waiting)
+  for (int idxThread = 0; idxThread < m_numThreads; idxThread++) {
+    int idxFrom = (int)(((long)numTasks * idxThread) / m_numThreads);
+    int idxTo = (int)(((long)numTasks * (idxThread + 1)) / m_numThreads);
+    for (int idxTask = idxFrom; idxTask < idxTo; idxTask++) {
+      m_queues[idxThread].tasks.push_back(idxTask);
+    }
+  }
+
+  // Wake up the worker threads; each thread runs tasks until all
+  // the queues are empty, and the calling thread acts as thread 0
+  {
+    lock_guard<mutex> guard(m_mutex);
+    m_task = &task;
+    m_numBusyWorkers = m_numThreads - 1;
+    m_numRuns++;
+  }
+  m_runStarted.notify_all();
+  for (int idxTask = NextTask(0); idxTask >= 0; idxTask = NextTask(0)) {
+    task(idxTask, 0);
+  }
+  unique_lock<mutex> guard(m_mutex);
+  m_runFinished.wait(guard, [this]() { return (m_numBusyWorkers == 0); });
+  m_task = NULL;
+}
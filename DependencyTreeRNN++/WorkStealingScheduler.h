@@ -0,0 +1,99 @@
+// Copyright (c) 2014-2015 Piotr Mirowski
+//
+// Piotr Mirowski, Andreas Vlachos
+// "Dependency Recurrent Neural Language Models for Sentence Completion"
+// ACL 2015
+
+#ifndef __DependencyTreeRNN____WorkStealingScheduler__
+#define __DependencyTreeRNN____WorkStealingScheduler__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Run a set of independent tasks (e.g., scoring sentences) on several
+ * threads. Each thread starts with a contiguous range of tasks in its own
+ * queue, takes tasks from the front of its queue, and once it is empty,
+ * steals tasks from the back of the queues of the other threads,
+ * so that threads stay busy even when the tasks vary widely in size.
+ * The worker threads are created once, with the scheduler, and wait
+ * between two calls to Run, so that short sets of tasks (e.g., one step
+ * of synchronous training) do not pay for creating threads.
+ */
+class WorkStealingScheduler {
+public:
+
+  /**
+   * Constructor: start the worker threads
+   */
+  WorkStealingScheduler(int numThreads);
+
+  /**
+   * Destructor: stop the worker threads
+   */
+  ~WorkStealingScheduler();
+
+  /**
+   * Run task(idxTask, idxThread) for all idxTask in [0, numTasks[
+   * and return when all the tasks are done. Index idxThread,
+   * in [0, numThreads[, identifies the thread running the task
+   * (e.g., to use per-thread states); the calling thread is thread 0.
+   * With one thread or one task, the tasks are run in order
+   * in the calling thread.
+   */
+  void Run(int numTasks, const std::function<void(int, int)> &task);
+
+  /**
+   * Return the number of threads
+   */
+  int GetNumThreads() const { return m_numThreads; }
+
+protected:
+
+  /**
+   * Queue of task indexes owned by one thread
+   */
+  struct TaskQueue {
+    std::mutex lock;
+    std::deque<int> tasks;
+  };
+
+  /**
+   * Take the next task from the front of the queue of thread idxThread,
+   * or steal one from the back of the queue of another thread.
+   * Return -1 when all the queues are empty.
+   */
+  int NextTask(int idxThread);
+
+  /**
+   * Run the tasks of each call to Run on worker thread idxThread
+   */
+  void Work(int idxThread);
+
+  // Number of threads, including the calling thread
+  int m_numThreads;
+
+  // Queues of tasks of the threads
+  std::vector<TaskQueue> m_queues;
+
+  // Task of the current call to Run, number of calls to Run so far,
+  // number of worker threads still running the current tasks,
+  // and whether the worker threads should stop
+  const std::function<void(int, int)> *m_task;
+  long m_numRuns;
+  int m_numBusyWorkers;
+  bool m_isStopped;
+
+  // Synchronization between the calling thread and the worker threads
+  std::mutex m_mutex;
+  std::condition_variable m_runStarted;
+  std::condition_variable m_runFinished;
+  std::vector<std::thread> m_threads;
+};
+
+#endif /* defined(__DependencyTreeRNN____WorkStealingScheduler__) */
@@ -122,6 +122,26 @@ int main(int argc, char *argv[]) {
                   "Penalty to add to <unk> in rescoring; normalizes type vs. token distinction", "-11");
   parser.Register("min-word-occurrence", "int",
                   "Mininum word occurrence to include word into vocabulary", "3");
+  parser.Register("batch", "int",
+                  "Number of independent sentences or unrolls forward-propagated together at test time", "1");
+  parser.Register("threads", "int",
+                  "Number of threads scoring sentences at test and validation time; when training a dependency-tree model, also the threads reading the vocabulary from the books, and training on the sentences of each book either Hogwild-style (lock-free updates, not deterministic) or, with sync-shards, computing the gradients of the shards of each step (deterministic, and independent of the number of threads)", "1");
+  parser.Register("sync-shards", "int",
+                  "Number of shards per step of synchronous data-parallel training of the dependency-tree model (0 for SGD)", "0");
+  parser.Register("sync-shard-sentences", "int",
+                  "Number of sentences per shard in synchronous data-parallel training", "4");
+  parser.Register("shared-prefix-training", "bool",
+                  "Train the dependency-tree model on the prefix trie of the unrolls of each sentence", "false");
+  parser.Register("binary-books", "bool",
+                  "Load the JSON books from pre-tokenized binary files (book.unrolls.bin), written when first parsed", "false");
+  parser.Register("prefetch-books", "int",
+                  "Number of JSON books read ahead on a background thread (0 to read each book when needed)", "1");
+  parser.Register("model-version", "int",
+                  "Format of the saved model: 20 (text header) or 21 (memory-mapped binary)", "20");
+  parser.Register("checkpoint-words", "int",
+                  "Number of training words between two checkpoints saved during an epoch to <rnnlm>.checkpoint (0 for none); a checkpoint is taken after a sentence (after a synchronous step with sync-shards, after a book with several Hogwild threads), and deferred while the previous one is being written", "0");
+  parser.Register("resume", "bool",
+                  "Resume training the dependency-tree model exactly from the last checkpoint <rnnlm>.checkpoint, if any, at the sentence (or step, or book) following it", "false");
   
   // Parse the command line arguments
   bool status = parser.Parse(argv, argc);
@@ -305,6 +325,33 @@ int main(int argc, char *argv[]) {
   // Minimum word occurrence
   int minWordOccurrence = 3;
   parser.Get("min-word-occurrence", minWordOccurrence);
+  // Batch size for testing
+  int batchSize = 1;
+  parser.Get("batch", batchSize);
+  // Number of threads for testing
+  int numThreads = 1;
+  parser.Get("threads", numThreads);
+  // Synchronous data-parallel training
+  int numSyncShards = 0;
+  parser.Get("sync-shards", numSyncShards);
+  int numSyncShardSentences = 4;
+  parser.Get("sync-shard-sentences", numSyncShardSentences);
+  bool useSharedPrefixTraining = false;
+  parser.Get("shared-prefix-training", useSharedPrefixTraining);
+  bool useBinaryBooks = false;
+  parser.Get("binary-books", useBinaryBooks);
+  int numPrefetchedBooks = 1;
+  parser.Get("prefetch-books", numPrefetchedBooks);
+  int modelVersion = 20;
+  parser.Get("model-version", modelVersion);
+  if ((modelVersion != 20) && (modelVersion != 21)) {
+    cout << "ERROR: model version should be 20 or 21\n";
+    return 1;
+  }
+  int numCheckpointWords = 0;
+  parser.Get("checkpoint-words", numCheckpointWords);
+  bool doResume = false;
+  parser.Get("resume", doResume);
   
   if (isTrainDataSet && isRnnModelSet && (featureDepLabelsType < 0)) {
     // Construct the RNN object, setting the filename, without loading anything
@@ -315,6 +362,10 @@ int main(int argc, char *argv[]) {
     model.SetValidFile(validFilename);
     // Set the sentence labels for validation or test
     model.SetSentenceLabelsFile(sentenceLabelsFilename);
+    model.SetBatchSize(batchSize);
+    model.SetNumThreads(numThreads);
+    model.SetModelVersion(modelVersion);
+    model.SetCheckpointWords(numCheckpointWords);
 
     // Set the filenames
     /*
@@ -387,8 +438,18 @@ int main(int argc, char *argv[]) {
   }
   
   if (isTrainDataSet && isRnnModelSet && (featureDepLabelsType >= 0)) {
+    // Is there a checkpoint from which to resume training?
+    bool isResuming = false;
+    if (doResume) {
+      ifstream checkpointStream(rnnModelFilename + ".checkpoint.resume");
+      if (checkpointStream) {
+        cout << "RNN checkpoint exists\n";
+        isResuming = true;
+      }
+    }
     // Construct the RNN object, setting the filename, without loading anything
-    RnnTreeLM model(rnnModelFilename, isRnnModelPresent, debugMode);
+    RnnTreeLM model(rnnModelFilename, isRnnModelPresent && !isResuming,
+                    debugMode);
 
     // Add the book names to the training corpus
     model.SetTrainFile(trainFilename);
@@ -399,6 +460,14 @@ int main(int argc, char *argv[]) {
       string fullname = pathname + filename;
       model.AddBookTrain(fullname);
     }
+    // Load the checkpoint and the state of the training
+    if (isResuming) {
+      if (!model.LoadCheckpoint()) {
+        cout << "ERROR: cannot resume training from the checkpoint\n";
+        return 1;
+      }
+      isRnnModelPresent = true;
+    }
 
     // Add the book names to the validation corpus
     model.SetValidFile(validFilename);
@@ -409,6 +478,14 @@ int main(int argc, char *argv[]) {
     }
     // Set the sentence labels for validation or test
     model.SetSentenceLabelsFile(sentenceLabelsFilename);
+    model.SetBatchSize(batchSize);
+    model.SetNumThreads(numThreads);
+    model.SetSynchronousTraining(numSyncShards, numSyncShardSentences);
+    model.SetSharedPrefixTraining(useSharedPrefixTraining);
+    model.SetBinaryBooks(useBinaryBooks);
+    model.SetNumPrefetchedBooks(numPrefetchedBooks);
+    model.SetModelVersion(modelVersion);
+    model.SetCheckpointWords(numCheckpointWords);
 
     // Read the vocabulary and word classes
     if (isClassFileSet) {
@@ -494,6 +571,10 @@ int main(int argc, char *argv[]) {
     }
     // Set the sentence labels for validation or test
     model.SetSentenceLabelsFile(sentenceLabelsFilename);
+    model.SetBatchSize(batchSize);
+    model.SetNumThreads(numThreads);
+    model.SetBinaryBooks(useBinaryBooks);
+    model.SetNumPrefetchedBooks(numPrefetchedBooks);
     // Set the type of dependency labels
     model.SetDependencyLabelType(featureDepLabelsType);
 
@@ -517,6 +598,8 @@ int main(int argc, char *argv[]) {
     model.SetValidFile(testFilename);
     // Set the sentence labels for validation or test
     model.SetSentenceLabelsFile(sentenceLabelsFilename);
+    model.SetBatchSize(batchSize);
+    model.SetNumThreads(numThreads);
 
     // Test the RNN on the test data
     vector<double> sentenceScores;
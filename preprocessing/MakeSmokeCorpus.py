@@ -0,0 +1,78 @@
+'''
+Generate a tiny synthetic corpus of dependency-parsed books,
+in the JSON format read by RnnDependencyTree, for the smoke test.
+
+arg1 = output directory
+
+The words follow a random bigram chain and the dependency trees
+are random; the corpus is the same at every run (fixed seed).
+Writes train0.json ... train2.json, valid.json, the lists of books
+train.list and valid.list, and valid.labels (the correct sentence
+of each group of 5 validation sentences).
+'''
+
+
+import json
+import os
+import random
+import sys
+
+
+def make_sentence(rng, words, successors):
+    n = rng.randint(4, 12)
+    sentence = [rng.choice(words)]
+    for _ in range(n - 1):
+        if rng.random() < 0.8:
+            sentence.append(rng.choice(successors[sentence[-1]]))
+        else:
+            sentence.append(rng.choice(words))
+    return sentence
+
+
+def make_unrolls(rng, sentence, labels):
+    # The parent of each token (but the root) is a random earlier token
+    parents = [-1] + [rng.randrange(i) for i in range(1, len(sentence))]
+    children = dict((i, []) for i in range(len(sentence)))
+    for i, p in enumerate(parents):
+        if p >= 0:
+            children[p].append(i)
+    # One unroll per leaf: the path from the root to the leaf
+    paths = []
+    for leaf in range(len(sentence)):
+        if not children[leaf]:
+            path = []
+            node = leaf
+            while node >= 0:
+                path.append(node)
+                node = parents[node]
+            paths.append(path[::-1])
+    counts = {}
+    for path in paths:
+        for t in path:
+            counts[t] = counts.get(t, 0) + 1
+    label = dict((i, rng.choice(labels)) for i in range(len(sentence)))
+    return [[[t, sentence[t], counts[t], "LEAF" if t == path[-1] else label[t]]
+             for t in path] for path in paths]
+
+
+def main(path):
+    rng = random.Random(1)
+    words = ["w%d" % i for i in range(100)]
+    labels = ["nsubj", "dobj", "amod", "prep", "det"]
+    successors = dict((w, rng.sample(words, 8)) for w in words)
+    books = [("train0", 150), ("train1", 150), ("train2", 150), ("valid", 50)]
+    for name, num_sentences in books:
+        book = [make_unrolls(rng, make_sentence(rng, words, successors), labels)
+                for _ in range(num_sentences)]
+        with open(os.path.join(path, name + ".json"), "w") as f:
+            json.dump(book, f)
+    with open(os.path.join(path, "train.list"), "w") as f:
+        f.write("train0.json\ntrain1.json\ntrain2.json\n")
+    with open(os.path.join(path, "valid.list"), "w") as f:
+        f.write("valid.json\n")
+    with open(os.path.join(path, "valid.labels"), "w") as f:
+        f.write("0\n" * 10)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1])
@@ -0,0 +1,124 @@
+#!/bin/sh
+
+# Smoke test of the training of dependency-tree models,
+# on a tiny synthetic corpus (see preprocessing/MakeSmokeCorpus.py).
+# Usage: ./smoke_test.sh [path to RnnDependencyTree]
+# Checks that:
+# - synchronous sharded training gives the same model on every run,
+#   whatever the number of threads;
+# - shared-prefix (trie) training computes the same log-probabilities
+#   as sentence-by-sentence training, and trains to a similar entropy;
+# - the binary books and the binary vocabulary give the same results
+#   as the JSON books and the text vocabulary;
+# - training resumed from a checkpoint continues to the same model.
+
+RNN=${1:-./RnnDependencyTree}
+case $RNN in
+  /*) ;;
+  *) RNN=$PWD/$RNN ;;
+esac
+SCRIPT_DIR=$(cd "$(dirname "$0")" && pwd)
+PATH_DATA=$(mktemp -d)
+trap 'rm -rf "$PATH_DATA"' EXIT
+python3 "$SCRIPT_DIR/preprocessing/MakeSmokeCorpus.py" "$PATH_DATA" || exit 1
+cd "$PATH_DATA" || exit 1
+
+NUM_FAILURES=0
+
+# Train a model NAME with the given options
+train() {
+  NAME=$1
+  shift
+  "$RNN" \
+    -rnnlm $NAME.model \
+    -train train.list \
+    -valid valid.list \
+    -sentence-labels valid.labels \
+    -path-json-books "$PATH_DATA/" \
+    -feature-labels-type 0 \
+    -hidden 16 \
+    -class 10 \
+    -bptt 4 \
+    -bptt-block 5 \
+    -min-word-occurrence 1 \
+    "$@" > $NAME.out 2>&1
+}
+
+# Report the result of a check
+check() {
+  if [ "$1" -eq 0 ]; then
+    echo "PASS: $2"
+  else
+    echo "FAIL: $2"
+    NUM_FAILURES=$((NUM_FAILURES + 1))
+  fi
+}
+
+# Last line of the log of a model matching a pattern (without the speed)
+last_log() {
+  grep "$2" $1.model.log.txt | tail -1 | sed 's/,words\/sec,.*//'
+}
+
+# Synchronous training: same model with 1 and 3 threads, and on a second run
+train sync1 -sync-shards 4 -sync-shard-sentences 2 -threads 1 -direct 1
+train sync3 -sync-shards 4 -sync-shard-sentences 2 -threads 3 -direct 1
+train sync3b -sync-shards 4 -sync-shard-sentences 2 -threads 3 -direct 1
+cmp -s sync1.model sync3.model && cmp -s sync3.model sync3b.model
+check $? "synchronous training is deterministic"
+
+# Trie training: same log-probabilities without learning (a single epoch),
+# and training entropy of the first epoch within 2% with learning
+train sentence0 -alpha 0
+train trie0 -alpha 0 -shared-prefix-training true
+[ -n "$(last_log sentence0 TRAINent)" ] && \
+[ "$(last_log sentence0 TRAINent)" = "$(last_log trie0 TRAINent)" ] && \
+[ "$(last_log sentence0 VALIDent)" = "$(last_log trie0 VALIDent)" ]
+check $? "trie training computes the same log-probabilities"
+train sentence
+train trie -shared-prefix-training true
+ENTROPY_SENTENCE=$(grep "Iter,0,.*Book,ALL" sentence.model.log.txt | sed 's/.*TRAINent,\([^,]*\),.*/\1/')
+ENTROPY_TRIE=$(grep "Iter,0,.*Book,ALL" trie.model.log.txt | sed 's/.*TRAINent,\([^,]*\),.*/\1/')
+awk -v a="$ENTROPY_SENTENCE" -v b="$ENTROPY_TRIE" \
+  'BEGIN { d = (a - b) / a; exit !((a > 0) && (d < 0.02) && (d > -0.02)) }'
+check $? "trie training matches sentence training ($ENTROPY_TRIE vs $ENTROPY_SENTENCE)"
+
+# Binary books: converted on the first run, read on the second
+train binary1 -binary-books true
+train binary2 -binary-books true
+grep -q "Read binary book" binary2.out && \
+cmp -s sentence.model binary1.model && cmp -s sentence.model binary2.model
+check $? "binary books round-trip"
+
+# Binary vocabulary: cached on the first test, read on the second
+test_model() {
+  "$RNN" \
+    -rnnlm sentence.model \
+    -test valid.list \
+    -sentence-labels valid.labels \
+    -path-json-books "$PATH_DATA/" \
+    -feature-labels-type 0 \
+    -vocab sentence.model.vocab.txt > $1.out 2>&1
+  grep -v -i "vocabulary" $1.out
+}
+SCORES_TEXT=$(test_model vocab1)
+SCORES_BINARY=$(test_model vocab2)
+grep -q "read from its binary cache" vocab2.out && \
+grep -q "Accuracy" vocab2.out && [ "$SCORES_TEXT" = "$SCORES_BINARY" ]
+check $? "binary vocabulary round-trips"
+
+# Resume: training resumed from the last checkpoint of a run ends
+# with the same validation scores and the same best model
+train full -checkpoint-words 1500
+cp full.model.checkpoint resumed.model.checkpoint
+cp full.model.checkpoint.resume resumed.model.checkpoint.resume
+train resumed -checkpoint-words 1500 -resume true
+grep -q "Resuming training" resumed.model.log.txt && \
+[ "$(last_log full VALIDent)" = "$(last_log resumed VALIDent)" ] && \
+{ [ ! -f resumed.model ] || cmp -s full.model resumed.model; }
+check $? "resumed training continues to the same model"
+
+if [ $NUM_FAILURES -ne 0 ]; then
+  echo "$NUM_FAILURES smoke test(s) failed"
+  exit 1
+fi
+echo "All smoke tests passed"